@@ -0,0 +1,148 @@
+/** Bounded-memory estimate of the blocks used by a set of extents.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include "SharedUsage.hh"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// File format: the magic "SNAPSZK1", the size k and the number of hashes
+// as 64-bit integers, then the hashes in increasing order (all in the
+// byte order of the machine).
+
+struct SketchUsage;
+
+/// K-minimum-values sketch of the 4 KiB blocks covered by the inserted
+/// extents: each block number is hashed, and only the k smallest distinct
+/// hashes are kept (8 bytes each). If the k-th smallest is a fraction u of
+/// the hash range, about (k - 1) / u blocks were inserted, with a relative
+/// standard error of 1 / sqrt(k - 2); with fewer than k blocks the count
+/// is exact. Sketches of different sets can be joined exactly, and their
+/// union tells how many blocks are shared (see sketchUsage). Blocks only
+/// partially covered by an extent count as whole.
+///
+/// Inserting an extent hashes all its blocks, but only the hashes below
+/// the current k-th smallest are kept (in a pending buffer merged lazily),
+/// so once the sketch is full almost no block costs more than hashing
+/// and a comparison. The interface is the subset of ExtentSet's needed to
+/// scan directories.
+class BlockSketch {
+public:
+  /// Estimated bytes, with the half-width of their ~95% confidence
+  /// interval (zero if exact)
+  struct Estimate {
+    __u64 bytes = 0;
+    __u64 error = 0;
+  };
+
+  /// Constructor with the default size
+  BlockSketch() : BlockSketch(s_defaultSize) {}
+
+  /// Constructor keeping the k smallest hashes (at least 3)
+  explicit BlockSketch(std::size_t k);
+
+  /// Sets the size of default-constructed sketches
+  static void configure(std::size_t defaultSize);
+
+  ////////////////////////////// Modifiers /////////////////////////////
+
+  void insert(Extent x);
+
+  inline void clear() { m_hashes.clear(); m_pending.clear(); m_threshold = ~__u64(0); }
+
+  /// Inserts all the Extents from the given file. If sync, its dirty data
+  /// is written back first, so that delayed allocations have an address.
+  void insertFromFile(const char* path, bool sync = false);
+
+  /// Inserts all the Extents from all files in path (recursively)
+  ScanSummary insertFromDir(const char* path, const ScanOptions& opts);
+
+  ////////////////////////////// Capacity //////////////////////////////
+
+  inline bool empty() const { return m_hashes.empty() && m_pending.empty(); }
+
+  /// Returns the number of hashes kept
+  inline std::size_t k() const { return m_k; }
+
+  /// Returns the number of hashes in memory, including the pending ones
+  inline std::size_t storedExtents() const { return m_hashes.size() + m_pending.size(); }
+
+  ///////////////////////////// Statistics /////////////////////////////
+
+  /// Returns the estimated bytes covered by the inserted extents
+  Estimate estimate() const;
+
+  /// Returns the estimated bytes in O(1), without merging the pending
+  /// hashes (see ScanProgress)
+  __u64 runningLength() const;
+
+  ////////////////////////////// Operators /////////////////////////////
+
+  /// In-place union/join (the result keeps the smaller size)
+  BlockSketch& operator|=(const BlockSketch& rhs);
+
+  /// Union/join
+  friend BlockSketch operator|(BlockSketch lhs, const BlockSketch& rhs) { lhs |= rhs; return lhs; }
+
+  /// Same as operator|=
+  inline BlockSketch& parallelUnion(const BlockSketch& rhs, unsigned, ThreadPool* = nullptr) { return *this |= rhs; }
+
+  ////////////////////////////// Storage ///////////////////////////////
+
+  /// Writes the sketch to a file. Throws std::runtime_error on failure.
+  void save(const std::string& path) const;
+
+  /// Reads a sketch written by save. Throws std::runtime_error on failure.
+  static BlockSketch load(const std::string& path);
+
+  friend SketchUsage sketchUsage(const std::vector<BlockSketch>& sketches);
+
+  static constexpr unsigned BLOCK_SHIFT = 12;
+
+private:
+  /// Merges the pending hashes, keeping the k smallest
+  void flush() const;
+
+  /// Returns true if the (merged) sketch holds the hash
+  bool contains(__u64 hash) const;
+
+  static std::size_t s_defaultSize;
+
+  std::size_t m_k;
+  mutable std::vector<__u64> m_hashes; ///< At most k, sorted
+  mutable std::vector<__u64> m_pending;
+  mutable __u64 m_threshold = ~__u64(0); ///< Hashes from this on cannot be among the k smallest
+};
+
+/// Estimated SharedUsage of N sketches, with the half-widths of the ~95%
+/// confidence intervals in a second SharedUsage
+struct SketchUsage {
+  explicit SketchUsage(std::size_t n) : value(n), error(n), sharedError(n) {}
+
+  SharedUsage value, error;
+  std::vector<__u64> sharedError; ///< Error of value.total[i] - value.exclusive[i]
+};
+
+/// Estimates the SharedUsage of N sketches from the k smallest hashes of
+/// their union (k being the smallest size): every value is the fraction
+/// of them found in the corresponding sketches, times the estimated size
+/// of the union. Exact if the union holds fewer than k blocks.
+SketchUsage sketchUsage(const std::vector<BlockSketch>& sketches);
@@ -0,0 +1,57 @@
+/** Low-level directory reader based on getdents64.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "UniqueFileDescriptor.hh"
+#include <linux/types.h>
+#include <vector>
+
+/// Reads the entries of a directory through its file descriptor with the
+/// getdents64 syscall, many entries per call, without building paths or
+/// calling stat (the entry type comes from d_type, when the filesystem
+/// provides it). Entries are meant to be opened with openat on fd().
+class DirectoryReader {
+public:
+  /// A directory entry. `name` is valid until the next call to next().
+  struct Entry {
+    __u64 ino;
+    unsigned char type; ///< One of the DT_* constants of <dirent.h>
+    const char* name;
+  };
+
+  /// Opens the directory at path. `buffer` is used to store the raw
+  /// entries and can be shared by readers that are not used at the same
+  /// time. Throws std::runtime_error if the directory cannot be opened.
+  DirectoryReader(const char* path, std::vector<char>& buffer);
+
+  /// Reads the next entry, skipping "." and "..". Returns false at the
+  /// end of the directory. Throws std::system_error on failure.
+  bool next(Entry& entry);
+
+  /// Returns the directory descriptor
+  inline int fd() const { return m_fd; }
+
+  /// Default size of the entry buffer
+  static constexpr std::size_t DEFAULT_BUFFER_SIZE = 1 << 17;
+
+private:
+  UniqueFileDescriptor m_fd;
+  std::vector<char>& m_buffer;
+  std::size_t m_pos = 0, m_len = 0;
+};
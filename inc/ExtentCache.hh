@@ -0,0 +1,106 @@
+/** Persistent on-disk cache of the extents of each file, to speed up
+ * rescans of unchanged trees (e.g. read-only snapshots).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Identifies a version of a file: any change to its content or metadata
+/// updates ctime, so the cached extents are valid as long as it matches.
+///
+/// A btrfs balance moves extents without touching ctime. For files of a
+/// read-only subvolume (a snapshot), the key also holds its generation,
+/// which a balance changes as it rewrites the subvolume tree. Writable
+/// subvolumes change their generation at every write, so it is left out
+/// (0) for them: the cache must be reset after a balance.
+struct ExtentCacheKey {
+  __u64 dev, ino;
+  __s64 ctimeSec;
+  __u32 ctimeNsec;
+  __u64 generation; ///< Of the read-only btrfs subvolume of the file, otherwise 0
+
+  friend bool operator==(const ExtentCacheKey& lhs, const ExtentCacheKey& rhs) {
+    return lhs.dev == rhs.dev && lhs.ino == rhs.ino && lhs.ctimeSec == rhs.ctimeSec && lhs.ctimeNsec == rhs.ctimeNsec
+           && lhs.generation == rhs.generation;
+  }
+};
+
+/// Maps ExtentCacheKey to the coalesced extents of the file, stored in a
+/// compact binary form (delta-encoded varints). The cache is loaded whole
+/// in memory at construction and written back by save(). Lookups and
+/// additions are thread-safe.
+///
+/// File format: the magic "SNAPSZC2", then for each file dev, ino, ctime
+/// seconds and nanoseconds and generation as varints, the number of
+/// extents, and for each extent the gap from the end of the previous one
+/// and its length.
+class ExtentCache {
+public:
+  /// Loads the cache from path, unless `load` is false (which discards
+  /// the old content). A missing or empty file, or one written by an older
+  /// version (whose keys have no generation), gives an empty cache. Throws
+  /// std::runtime_error if the file cannot be read, is not a cache (even
+  /// if `load` is false, so that save() never replaces it) or is
+  /// malformed.
+  explicit ExtentCache(std::string path, bool load = true);
+
+  /// If key is in the cache, appends its extents to out and returns true
+  bool lookup(const ExtentCacheKey& key, std::vector<Extent>& out) const;
+
+  /// Adds the sorted, coalesced extents of a file
+  void add(const ExtentCacheKey& key, const std::vector<Extent>& extents);
+
+  /// Writes the cache back to its file (through a temporary file and a
+  /// rename), with the entries added or looked up since construction only:
+  /// those of files no longer scanned are dropped. If maxBytes is nonzero
+  /// and the cache is larger, the added entries are kept first. Throws
+  /// std::runtime_error on failure.
+  void save(std::size_t maxBytes = 0) const;
+
+  /// Number of successful lookups
+  inline std::size_t hits() const { return m_hits; }
+
+private:
+  struct KeyHash {
+    std::size_t operator()(const ExtentCacheKey& k) const;
+  };
+
+  /// Appends the encoded entry to out
+  static void encode(std::string& out, const ExtentCacheKey& key, const std::vector<Extent>& extents);
+
+  /// Decodes an entry starting at p, advancing p. If out is not null,
+  /// appends the extents to it. Returns false if the entry is malformed.
+  static bool decode(const char*& p, const char* end, ExtentCacheKey& key, std::vector<Extent>* out);
+
+  std::string m_path;
+  std::string m_data; // Entries loaded from file
+  std::vector<std::size_t> m_offsets; // Offset of each loaded entry in m_data, plus m_data.size()
+  std::unordered_map<ExtentCacheKey, std::size_t, KeyHash> m_index; // Key -> loaded entry number
+  std::unique_ptr<std::atomic<bool>[]> m_used; // Whether each loaded entry was looked up
+  mutable std::atomic<std::size_t> m_hits{0};
+  mutable std::mutex m_mutex; // Protects m_added and m_addedIndex
+  std::string m_added; // Entries added in this run
+  std::unordered_map<ExtentCacheKey, std::size_t, KeyHash> m_addedIndex; // Key -> offset in m_added
+};
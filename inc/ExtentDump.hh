@@ -0,0 +1,119 @@
+/** Compact binary dump of an extent set, for offline set algebra.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <fstream>
+#include <iterator>
+#include <string>
+
+// Dump format: the magic "SNAPSZD1", then for each extent (sorted and
+// coalesced) the gap from the end of the previous one (or from zero) and
+// its length, as LEB128 varints. Typical extents take 4-8 bytes.
+
+/// Writes a dump, one extent at a time
+class ExtentDumpWriter {
+public:
+  /// Creates (or truncates) the file. Throws std::runtime_error on failure.
+  explicit ExtentDumpWriter(const std::string& path);
+
+  /// Closes the file, if close() was not called (errors are ignored)
+  ~ExtentDumpWriter();
+
+  /// Appends an extent. Extents must be appended in order: contiguous
+  /// ones are joined, overlapping ones throw std::domain_error.
+  void append(const Extent& x);
+
+  /// Writes all buffered data and closes the file. Throws
+  /// std::runtime_error on failure.
+  void close();
+
+private:
+  /// Encodes the pending extent into the buffer
+  void encodePending();
+
+  std::string m_path;
+  std::ofstream m_out;
+  std::string m_buffer;
+  Extent m_pending; // Last extent, not encoded yet since it may be joined
+  __u64 m_prevEnd = 0; // End of the last encoded extent
+};
+
+/// Writes all the extents of a set (ExtentSet, FlatExtentSet...) to a dump
+template <class Set>
+void writeExtentDump(const std::string& path, const Set& es) {
+  ExtentDumpWriter w(path);
+  for (const Extent& x : es)
+    w.append(x);
+  w.close();
+}
+
+
+/// Read-only, memory-mapped dump. Extents are decoded on the fly while
+/// iterating, so even huge dumps use no memory besides the page cache.
+class MappedExtentDump {
+public:
+  /// Forward iterator decoding the extents
+  class iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Extent value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Extent* pointer;
+    typedef const Extent& reference;
+
+    iterator() = default;
+    inline const Extent& operator*() const { return m_cur; }
+    inline const Extent* operator->() const { return &m_cur; }
+    /// Throws std::runtime_error if the dump is truncated
+    iterator& operator++();
+    inline iterator operator++(int) { iterator old = *this; ++*this; return old; }
+    friend bool operator==(const iterator& lhs, const iterator& rhs) { return lhs.m_p == rhs.m_p && lhs.m_atEnd == rhs.m_atEnd; }
+    friend bool operator!=(const iterator& lhs, const iterator& rhs) { return !(lhs == rhs); }
+
+  private:
+    friend class MappedExtentDump;
+    iterator(const char* p, const char* end) : m_p(p), m_end(end) { ++*this; }
+
+    const char* m_p = nullptr; // Start of the next extent to decode
+    const char* m_end = nullptr;
+    Extent m_cur;
+    bool m_atEnd = true;
+  };
+
+  /// Maps the file. Throws std::runtime_error if it cannot be opened or
+  /// it is not a dump.
+  explicit MappedExtentDump(const char* path);
+
+  /// Unmaps the file
+  ~MappedExtentDump();
+
+  MappedExtentDump(const MappedExtentDump&) = delete;
+  MappedExtentDump& operator=(const MappedExtentDump&) = delete;
+
+  iterator begin() const;
+  inline iterator end() const { return iterator(); }
+
+  /// Returns the total length of the extents (requires a full pass)
+  __u64 totalLength() const;
+
+private:
+  const char* m_data = nullptr;
+  std::size_t m_size = 0;
+};
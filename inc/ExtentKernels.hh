@@ -0,0 +1,46 @@
+/** Kernels for the set operations on sorted, coalesced extent arrays.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <cstddef>
+#include <vector>
+
+// The arrays passed to these functions must be sorted and coalesced (as
+// FlatExtentSet keeps them): the extents are disjoint and not contiguous,
+// so their ends are increasing too. Runs of extents that cannot overlap
+// the other array are skipped by comparing several ends at once with
+// AVX2 or SSE4.2 (chosen at runtime, with a scalar fallback), then by
+// galloping (exponential search), which makes very unbalanced inputs
+// cost O(small * log(large)).
+
+/// Returns the index of the first extent of p[0..n) that ends after key,
+/// or n if there is none
+std::size_t firstEndingAfter(const Extent* p, std::size_t n, __u64 key);
+
+/// Appends the intersection of a[0..na) and b[0..nb) to out, in order
+void intersectExtents(const Extent* a, std::size_t na, const Extent* b, std::size_t nb, std::vector<Extent>& out);
+
+/// Appends the union of a[0..na) and b[0..nb) to out, in order and
+/// coalesced (also with the last extent already in out)
+void unionExtents(const Extent* a, std::size_t na, const Extent* b, std::size_t nb, std::vector<Extent>& out);
+
+/// Returns the name of the kernel in use: "avx2", "sse4.2" or "scalar".
+/// The environment variable SNAPSIZE_KERNEL can force a simpler one.
+const char* extentKernelName();
@@ -0,0 +1,184 @@
+/** Alternative sources of directory trees and file extents, to run the
+ * scan pipeline without a real filesystem.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// A virtual directory tree with the extents of its files. When set in
+/// ScanOptions::source, insertFromDir walks it instead of the filesystem
+/// (with the same threads, work stealing and hardlink detection), calling
+/// it instead of getdents64 and FS_IOC_FIEMAP. Paths are absolute, and
+/// built by appending '/' and the entry name to the directory path.
+/// Implementations must be thread-safe.
+class ExtentSource {
+public:
+  /// An entry of a directory
+  struct Entry {
+    std::string name;
+    bool isDir = false;
+    __u64 id = 0;    ///< Identifies the file within the source
+    __u64 dev = 0;   ///< Device number, for hardlink detection
+    __u64 ino = 0;   ///< Inode number, for hardlink detection
+    __u64 nlink = 1; ///< Number of hardlinks to the inode
+  };
+
+  virtual ~ExtentSource() = default;
+
+  /// Returns the entry at path (whose name is the whole path). Throws
+  /// std::runtime_error if it does not exist.
+  virtual Entry find(const std::string& path) const = 0;
+
+  /// Appends the entries of the directory at path to out. Throws
+  /// std::runtime_error if it is not a directory.
+  virtual void list(const std::string& path, std::vector<Entry>& out) const = 0;
+
+  /// Appends the extents of a file returned by find or list to out
+  virtual void extents(const Entry& file, std::vector<Extent>& out) const = 0;
+};
+
+/// Creates a source from a command-line specification:
+///  - "synthetic[:KEY=VALUE,...]" for a SyntheticExtentSource
+///  - "replay:FILE" for a ReplayExtentSource reading the trace FILE
+/// Throws std::invalid_argument if the specification is not valid.
+std::unique_ptr<ExtentSource> makeExtentSource(const std::string& spec);
+
+
+/// Deterministic, generated tree, modelling a pool of snapshots of any
+/// size without storing anything. Directory "/" holds `filesPerDir` files
+/// named f0, f1... and `subdirs` directories d0, d1... recursively, until
+/// there are `files` files in total (directories form a complete tree in
+/// breadth-first order).
+///
+/// The content of each file is an independent draw: with probability
+/// `shared` it is the same as that of another random file (as files in
+/// different snapshots, or reflinked copies), otherwise it is unique.
+/// Each content has between 1 and 2 * `extentsPerFile` - 1 extents (the
+/// fragmentation), each 4 KiB to 64 KiB long, separated by gaps in a
+/// region of the disk of its own. With probability `hardlinks` a file is
+/// a hardlink to another one.
+class SyntheticExtentSource : public ExtentSource {
+public:
+  struct Params {
+    __u64 files = 1000000;
+    __u64 filesPerDir = 100;
+    __u64 subdirs = 10;
+    __u64 extentsPerFile = 4;
+    double shared = 0.5;
+    double hardlinks = 0;
+    __u64 seed = 1;
+  };
+
+  /// Throws std::invalid_argument if the parameters are not valid
+  explicit SyntheticExtentSource(const Params& params);
+
+  Entry find(const std::string& path) const override;
+  void list(const std::string& path, std::vector<Entry>& out) const override;
+  void extents(const Entry& file, std::vector<Extent>& out) const override;
+
+private:
+  /// Returns the id of the directory at path, or throws std::runtime_error
+  __u64 dirId(const std::string& path, std::size_t end) const;
+
+  /// Returns a pseudo-random number depending on the seed, x and a salt
+  __u64 hash(__u64 x, __u64 salt) const;
+
+  /// Returns a uniform number in [0, 1) depending on the seed, x and a salt
+  inline double uniform(__u64 x, __u64 salt) const { return (hash(x, salt) >> 11) * 0x1p-53; }
+
+  /// Returns the file that f is a hardlink to, or f itself
+  __u64 linkTarget(__u64 f) const;
+
+  Params m_params;
+  __u64 m_dirs; // Number of directories
+  __u64 m_region; // Bytes of disk reserved to each content
+};
+
+
+/// Tree and extents read from a trace file, as written by
+/// ExtentTraceWriter. The whole trace is loaded in memory.
+///
+/// Trace format: text, one file per line, with the fields separated by
+/// tabs: device number, inode number, number of links, extents as
+/// comma-separated START:LENGTH pairs (in bytes, possibly none) and the
+/// path. Backslashes, tabs and newlines in paths are escaped as \\, \t
+/// and \n. Relative paths are taken as relative to "/". Lines starting
+/// with '#' are ignored, except the header written by ExtentTraceWriter:
+/// traces without it (written by older versions) have no device number,
+/// taken as 0.
+class ReplayExtentSource : public ExtentSource {
+public:
+  /// Loads the trace. Throws std::runtime_error if it cannot be read or
+  /// it is malformed.
+  explicit ReplayExtentSource(const std::string& path);
+
+  Entry find(const std::string& path) const override;
+  void list(const std::string& path, std::vector<Entry>& out) const override;
+  void extents(const Entry& file, std::vector<Extent>& out) const override;
+
+  /// Returns the number of files in the trace
+  inline std::size_t files() const { return m_files.size(); }
+
+private:
+  struct File {
+    std::string name;
+    __u64 dev, ino, nlink;
+    std::size_t first, count; // Extents in m_extents
+  };
+  struct Dir {
+    std::vector<std::string> dirs; // Names of the subdirectories
+    std::vector<std::size_t> files; // Indices in m_files
+  };
+
+  /// Returns the directory at path (normalized), creating it and its
+  /// parents if needed
+  std::size_t makeDir(const std::string& path);
+
+  std::vector<File> m_files;
+  std::vector<Extent> m_extents;
+  std::vector<Dir> m_dirs;
+  std::unordered_map<std::string, std::size_t> m_dirIndex; // Normalized path -> index in m_dirs
+};
+
+
+/// Records the files scanned by insertFromDir (ScanOptions::trace) in the
+/// format read by ReplayExtentSource. Thread-safe.
+class ExtentTraceWriter : public FileExtentsRecorder {
+public:
+  /// Creates (or truncates) the file. Throws std::runtime_error on failure.
+  explicit ExtentTraceWriter(const std::string& path);
+
+  /// Appends a file with its extents
+  void add(const std::string& path, __u64 dev, __u64 ino, __u64 nlink, const std::vector<Extent>& extents) override;
+
+  /// Writes all buffered data and closes the file. Throws
+  /// std::runtime_error on failure.
+  void close();
+
+private:
+  std::string m_path;
+  std::mutex m_mutex; // Protects m_out
+  std::ofstream m_out;
+};
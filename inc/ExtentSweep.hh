@@ -0,0 +1,85 @@
+/** K-way sweep over sorted extent sequences.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+/// Sweeps N sorted, coalesced extent sequences, each given as a
+/// [begin, end) iterator pair, splitting the physical address space at
+/// every extent boundary. For each resulting segment [start, end) covered
+/// by at least one sequence, calls f(start, end, active), where active is
+/// the vector of the indices of the sequences covering it (in no
+/// particular order). Memory is O(N) and the sequences are only read
+/// forward, so they may be streamed (e.g. from a MappedExtentDump).
+template <class Iter, class F>
+void sweepExtents(std::vector<std::pair<Iter, Iter>> ranges, F f) {
+  const std::size_t n = ranges.size();
+  // Each sequence is either outside its current extent, waiting for its
+  // start, or inside it, waiting for its end. The heap holds the position
+  // of the next boundary of every sequence that is not exhausted.
+  typedef std::pair<__u64, std::size_t> Event;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+  std::vector<char> inside(n, 0);
+  std::vector<std::size_t> active; // Sequences inside an extent
+  for (std::size_t i = 0; i < n; ++i)
+    if (ranges[i].first != ranges[i].second)
+      events.emplace(ranges[i].first->start(), i);
+  __u64 pos = 0;
+  while (!events.empty()) {
+    const __u64 next = events.top().first;
+    if (!active.empty() && next > pos)
+      f(pos, next, static_cast<const std::vector<std::size_t>&>(active));
+    pos = next;
+    // Process all boundaries at this position
+    while (!events.empty() && events.top().first == pos) {
+      const std::size_t i = events.top().second;
+      events.pop();
+      std::pair<Iter, Iter>& r = ranges[i];
+      if (!inside[i]) {
+        inside[i] = 1;
+        active.push_back(i);
+        events.emplace(r.first->end(), i);
+      } else {
+        inside[i] = 0;
+        for (std::size_t a = 0; a < active.size(); ++a)
+          if (active[a] == i) {
+            active[a] = active.back();
+            active.pop_back();
+            break;
+          }
+        if (++r.first != r.second)
+          events.emplace(r.first->start(), i);
+      }
+    }
+  }
+}
+
+/// Returns the [begin, end) iterator pairs of the given sets
+template <class Set>
+std::vector<std::pair<typename Set::iterator, typename Set::iterator>> extentRanges(const std::vector<Set>& sets) {
+  std::vector<std::pair<typename Set::iterator, typename Set::iterator>> ranges;
+  ranges.reserve(sets.size());
+  for (const Set& s : sets)
+    ranges.emplace_back(s.begin(), s.end());
+  return ranges;
+}
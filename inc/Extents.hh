@@ -18,8 +18,13 @@
  * You should have received a copy of the GNU General Public License
  * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
  */
+#pragma once
 #include <linux/types.h>
+#include <atomic>
 #include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 /// Simple class to represent an extent. Zero-length extents are all
 /// represented as starting at zero.
@@ -97,6 +102,136 @@ private:
 };
 
 
+class ExtentCache;
+class ExtentSource;
+class ThreadPool;
+struct ScanStats;
+
+/// Receives the path, device, inode, number of links and extents (sorted
+/// and coalesced) of the files read by insertFromDir (see
+/// ScanOptions::trace). add may be called by several threads at once.
+class FileExtentsRecorder {
+public:
+  virtual ~FileExtentsRecorder() = default;
+
+  virtual void add(const std::string& path, __u64 dev, __u64 ino, __u64 nlink, const std::vector<Extent>& extents) = 0;
+};
+
+/// Receives the progress of insertFromDir (see ScanOptions::progress).
+/// directoryDone may be called by several threads at once.
+///
+/// Each worker thread fills its own set, and the sets are joined at the
+/// end, so the bytes covered so far are tracked as the changes of the
+/// runningLength() of the set of each worker, read by the worker itself
+/// in O(1). Their sum is exact with one thread; with more, the bytes
+/// found by several workers are counted more than once until the end.
+class ScanProgress {
+public:
+  virtual ~ScanProgress() = default;
+
+  /// Called after all the entries of directory path were read, with the
+  /// number of regular files read (or found in the cache) in it and the
+  /// change of the bytes covered by the set of the worker that read it
+  virtual void directoryDone(const std::string& path, std::size_t files, __s64 bytes) = 0;
+};
+
+/// Thrown by insertFromDir when ScanOptions::cancel is set during the
+/// scan; the set is left with the extents of all the files read so far
+class ScanCancelled : public std::runtime_error {
+public:
+  ScanCancelled() : std::runtime_error("Scan cancelled") {}
+};
+
+/// Options controlling how ExtentSet::insertFromDir walks a directory tree
+struct ScanOptions {
+  /// If true, the first error is rethrown instead of being reported on
+  /// stderr and skipped
+  bool stopOnError = false;
+
+  /// Number of worker threads (1 walks the tree serially, 0 uses one
+  /// thread per available core)
+  unsigned threads = 1;
+
+  /// If not null, the workers run on its threads (all of them, ignoring
+  /// `threads`) instead of threads started for each scan
+  ThreadPool* pool = nullptr;
+
+  /// If true, files with more than one hardlink are scanned only once,
+  /// skipping the other links to the same inode (their extents are the
+  /// same, so the result does not change)
+  bool skipHardlinks = true;
+
+  /// If true, the open, statx and close calls for the files of each
+  /// directory are batched through io_uring (the FIEMAP ioctl is still
+  /// synchronous). Falls back to plain system calls if io_uring is not
+  /// available.
+  bool ioUring = false;
+
+  /// If true, the files of each directory are opened by increasing inode
+  /// number after the whole directory is read, instead of in the order
+  /// of the entries, which has nothing to do with the position of their
+  /// metadata on disk (faster on rotational disks with a cold cache)
+  bool inodeOrder = false;
+
+  /// If not null, files found in the cache (same device, inode and ctime)
+  /// are not read again, and the extents of the others are added to it
+  ExtentCache* cache = nullptr;
+
+  /// If not null, the tree and the extents are taken from this source
+  /// instead of the filesystem (the cache and io_uring are not used)
+  const ExtentSource* source = nullptr;
+
+  /// If not null, the path, inode and extents of each file read (or found
+  /// in the cache, or passed to insertFromDir itself) are passed to it,
+  /// e.g. to an ExtentTraceWriter for replay with ReplayExtentSource
+  FileExtentsRecorder* trace = nullptr;
+
+  /// If not null, counters and timings of the scan are added to it
+  ScanStats* stats = nullptr;
+
+  /// If not null, notified as the directories are read
+  ScanProgress* progress = nullptr;
+
+  /// If not null, the scan stops as soon as it becomes true (it may be
+  /// set by another thread), and insertFromDir throws ScanCancelled
+  const std::atomic<bool>* cancel = nullptr;
+
+
+  /// If true, entries on a different filesystem than the directory passed
+  /// to insertFromDir are skipped, so mount points are not entered (not
+  /// applicable to an ExtentSource)
+  bool oneFileSystem = false;
+
+  /// Shell patterns (see fnmatch(3)) of the entries to skip: matching
+  /// directories are pruned without being opened. Patterns containing a
+  /// '/' are matched against the path (the directory passed to
+  /// insertFromDir followed by the names below it), the others against
+  /// the name of the entry.
+  std::vector<std::string> exclude;
+};
+
+/// Returns true if entry `name` of directory `dir` matches one of the
+/// patterns, as described for ScanOptions::exclude
+bool isExcluded(const std::vector<std::string>& patterns, const std::string& dir, const char* name);
+
+
+/// Counters filled by ExtentSet::insertFromDir
+struct ScanSummary {
+  std::size_t files = 0;            ///< Regular files whose extents were read
+  std::size_t hardlinksSkipped = 0; ///< Links to inodes that were already read
+  std::size_t cacheHits = 0;        ///< Files whose extents were taken from the cache
+  std::size_t errors = 0;           ///< Entries that could not be read
+
+  ScanSummary& operator+=(const ScanSummary& rhs) {
+    files += rhs.files;
+    hardlinksSkipped += rhs.hardlinksSkipped;
+    cacheHits += rhs.cacheHits;
+    errors += rhs.errors;
+    return *this;
+  }
+};
+
+
 /// Specialized class containing a set of extents. Overlapping or
 /// contiguous extents are automatically coalesced, minimizing memory
 /// usage. Extents are sorted by starting position.
@@ -111,13 +246,21 @@ public:
 
   void insert(Extent x);
 
-  inline void clear() { m_set.clear(); m_totalSizeCache = 0; }
+  inline void clear() { m_set.clear(); m_totalLength = 0; }
 
-  /// Inserts all the Extents from the given file
-  void insertFromFile(const char* path);
+  /// Inserts all the Extents from the given file. If sync, its dirty data
+  /// is written back first, so that delayed allocations have an address.
+  void insertFromFile(const char* path, bool sync = false);
 
   /// Inserts all the Extents from all files in path (recursively)
-  void insertFromDir(const char* path, bool stopOnError = false);
+  ScanSummary insertFromDir(const char* path, const ScanOptions& opts);
+
+  /// Inserts all the Extents from all files in path (recursively)
+  inline ScanSummary insertFromDir(const char* path, bool stopOnError = false) {
+    ScanOptions opts;
+    opts.stopOnError = stopOnError;
+    return insertFromDir(path, opts);
+  }
 
   ////////////////////////////// Capacity //////////////////////////////
 
@@ -125,6 +268,9 @@ public:
   inline operator bool() const { return m_set.empty(); }
   inline std::size_t size() const { return m_set.size(); }
 
+  /// Returns the number of extents in memory (same as size())
+  inline std::size_t storedExtents() const { return m_set.size(); }
+
   ////////////////////////////// Accessors /////////////////////////////
 
   /// Returns a const reference to the first element. Throws std::out_of_range if empty.
@@ -142,7 +288,19 @@ public:
 
   ///////////////////////////// Statistics /////////////////////////////
 
-  __u64 totalLength() const;
+  /// Returns the bytes covered by the set (kept up to date by insert)
+  inline __u64 totalLength() const { return m_totalLength; }
+
+  /// Same as totalLength()
+  inline __u64 parallelTotalLength(unsigned) const { return m_totalLength; }
+
+  /// Same as totalLength() (see ScanProgress)
+  inline __u64 runningLength() const { return m_totalLength; }
+
+  /// Returns the bytes covered by the set within range. Takes O(log n + k)
+  /// for the k extents overlapping it (a std::set cannot be augmented with
+  /// the lengths of its subtrees; FlatExtentSet answers in O(log n)).
+  __u64 lengthWithin(const Extent& range) const;
 
   ////////////////////////////// Operators /////////////////////////////
 
@@ -158,7 +316,16 @@ public:
   /// Union/join
   friend ExtentSet operator|(ExtentSet lhs, const ExtentSet& rhs) { lhs |= rhs; return lhs; }
 
+  /// Same as operator&, splitting the address space into ranges that are
+  /// intersected by the given number of threads (0 = one per core)
+  friend ExtentSet parallelIntersection(const ExtentSet& lhs, const ExtentSet& rhs, unsigned threads);
+
+  /// Same as operator|=, splitting the address space into ranges that are
+  /// joined by the given number of threads (0 = one per core), taken from
+  /// pool if not null
+  ExtentSet& parallelUnion(const ExtentSet& rhs, unsigned threads, ThreadPool* pool = nullptr);
+
 private:
   std::set<Extent> m_set;
-  mutable __u64 m_totalSizeCache = 0;
+  __u64 m_totalLength = 0;
 };
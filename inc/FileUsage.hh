@@ -0,0 +1,71 @@
+/** Bytes used by each file of the scanned trees.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// Records the extents of every file scanned (as the FileExtentsRecorder
+/// of ScanOptions::trace), then tells which files hold the most bytes
+/// not referenced by any other file. Each file gets a 32-bit id, and its
+/// extents are kept as flat (start, end, id) records, 24 bytes each, with
+/// 20 bytes per file plus its path: no set is built per file. A single
+/// sweep over the records sorted by start attributes every segment
+/// covered by exactly one file to it.
+class FileUsage : public FileExtentsRecorder {
+public:
+  /// Bytes of a file, as returned by top
+  struct Entry {
+    std::string path;
+    __u64 total = 0;     ///< Bytes covered by the file
+    __u64 exclusive = 0; ///< Bytes covered only by the file, i.e. freed once all its links are deleted
+    __u64 links = 1;     ///< Hardlinks of the file: if more than one, deleting path alone frees nothing
+  };
+
+  /// Records a file with its extents (may be called by several threads at
+  /// once). Throws std::length_error if the ids of 32 bits are exhausted.
+  void add(const std::string& path, __u64 dev, __u64 ino, __u64 nlink, const std::vector<Extent>& extents) override;
+
+  /// Returns the number of files recorded
+  std::size_t files() const;
+
+  /// Computes the bytes of every file recorded and returns the k with the
+  /// most exclusive bytes (ties by order of recording), in decreasing
+  /// order. Takes O(n log n) for n extents, sorting the records in place,
+  /// and O(k) memory besides 8 bytes per file.
+  std::vector<Entry> top(std::size_t k);
+
+private:
+  struct Record {
+    __u64 start, end;
+    __u32 file;
+
+    friend bool operator<(const Record& lhs, const Record& rhs) { return lhs.start < rhs.start; }
+  };
+
+  mutable std::mutex m_mutex; ///< Protects everything below
+  std::vector<Record> m_records;
+  std::vector<__u64> m_totals; ///< Bytes covered by each file
+  std::vector<__u32> m_links; ///< Hardlinks of each file (saturated)
+  std::vector<__u64> m_pathEnds; ///< End of the path of each file in m_paths
+  std::string m_paths; ///< Paths of all files, concatenated
+};
@@ -17,6 +17,7 @@
  * You should have received a copy of the GNU General Public License
  * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
  */
+#pragma once
 #include <iostream>
 
 /// Utility class to print file sizes in human-readable format
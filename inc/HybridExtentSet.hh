@@ -0,0 +1,203 @@
+/** Extent set mixing run lists and block bitmaps.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <vector>
+
+/// Drop-in alternative to ExtentSet for heavily fragmented filesystems.
+/// The address space is split into chunks of CHUNK_BLOCKS blocks of 4 KiB
+/// (256 MiB); each non-empty chunk stores either its sorted, coalesced
+/// extents (16 bytes each) or, when that would take more memory, a bitmap
+/// with one bit per block (8 KiB). Only block-aligned extents can be
+/// stored in a bitmap, so chunks with unaligned extents (which FIEMAP
+/// scans skip anyway) always keep the exact runs. Union and intersection
+/// work chunk by chunk, with word-wide bitwise operations between bitmaps.
+class HybridExtentSet {
+  /// Contents of one chunk: exactly one of runs and bits is not empty
+  struct Chunk {
+    std::vector<Extent> runs; ///< Sorted, coalesced extents, if not a bitmap
+    std::vector<__u64> bits;  ///< One bit per block, if a bitmap
+    __u64 length = 0;         ///< Bytes covered
+    bool aligned = true;      ///< True if all the runs are block-aligned
+  };
+  typedef std::map<__u64, Chunk> ChunkMap;
+
+public:
+  /// Forward iterator over the coalesced extents, joining those that
+  /// continue across chunk boundaries
+  class iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Extent value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Extent* pointer;
+    typedef const Extent& reference;
+
+    iterator() = default;
+    inline const Extent& operator*() const { return m_cur; }
+    inline const Extent* operator->() const { return &m_cur; }
+    iterator& operator++();
+    inline iterator operator++(int) { iterator old = *this; ++*this; return old; }
+    friend bool operator==(const iterator& lhs, const iterator& rhs) {
+      return lhs.m_atEnd == rhs.m_atEnd &&
+             (lhs.m_atEnd || (lhs.m_chunk == rhs.m_chunk && lhs.m_pos == rhs.m_pos && lhs.m_hasNext == rhs.m_hasNext));
+    }
+    friend bool operator!=(const iterator& lhs, const iterator& rhs) { return !(lhs == rhs); }
+
+  private:
+    friend class HybridExtentSet;
+    iterator(ChunkMap::const_iterator chunk, ChunkMap::const_iterator end) : m_chunk(chunk), m_end(end), m_atEnd(false) { ++*this; }
+
+    /// Reads the next piece of a chunk into x, returning false at the end
+    bool nextPiece(Extent& x);
+
+    ChunkMap::const_iterator m_chunk, m_end;
+    std::size_t m_pos = 0; ///< Next run, or next block of the bitmap, of m_chunk
+    Extent m_cur, m_next;  ///< Current extent, and the piece read after it
+    bool m_hasNext = false;
+    bool m_atEnd = true;
+  };
+
+  ////////////////////////////// Modifiers /////////////////////////////
+
+  void insert(Extent x);
+
+  inline void clear() { m_chunks.clear(); m_totalLength = 0; m_stored = 0; }
+
+  /// Inserts all the Extents from the given file. If sync, its dirty data
+  /// is written back first, so that delayed allocations have an address.
+  void insertFromFile(const char* path, bool sync = false);
+
+  /// Inserts all the Extents from all files in path (recursively)
+  ScanSummary insertFromDir(const char* path, const ScanOptions& opts);
+
+  /// Inserts all the Extents from all files in path (recursively)
+  inline ScanSummary insertFromDir(const char* path, bool stopOnError = false) {
+    ScanOptions opts;
+    opts.stopOnError = stopOnError;
+    return insertFromDir(path, opts);
+  }
+
+  ////////////////////////////// Capacity //////////////////////////////
+
+  inline bool empty() const { return m_chunks.empty(); }
+
+  /// Returns the number of coalesced extents (requires a full pass)
+  std::size_t size() const;
+
+  /// Returns the number of runs in memory, counting each bitmap as the
+  /// MAX_RUNS runs that would take the same memory
+  inline std::size_t storedExtents() const { return m_stored; }
+
+  /// Returns the number of chunks and of bitmap chunks
+  inline std::size_t chunks() const { return m_chunks.size(); }
+  std::size_t bitmapChunks() const;
+
+  /// Returns the memory allocated for the chunks, in bytes (including an
+  /// estimate of the map nodes)
+  std::size_t memoryUsage() const;
+
+  ////////////////////////////// Accessors /////////////////////////////
+
+  /// Returns the first element. Throws std::out_of_range if empty.
+  Extent first() const;
+
+  /// Returns the last element. Throws std::out_of_range if empty.
+  Extent last() const;
+
+  ////////////////////////////// Iterators /////////////////////////////
+
+  inline iterator begin() const { return iterator(m_chunks.begin(), m_chunks.end()); }
+  inline iterator end() const { return iterator(); }
+
+  ///////////////////////////// Statistics /////////////////////////////
+
+  /// Returns the bytes covered by the set (kept up to date by the modifiers)
+  inline __u64 totalLength() const { return m_totalLength; }
+
+  /// Same as totalLength() (see ScanProgress)
+  inline __u64 runningLength() const { return m_totalLength; }
+
+  /// Same as totalLength()
+  inline __u64 parallelTotalLength(unsigned) const { return m_totalLength; }
+
+  /// Returns the bytes covered by the set within range, using the length
+  /// of the chunks it covers completely
+  __u64 lengthWithin(const Extent& range) const;
+
+  ////////////////////////////// Operators /////////////////////////////
+
+  /// In-place intersection
+  HybridExtentSet& operator&=(const HybridExtentSet& rhs) { *this = *this & rhs; return *this; }
+
+  /// Intersection
+  friend HybridExtentSet operator&(const HybridExtentSet& lhs, const HybridExtentSet& rhs);
+
+  /// In-place union/join
+  HybridExtentSet& operator|=(const HybridExtentSet& rhs);
+
+  /// Union/join
+  friend HybridExtentSet operator|(HybridExtentSet lhs, const HybridExtentSet& rhs) { lhs |= rhs; return lhs; }
+
+  /// Same as operator&, with the chunks intersected by the given number
+  /// of threads (0 = one per core)
+  friend HybridExtentSet parallelIntersection(const HybridExtentSet& lhs, const HybridExtentSet& rhs, unsigned threads);
+
+  /// Same as operator|=, with the chunks joined by the given number of
+  /// threads (0 = one per core), taken from pool if not null
+  HybridExtentSet& parallelUnion(const HybridExtentSet& rhs, unsigned threads, ThreadPool* pool = nullptr);
+
+  /////////////////////////////// Layout ///////////////////////////////
+
+  static constexpr unsigned BLOCK_SHIFT = 12;
+  static constexpr __u64 BLOCK_SIZE = __u64(1) << BLOCK_SHIFT;
+  static constexpr unsigned CHUNK_SHIFT = BLOCK_SHIFT + 16;
+  static constexpr __u64 CHUNK_BLOCKS = __u64(1) << (CHUNK_SHIFT - BLOCK_SHIFT);
+  static constexpr std::size_t BITMAP_WORDS = CHUNK_BLOCKS / 64;
+
+  /// Chunks with more runs than this are stored as bitmaps if aligned;
+  /// bitmaps with at most half as many runs go back to run lists
+  static constexpr std::size_t MAX_RUNS = BITMAP_WORDS * sizeof(__u64) / sizeof(Extent);
+
+private:
+  /// Inserts x, which must lie within the given chunk
+  void insertIntoChunk(__u64 index, Chunk& c, Extent x);
+
+  /// Joins src into dst, and intersects a and b into out (all chunks at
+  /// the given base address), updating the chunk lengths
+  static void unionChunk(Chunk& dst, const Chunk& src, __u64 base);
+  static void intersectChunk(const Chunk& a, const Chunk& b, __u64 base, Chunk& out);
+
+  /// Converts the chunk to a bitmap or to a run list if it saves memory
+  static void normalize(Chunk& c, __u64 base);
+
+  /// Returns the stored runs the chunk is counted as by storedExtents()
+  static inline std::size_t stored(const Chunk& c) { return c.bits.empty() ? c.runs.size() : MAX_RUNS; }
+
+  /// Recomputes m_stored and m_totalLength from the chunks
+  void recount();
+
+  ChunkMap m_chunks;       ///< Non-empty chunks, by address >> CHUNK_SHIFT
+  __u64 m_totalLength = 0; ///< Sum of the lengths of the chunks
+  std::size_t m_stored = 0; ///< Sum of stored() over the chunks
+};
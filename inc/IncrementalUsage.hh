@@ -0,0 +1,74 @@
+/** Shared usage of extent sets kept up to date as extents come and go.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include "SharedUsage.hh"
+#include <cstddef>
+#include <map>
+#include <vector>
+
+/// SharedUsage of N multisets of extents, e.g. of the files of N trees,
+/// updated as groups of extents (the extents of a file) are added and
+/// removed. The address space is split into disjoint segments, each with
+/// the number of groups of every set covering it; when the sets covering
+/// a segment change, its length is moved between the entries of the
+/// usage. Adding or removing a group costs O(k log n) for k extents and n
+/// segments, however large the sets are.
+class IncrementalUsage {
+public:
+  explicit IncrementalUsage(std::size_t n) : m_usage(n) {}
+
+  /// Adds the given sorted, coalesced extents to set i
+  void add(std::size_t i, const std::vector<Extent>& extents);
+
+  /// Removes extents previously added to set i. Throws std::logic_error
+  /// if some were not added.
+  void remove(std::size_t i, const std::vector<Extent>& extents);
+
+  /// Returns the current usage
+  inline const SharedUsage& usage() const { return m_usage; }
+
+  /// Returns the number of segments in memory
+  inline std::size_t segments() const { return m_segments.size(); }
+
+private:
+  struct Segment {
+    __u64 end;
+    std::vector<__u32> counts; ///< Groups of each set covering the segment (not all zero)
+  };
+  typedef std::map<__u64, Segment> SegmentMap;
+
+  /// Adds delta (1 or -1) to the count of set i over x
+  void update(std::size_t i, const Extent& x, int delta);
+
+  /// Splits the segment containing pos, if any, so that one starts there
+  void split(__u64 pos);
+
+  /// Joins the segment at it with the following ones while they are
+  /// contiguous and have the same counts, returning the first one left
+  SegmentMap::iterator joinNext(SegmentMap::iterator it);
+
+  /// Adds (or subtracts) len bytes to the usage entries of the sets with
+  /// nonzero counts
+  void account(__u64 len, const std::vector<__u32>& counts, bool subtract);
+
+  SegmentMap m_segments; ///< Disjoint segments, by start
+  SharedUsage m_usage;
+};
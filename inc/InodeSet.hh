@@ -0,0 +1,80 @@
+/** Compact hash set of (device, inode) pairs, used to skip hardlinks to
+ * files that were already scanned.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <linux/types.h>
+#include <array>
+#include <mutex>
+#include <vector>
+
+/// Open-addressing hash set (linear probing, 16 bytes per slot, at most
+/// half full) of (st_dev, st_ino) pairs. Inode 0 marks empty slots, since
+/// no filesystem uses it for actual files. No memory is allocated until
+/// the first insertion.
+class InodeSet {
+public:
+  /// Constructor, reserving room for `capacity` pairs on the first insertion
+  explicit InodeSet(std::size_t capacity = 1024);
+
+  /// Inserts the pair. Returns false if it was already present.
+  bool insert(__u64 dev, __u64 ino);
+
+  /// Returns true if the pair is present
+  bool contains(__u64 dev, __u64 ino) const;
+
+  inline std::size_t size() const { return m_size; }
+  inline void clear() { m_slots.assign(m_slots.size(), Slot()); m_size = 0; }
+
+private:
+  struct Slot { __u64 dev = 0, ino = 0; };
+
+  /// Returns the index of the slot holding the pair, or of the empty slot
+  /// where it should be inserted
+  std::size_t find(__u64 dev, __u64 ino) const;
+
+  /// Doubles the number of slots, rehashing all pairs
+  void grow();
+
+  std::vector<Slot> m_slots; ///< Empty until the first insertion
+  std::size_t m_initialSlots;
+  std::size_t m_size = 0;
+};
+
+
+/// Thread-safe InodeSet, split in independently locked shards to keep
+/// contention low. The shards start small and are only allocated when
+/// used, so a scan without hardlinks pays nothing for them.
+class ConcurrentInodeSet {
+public:
+  ConcurrentInodeSet();
+
+  /// Inserts the pair. Returns false if it was already present.
+  bool insert(__u64 dev, __u64 ino);
+
+  std::size_t size() const;
+
+private:
+  struct Shard {
+    mutable std::mutex mutex;
+    InodeSet set;
+  };
+
+  std::array<Shard, 64> m_shards;
+};
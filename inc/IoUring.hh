@@ -0,0 +1,87 @@
+/** Minimal io_uring wrapper used to batch metadata syscalls.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <linux/io_uring.h>
+#include <linux/types.h>
+#include <cstddef>
+
+struct statx;
+
+/// Submission/completion ring set up directly with the io_uring syscalls
+/// (no liburing needed), supporting just the operations used by the
+/// directory scan. Not thread-safe: each thread needs its own ring.
+class IoUring {
+public:
+  /// Sets up a ring with room for `entries` submissions.
+  /// Throws std::system_error on failure (e.g. if io_uring is disabled).
+  explicit IoUring(unsigned entries);
+
+  /// Unmaps the rings and closes the descriptor
+  inline ~IoUring() { release(); }
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  /// Returns true if the running kernel supports io_uring with the
+  /// OPENAT, STATX and CLOSE operations
+  static bool supported();
+
+  /// Returns the number of submission slots
+  inline unsigned entries() const { return m_sqEntries; }
+
+  ////////////////////////////// Submission ////////////////////////////
+
+  /// Queues an openat(dirfd, path, flags). Returns false if the ring is full.
+  bool openat(int dirfd, const char* path, int flags, __u64 userData);
+
+  /// Queues a statx(dirfd, path, flags, mask, buf). Returns false if the ring is full.
+  bool statx(int dirfd, const char* path, int flags, unsigned mask, struct statx* buf, __u64 userData);
+
+  /// Queues a close(fd). Returns false if the ring is full.
+  bool close(int fd, __u64 userData);
+
+  /// Submits all queued operations and waits until at least `waitNr`
+  /// completions are available. Throws std::system_error on failure.
+  void submit(unsigned waitNr = 0);
+
+  ////////////////////////////// Completion ////////////////////////////
+
+  /// Pops a completion, if available, storing its user data and result
+  /// (which is -errno on failure). Returns false if there is none.
+  bool complete(__u64& userData, __s32& res);
+
+private:
+  /// Returns a zeroed submission entry, or nullptr if the ring is full
+  io_uring_sqe* nextSqe();
+
+  /// Unmaps the rings and closes the descriptor (if valid)
+  void release();
+
+  int m_fd = -1;
+  void* m_sqRing = nullptr;
+  void* m_cqRing = nullptr;
+  io_uring_sqe* m_sqes = nullptr;
+  std::size_t m_sqRingSize = 0, m_cqRingSize = 0, m_sqesSize = 0;
+  unsigned m_sqEntries = 0;
+  unsigned *m_sqHead, *m_sqTail, *m_sqMask, *m_sqArray;
+  unsigned *m_cqHead, *m_cqTail, *m_cqMask;
+  io_uring_cqe* m_cqes;
+  unsigned m_sqeTail = 0, m_submitted = 0; // Local copies of the SQ tail
+};
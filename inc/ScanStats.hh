@@ -0,0 +1,84 @@
+/** Optional instrumentation of directory scans.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <linux/types.h>
+#include <chrono>
+#include <iostream>
+
+/// Counters and timings filled by insertFromDir when ScanOptions::stats
+/// is set (each thread fills its own copy, added to it at the end). Times
+/// are in nanoseconds, summed over all threads. When stats are not
+/// requested, the only cost is a null pointer check at each measurement.
+struct ScanStats {
+  __u64 files = 0;            ///< Regular files whose extents were read
+  __u64 directories = 0;      ///< Directories read
+  __u64 hardlinksSkipped = 0; ///< Links to inodes that were already read
+  __u64 cacheHits = 0;        ///< Files whose extents were taken from the cache
+  __u64 otherSkipped = 0;     ///< Entries neither regular files nor directories
+  __u64 excludedSkipped = 0;  ///< Entries matching an exclude pattern
+  __u64 otherFsSkipped = 0;   ///< Entries on other filesystems (with oneFileSystem)
+  __u64 errors = 0;           ///< Entries that could not be read
+
+  __u64 fiemapCalls = 0;      ///< FS_IOC_FIEMAP ioctls
+  __u64 extentsReturned = 0;  ///< Extents returned by the ioctls (or the source)
+  __u64 extentsInserted = 0;  ///< Extents inserted into the sets (aligned ones)
+  __u64 bufferReallocs = 0;   ///< Reallocations of the FIEMAP buffers
+  __u64 peakSetExtents = 0;   ///< Peak extents stored by the sets (sum of the per-thread peaks)
+
+  __u64 readdirNs = 0;        ///< Opening and reading directories
+  __u64 openNs = 0;           ///< Stat, open and close of files
+  __u64 ioctlNs = 0;          ///< FS_IOC_FIEMAP ioctls (or source calls)
+  __u64 insertNs = 0;         ///< Insertion into the sets
+
+  // Filled by the caller of insertFromDir, not by the scan
+  __u64 coalescedExtents = 0; ///< Extents in the sets after the scans (sum over the sets)
+  __u64 wallNs = 0;           ///< Total elapsed time
+  long peakRssKiB = 0;        ///< Peak resident memory of the process
+
+  ScanStats& operator+=(const ScanStats& rhs);
+
+  /// Writes the stats as a JSON object on a single line
+  void writeJson(std::ostream& out) const;
+
+  /// Writes the stats in human-readable form, one per line
+  void print(std::ostream& out) const;
+
+  /// Returns a monotonic timestamp in nanoseconds
+  static inline __u64 now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+};
+
+/// Adds the time elapsed during its lifetime to a counter, if not null
+class ScanTimer {
+public:
+  explicit ScanTimer(__u64* ns) : m_ns(ns), m_start(ns ? ScanStats::now() : 0) {}
+  ~ScanTimer() {
+    if (m_ns)
+      *m_ns += ScanStats::now() - m_start;
+  }
+
+  ScanTimer(const ScanTimer&) = delete;
+  ScanTimer& operator=(const ScanTimer&) = delete;
+
+private:
+  __u64* const m_ns;
+  const __u64 m_start;
+};
@@ -0,0 +1,135 @@
+/** Reusable scanning context, the entry point of libsnapsize.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "ExtentCache.hh"
+#include "Extents.hh"
+#include "SharedUsage.hh"
+#include "ThreadPool.hh"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Scans files and directories for a process that measures them many
+/// times (e.g. a monitoring agent), instead of running de: the worker
+/// threads and the cache of the extents of unchanged files are kept
+/// across queries, progress is reported through callbacks while a query
+/// runs, and a query can be cancelled from another thread.
+///
+/// Only one query may run at a time. The callbacks are called by the
+/// worker threads, possibly at the same time.
+class Scanner : private FileExtentsRecorder, private ScanProgress {
+public:
+  /// Called for each regular file read, with its path, inode number and
+  /// sorted, coalesced extents
+  typedef std::function<void(const std::string& path, __u64 ino, const std::vector<Extent>& extents)> FileCallback;
+
+  /// Called after each directory is read, with the number of regular
+  /// files read in it and the change of the bytes covered by the set of
+  /// the worker that read it (see ScanProgress)
+  typedef std::function<void(const std::string& path, std::size_t files, __s64 bytes)> DirectoryCallback;
+
+  /// Constructor, starting opts.threads worker threads (0 = one per
+  /// core). The other options are used by every query, except trace,
+  /// progress, cancel and pool, which are managed by the Scanner.
+  explicit Scanner(const ScanOptions& opts = ScanOptions());
+
+  /// Returns the options used by the next queries (changing threads has
+  /// no effect)
+  inline ScanOptions& options() { return m_opts; }
+
+  /// Sets the callback for the files read (empty to remove it). Tracking
+  /// files makes every file be stat'ed and its extents be collected.
+  inline void onFile(FileCallback callback) { m_onFile = std::move(callback); }
+
+  /// Sets the callback for the directories read (empty to remove it)
+  inline void onDirectory(DirectoryCallback callback) { m_onDirectory = std::move(callback); }
+
+  /// Keeps the extents of the files read in a cache, so that unchanged
+  /// files (same device, inode and ctime) are not read again by the next
+  /// queries. If path is not empty, the cache is loaded from it and can
+  /// be saved with saveCache, which keeps only the entries of the files
+  /// read since. Throws std::runtime_error if the file exists and is not
+  /// a valid cache (see ExtentCache).
+  void useCache(const std::string& path = std::string());
+
+  /// Writes the cache to the file given to useCache (see ExtentCache::save)
+  void saveCache(std::size_t maxBytes = 0) const;
+
+  /// Cancels the query running in another thread, which throws
+  /// ScanCancelled (ignored if none is running)
+  inline void cancel() { m_cancel = true; }
+
+  /// Inserts the extents of the file or directory at path (not a
+  /// symlink) into es, returning the counters of the scan. Throws ScanCancelled if
+  /// cancelled, std::runtime_error if path cannot be read, and the first
+  /// error if options().stopOnError.
+  template <class Set>
+  ScanSummary scan(const std::string& path, Set& es);
+
+  /// Scans the given paths and returns their SharedUsage, adding the
+  /// counters of the scans to summary if not null. Throws like scan.
+  SharedUsage usage(const std::vector<std::string>& paths, ScanSummary* summary = nullptr);
+
+private:
+  /// Returns the options of a new query, resetting the cancellation
+  ScanOptions queryOptions();
+
+  /// Same as scan, with the options of the current query, throwing
+  /// ScanCancelled before starting if the query was cancelled
+  template <class Set>
+  ScanSummary scanPath(const std::string& path, Set& es, const ScanOptions& opts);
+
+  /// If path is a regular file (outside of an ExtentSource), appends its
+  /// extents to extents, notifies it and returns true
+  bool readFile(const std::string& path, std::vector<Extent>& extents);
+
+  void add(const std::string& path, __u64 dev, __u64 ino, __u64 nlink, const std::vector<Extent>& extents) override;
+  void directoryDone(const std::string& path, std::size_t files, __s64 bytes) override;
+
+  ScanOptions m_opts;
+  ThreadPool m_pool;
+  std::unique_ptr<ExtentCache> m_cache;
+  FileCallback m_onFile;
+  DirectoryCallback m_onDirectory;
+  std::atomic<bool> m_cancel{false};
+};
+
+template <class Set>
+ScanSummary Scanner::scan(const std::string& path, Set& es) {
+  return scanPath(path, es, queryOptions());
+}
+
+template <class Set>
+ScanSummary Scanner::scanPath(const std::string& path, Set& es, const ScanOptions& opts) {
+  if (m_cancel)
+    throw ScanCancelled();
+  std::vector<Extent> extents;
+  if (readFile(path, extents)) {
+    for (const Extent& x : extents)
+      es.insert(x);
+    ScanSummary summary;
+    summary.files = 1;
+    return summary;
+  }
+  return es.insertFromDir(path.c_str(), opts);
+}
@@ -0,0 +1,68 @@
+/** Single-pass accounting of exclusive and shared bytes among several
+ * extent sets.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "ExtentSweep.hh"
+#include <utility>
+#include <vector>
+
+/// Exclusive and shared bytes of N extent sets, as computed by sharedUsage
+struct SharedUsage {
+  explicit SharedUsage(std::size_t n) : n(n), total(n), exclusive(n), pairwise(n * n) {}
+
+  std::size_t n;                ///< Number of sets
+  std::vector<__u64> total;     ///< Bytes covered by each set
+  std::vector<__u64> exclusive; ///< Bytes covered only by each set, i.e. freed if it is deleted
+  std::vector<__u64> pairwise;  ///< Bytes shared by each pair of sets (row-major, the diagonal is total)
+  __u64 unionTotal = 0;         ///< Bytes covered by at least one set
+
+  /// Returns the bytes shared by sets i and j (total of i if i == j)
+  inline __u64 shared(std::size_t i, std::size_t j) const { return pairwise[i * n + j]; }
+};
+
+/// Computes the SharedUsage of N sorted, coalesced extent sequences, each
+/// given as a [begin, end) iterator pair, with a single sweepExtents.
+/// Apart from the result, memory is O(N).
+template <class Iter>
+SharedUsage sharedUsage(std::vector<std::pair<Iter, Iter>> ranges) {
+  const std::size_t n = ranges.size();
+  SharedUsage res(n);
+  sweepExtents(std::move(ranges), [&](__u64 start, __u64 end, const std::vector<std::size_t>& active) {
+    const __u64 len = end - start;
+    res.unionTotal += len;
+    if (active.size() == 1)
+      res.exclusive[active[0]] += len;
+    for (std::size_t a = 0; a < active.size(); ++a)
+      for (std::size_t b = a; b < active.size(); ++b) {
+        res.pairwise[active[a] * n + active[b]] += len;
+        if (a != b)
+          res.pairwise[active[b] * n + active[a]] += len;
+      }
+  });
+  for (std::size_t i = 0; i < n; ++i)
+    res.total[i] = res.pairwise[i * n + i];
+  return res;
+}
+
+/// Computes the SharedUsage of N extent sets (ExtentSet, FlatExtentSet...)
+template <class Set>
+SharedUsage sharedUsage(const std::vector<Set>& sets) {
+  return sharedUsage(extentRanges(sets));
+}
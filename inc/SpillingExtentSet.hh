@@ -0,0 +1,197 @@
+/** External-memory extent set, spilling sorted runs to disk when it
+ * exceeds a memory budget.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "ExtentDump.hh"
+#include "FlatExtentSet.hh"
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Extent set with the same interface as ExtentSet, whose memory usage is
+/// bounded. Extents are collected in a FlatExtentSet; when it grows past
+/// the memory budget, it is written as a sorted, coalesced run to a
+/// temporary extent dump and cleared. Queries merge the runs with a
+/// streaming k-way merge into a single memory-mapped run, so results are
+/// exact and only the page cache grows with the size of the set.
+/// Copies share the (immutable) runs.
+class SpillingExtentSet {
+public:
+  /// Iterator over the extents, either in memory or in the mapped run
+  class iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Extent value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Extent* pointer;
+    typedef const Extent& reference;
+
+    iterator() = default;
+    inline const Extent& operator*() const { return m_isDump ? *m_dump : *m_mem; }
+    inline const Extent* operator->() const { return &**this; }
+    inline iterator& operator++() { if (m_isDump) ++m_dump; else ++m_mem; return *this; }
+    friend bool operator==(const iterator& lhs, const iterator& rhs) {
+      return lhs.m_isDump ? lhs.m_dump == rhs.m_dump : lhs.m_mem == rhs.m_mem;
+    }
+    friend bool operator!=(const iterator& lhs, const iterator& rhs) { return !(lhs == rhs); }
+
+  private:
+    friend class SpillingExtentSet;
+    explicit iterator(FlatExtentSet::iterator it) : m_mem(it), m_isDump(false) {}
+    explicit iterator(MappedExtentDump::iterator it) : m_dump(it), m_isDump(true) {}
+
+    FlatExtentSet::iterator m_mem;
+    MappedExtentDump::iterator m_dump;
+    bool m_isDump = false;
+  };
+
+  /// Constructor with the default memory budget
+  SpillingExtentSet() : SpillingExtentSet(s_defaultMemoryLimit) {}
+
+  /// Constructor with the given memory budget in bytes
+  explicit SpillingExtentSet(std::size_t memoryLimit) : m_memoryLimit(memoryLimit) {}
+
+  /// Sets the memory budget of default-constructed sets and the directory
+  /// of the temporary files (default: $TMPDIR or /tmp)
+  static void configure(std::size_t defaultMemoryLimit, std::string tempDir = std::string());
+
+  ////////////////////////////// Modifiers /////////////////////////////
+
+  void insert(Extent x);
+
+  void clear();
+
+  /// Inserts all the Extents from the given file. If sync, its dirty data
+  /// is written back first, so that delayed allocations have an address.
+  void insertFromFile(const char* path, bool sync = false);
+
+  /// Inserts all the Extents from all files in path (recursively)
+  ScanSummary insertFromDir(const char* path, const ScanOptions& opts);
+
+  ////////////////////////////// Capacity //////////////////////////////
+
+  inline bool empty() const { return m_mem.empty() && m_runs.empty(); }
+
+  /// Returns the number of coalesced extents (requires a full pass)
+  std::size_t size() const;
+
+  /// Returns the number of extents in memory (not spilled yet)
+  inline std::size_t storedExtents() const { return m_mem.storedExtents(); }
+
+  /// Returns the number of runs on disk
+  inline std::size_t runs() const { return m_runs.size(); }
+
+  ////////////////////////////// Accessors /////////////////////////////
+
+  /// Returns the first element. Throws std::out_of_range if empty.
+  Extent first() const;
+
+  /// Returns the last element (requires a full pass). Throws std::out_of_range if empty.
+  Extent last() const;
+
+  ////////////////////////////// Iterators /////////////////////////////
+
+  /// Returns an iterator to the first extent/past the last one. Both merge
+  /// all the runs first, invalidating iterators taken before a modification.
+  iterator begin() const;
+  iterator end() const;
+
+  ///////////////////////////// Statistics /////////////////////////////
+
+  __u64 totalLength() const;
+
+  /// Same as totalLength() (the runs are streamed by a single thread)
+  inline __u64 parallelTotalLength(unsigned) const { return totalLength(); }
+
+  /// Returns the bytes covered by the set in O(1), without merging the
+  /// runs: until totalLength() is called, the lengths of the runs are
+  /// summed (counting their overlaps more than once), and the latest
+  /// insertions are missing (see ScanProgress)
+  inline __u64 runningLength() const { return m_totalValid ? m_totalSize : m_runsLength + m_mem.runningLength(); }
+
+  /// Returns the bytes covered by the set within range (streaming the
+  /// runs up to the end of the range)
+  __u64 lengthWithin(const Extent& range) const;
+
+  ////////////////////////////// Operators /////////////////////////////
+
+  /// In-place intersection
+  SpillingExtentSet& operator&=(const SpillingExtentSet& rhs) { *this = *this & rhs; return *this; }
+
+  /// Intersection (streamed, with the memory budget of lhs)
+  friend SpillingExtentSet operator&(const SpillingExtentSet& lhs, const SpillingExtentSet& rhs);
+
+  /// In-place union/join (streamed)
+  SpillingExtentSet& operator|=(const SpillingExtentSet& rhs);
+
+  /// Union/join
+  friend SpillingExtentSet operator|(SpillingExtentSet lhs, const SpillingExtentSet& rhs) { lhs |= rhs; return lhs; }
+
+  /// Same as operator& (the runs are streamed by a single thread)
+  friend SpillingExtentSet parallelIntersection(const SpillingExtentSet& lhs, const SpillingExtentSet& rhs, unsigned) {
+    return lhs & rhs;
+  }
+
+  /// Same as operator|= (the runs are streamed by a single thread)
+  inline SpillingExtentSet& parallelUnion(const SpillingExtentSet& rhs, unsigned, ThreadPool* = nullptr) {
+    return *this |= rhs;
+  }
+
+private:
+  /// A temporary dump, unlinked as soon as it is mapped (so that nothing
+  /// is left behind if the process is killed) and unmapped when the last
+  /// set referencing it is destroyed
+  struct Run {
+    explicit Run(std::string path) : path(std::move(path)) {}
+    ~Run();
+
+    /// Maps the dump written to path, then unlinks it
+    void mapAndUnlink();
+
+    std::string path; // Empty once unlinked
+    std::unique_ptr<MappedExtentDump> map;
+  };
+
+  /// Creates a new empty temporary file, returning its path
+  static std::string tempFile();
+
+  /// Writes the in-memory extents as a new run and clears them
+  void spill() const;
+
+  /// Merges all runs into one
+  void mergeRuns() const;
+
+  /// Spills the in-memory extents (if there are runs) and merges all
+  /// runs into one, so that iteration sees a single sorted sequence
+  void consolidate() const;
+
+  /// Maximum number of runs before they are merged into one
+  static constexpr std::size_t MAX_RUNS = 64;
+
+  static std::size_t s_defaultMemoryLimit;
+  static std::string s_tempDir;
+
+  std::size_t m_memoryLimit;
+  mutable FlatExtentSet m_mem;
+  mutable std::vector<std::shared_ptr<Run>> m_runs;
+  mutable __u64 m_totalSize = 0;
+  mutable bool m_totalValid = true;
+  mutable __u64 m_runsLength = 0; ///< Sum of the lengths of the runs
+};
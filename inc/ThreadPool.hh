@@ -0,0 +1,68 @@
+/** Fixed set of threads reused across parallel runs.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Threads started once and reused by every run, so that a process
+/// scanning often (e.g. through Scanner) does not start new threads each
+/// time. A run calls the same function with the indices 0 to n - 1 at
+/// once, index 0 on the calling thread, like the workers of a scan.
+class ThreadPool {
+public:
+  /// Starts threads - 1 threads (0 = one per available core, counting the
+  /// calling thread)
+  explicit ThreadPool(unsigned threads);
+
+  /// Waits for the threads to exit (there must be no run in progress)
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// Returns the number of threads, including the calling one
+  inline unsigned size() const { return m_threads.size() + 1; }
+
+  /// Calls f(0) on the calling thread and f(1)... f(n - 1) on the others
+  /// (n is at most size()), returning when all are done. The first
+  /// exception thrown is rethrown. Runs from different threads are
+  /// serialized.
+  void run(unsigned n, const std::function<void(unsigned)>& f);
+
+private:
+  /// Body of thread i (1 to size() - 1)
+  void loop(unsigned i);
+
+  std::vector<std::thread> m_threads;
+  std::mutex m_runMutex; ///< Held for the whole run
+  std::mutex m_mutex;    ///< Protects the following
+  std::condition_variable m_start, m_done;
+  const std::function<void(unsigned)>* m_task = nullptr;
+  unsigned m_n = 0;
+  unsigned m_generation = 0; ///< Incremented by each run
+  unsigned m_running = 0;    ///< Threads of the current run still busy
+  std::exception_ptr m_error;
+  bool m_exit = false;
+};
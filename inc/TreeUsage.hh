@@ -0,0 +1,100 @@
+/** Single-pass accounting of the bytes used by the subtrees of a
+ * directory tree.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "ExtentSweep.hh"
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Directories of a tree scanned by insertFromDirTree
+struct DirTree {
+  std::vector<std::size_t> parent{0}; ///< Parent of each node (the root, 0, is its own parent)
+  std::vector<std::string> names{""}; ///< Name of each directory in its parent (empty for the root)
+};
+
+/// Scans the tree of path like insertFromDir, in a single walk sharing
+/// the workers, and adds a node to tree for every directory up to
+/// maxDepth levels below path, after its parent but otherwise in no
+/// particular order. The extents of each file are
+/// inserted into sets[k] for the node k of its directory, or of its
+/// ancestor maxDepth levels below path; sets is resized to the number of
+/// nodes. Every link of a file with several hardlinks is read, whatever
+/// opts.skipHardlinks, so that each of their nodes gets its extents.
+/// Defined for ExtentSet, FlatExtentSet, SpillingExtentSet and
+/// HybridExtentSet.
+template <class Set>
+ScanSummary insertFromDirTree(const char* path, std::size_t maxDepth, const ScanOptions& opts, DirTree& tree,
+                              std::deque<Set>& sets);
+
+/// Bytes used by the subtrees of a tree of N nodes, as computed by treeUsage
+struct TreeUsage {
+  explicit TreeUsage(std::size_t n) : total(n), exclusive(n) {}
+
+  std::vector<__u64> total;     ///< Bytes covered by the subtree of each node
+  std::vector<__u64> exclusive; ///< Bytes covered only by the subtree of each node, i.e. freed if it is deleted
+};
+
+/// Computes the TreeUsage of a tree of N nodes, given the parent of each
+/// node (parent[i] < i, except for the root, 0, which is its own parent)
+/// and the sorted, coalesced extents of the files of each node (excluding
+/// those of its children), as [begin, end) iterator pairs. A single
+/// sweepExtents attributes each segment to the ancestors of the nodes
+/// covering it, and to the ancestors of their lowest common ancestor if
+/// exclusive, so the sets of the subtrees are never built. Apart from the
+/// result, memory is O(N).
+template <class Iter>
+TreeUsage treeUsage(const std::vector<std::size_t>& parent, std::vector<std::pair<Iter, Iter>> ranges) {
+  const std::size_t n = parent.size();
+  TreeUsage res(n);
+  std::vector<std::size_t> depth(n, 0);
+  for (std::size_t i = 1; i < n; ++i)
+    depth[i] = depth[parent[i]] + 1;
+  std::vector<__u64> mark(n, 0); // Segment that last added to each node
+  __u64 segment = 0;
+  sweepExtents(std::move(ranges), [&](__u64 start, __u64 end, const std::vector<std::size_t>& active) {
+    const __u64 len = end - start;
+    ++segment;
+    std::size_t lca = active[0];
+    for (std::size_t a : active) {
+      // Add to the ancestors not already reached from another node
+      for (std::size_t d = a; mark[d] != segment; d = parent[d]) {
+        mark[d] = segment;
+        res.total[d] += len;
+      }
+      std::size_t b = a;
+      while (depth[b] > depth[lca])
+        b = parent[b];
+      while (depth[lca] > depth[b])
+        lca = parent[lca];
+      while (lca != b) {
+        lca = parent[lca];
+        b = parent[b];
+      }
+    }
+    for (std::size_t d = lca;; d = parent[d]) {
+      res.exclusive[d] += len;
+      if (!d)
+        break;
+    }
+  });
+  return res;
+}
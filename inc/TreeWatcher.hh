@@ -0,0 +1,84 @@
+/** Change notifications for a directory tree, through inotify.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "UniqueFileDescriptor.hh"
+#include <linux/types.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Watches every directory of a tree with inotify, reporting the files
+/// that were written and closed, created, deleted or moved, and the
+/// directories that appeared or disappeared (whose content must then be
+/// scanned or forgotten by the caller). Entries matching the exclude
+/// patterns (see ScanOptions::exclude) are ignored. inotify does not
+/// report changes made without closing a file opened for writing (e.g.
+/// through a long-lived mmap) nor changes to the sharing of extents
+/// (deduplication, reflinks to files outside the tree).
+class TreeWatcher {
+public:
+  struct Event {
+    enum Type {
+      Changed,    ///< The file was written, created or moved here
+      Removed,    ///< The file was deleted or moved away
+      DirAdded,   ///< The directory was created or moved here (now watched)
+      DirRemoved, ///< The directory was deleted or moved away (no longer watched)
+      Overflow    ///< Events were lost: the whole tree must be scanned again
+    };
+
+    Type type;
+    std::string path; ///< Empty for Overflow
+  };
+
+  /// Constructor, watching nothing yet. Throws std::system_error if
+  /// inotify is not available.
+  TreeWatcher(const std::vector<std::string>& exclude, bool oneFileSystem);
+
+  /// Watches dir and its subdirectories, except the excluded ones and,
+  /// if oneFileSystem, those on a different filesystem than the first
+  /// directory watched. Throws std::system_error on failure (e.g. when
+  /// the limit on inotify watches is reached); unreadable subdirectories
+  /// are reported on stderr and skipped.
+  void watchTree(const std::string& dir);
+
+  /// Stops watching dir and its subdirectories
+  void unwatchTree(const std::string& dir);
+
+  /// Returns the inotify descriptor, readable when events are pending
+  inline int fd() const { return m_fd; }
+
+  /// Appends the pending events to events without blocking. Returns
+  /// false if there were none. Throws std::system_error on failure.
+  bool read(std::vector<Event>& events);
+
+  /// Returns the number of directories watched
+  inline std::size_t watches() const { return m_paths.size(); }
+
+private:
+  UniqueFileDescriptor m_fd;
+  const std::vector<std::string> m_exclude;
+  const bool m_oneFileSystem;
+  bool m_haveDev = false;
+  __u64 m_dev = 0;                              ///< Device of the first directory watched
+  std::unordered_map<int, std::string> m_paths; ///< Watched directories by descriptor
+  std::map<std::string, int> m_watches;         ///< Descriptors by directory (sorted, to find subtrees)
+  std::vector<char> m_buffer;                   ///< For DirectoryReader
+};
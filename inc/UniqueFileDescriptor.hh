@@ -17,6 +17,7 @@
  * You should have received a copy of the GNU General Public License
  * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
  */
+#pragma once
 #include <string>
 #include <utility>
 
@@ -30,6 +31,16 @@ public:
   /// Throws std::runtime_error if the return value of open is invalid.
   UniqueFileDescriptor(const char* file, int flag);
 
+  /// Constructor calling libc's openat, i.e. opening `file` relative to
+  /// the directory descriptor `dirfd`. Throws std::runtime_error if the
+  /// return value of openat is invalid.
+  UniqueFileDescriptor(int dirfd, const char* file, int flag);
+
+  /// Constructor taking ownership of a descriptor returned by another
+  /// call (e.g. inotify_init1). Throws std::system_error with errno if fd
+  /// is invalid, labelled with `what`.
+  UniqueFileDescriptor(int fd, const char* what);
+
   /// Destructor. Calls libc's close if the descriptor is valid.
   inline ~UniqueFileDescriptor() { close(); }
 
@@ -41,7 +52,7 @@ public:
 
   /// Move constructor (invalidates the argument).
   UniqueFileDescriptor(UniqueFileDescriptor&& x)
-  : m_fd(std::exchange(x.m_fd, -1)), m_path(std::exchange(x.m_path, nullptr)) {}
+  : m_fd(std::exchange(x.m_fd, -1)), m_path(std::exchange(x.m_path, std::string())) {}
 
   /// Move assignment (closes this and invalidates the argument).
   UniqueFileDescriptor& operator=(UniqueFileDescriptor&& x);
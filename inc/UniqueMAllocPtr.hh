@@ -17,6 +17,7 @@
  * You should have received a copy of the GNU General Public License
  * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
  */
+#pragma once
 #include <cstdlib>
 #include <stdexcept>
 #include <utility>
@@ -49,6 +50,7 @@ public:
     free();
     m_ptr = std::exchange(p.m_ptr, nullptr);
     m_size = std::exchange(p.m_size, 0);
+    return *this;
   }
 
   /////////////////////////////// Getters //////////////////////////////
@@ -64,15 +66,17 @@ public:
 
   /// Calls realloc. Throws std::runtime_error on failure. If force is
   /// false (default) and the requested size is smaller than the
-  /// already-allocated size, does nothing.
-  void realloc(std::size_t sz, bool force = false) {
+  /// already-allocated size, does nothing. Returns true if realloc was
+  /// called.
+  bool realloc(std::size_t sz, bool force = false) {
     if (!force && sz <= m_size)
-      return;
+      return false;
     T* ptr = (T*)std::realloc(m_ptr, sz);
-    if (ptr)
-      m_ptr = ptr;
-    else
+    if (!ptr)
       throw std::runtime_error("realloc failed");
+    m_ptr = ptr;
+    m_size = sz;
+    return true;
   }
 
   /// Calls free and set pointer to null and size to zero
@@ -0,0 +1,45 @@
+/** LEB128 variable-length encoding of unsigned integers, used by the
+ * binary extent formats.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <linux/types.h>
+#include <string>
+
+/// Appends x to out, 7 bits per byte, least significant first
+inline void putVarInt(std::string& out, __u64 x) {
+  while (x >= 0x80) {
+    out.push_back((char)(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back((char)x);
+}
+
+/// Decodes a value starting at p, advancing p. Returns false (leaving p
+/// unspecified) if the encoding is truncated at end or too long.
+inline bool getVarInt(const char*& p, const char* end, __u64& x) {
+  x = 0;
+  for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+    const unsigned char c = *p++;
+    x |= (__u64)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
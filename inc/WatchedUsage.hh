@@ -0,0 +1,117 @@
+/** Shared usage of directory trees kept up to date while they change.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "Extents.hh"
+#include "IncrementalUsage.hh"
+#include "SharedUsage.hh"
+#include "TreeWatcher.hh"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// SharedUsage of N directory trees, scanned once and then updated from
+/// the changes reported by a TreeWatcher for each of them: only the files
+/// written, created, deleted or moved are read again (with a FIEMAP), and
+/// their old and new extents are removed from and added to an
+/// IncrementalUsage, so an update costs O(changed files) instead of a
+/// whole scan. Directories appearing are scanned, and a lost event
+/// (inotify queue overflow) makes the whole tree be scanned again.
+///
+/// The extents of every file are kept in memory, once per inode (tracking
+/// the links to it), keyed by path and by device and inode number: as in
+/// the other modes, the trees must be on the same filesystem for the
+/// result to make sense.
+class WatchedUsage {
+public:
+  /// Watches and scans the given directories. The options are used for
+  /// every scan (hardlinks are always tracked; opts.source and opts.trace
+  /// must be null). Throws std::system_error if a tree
+  /// cannot be watched, and what insertFromDir throws.
+  WatchedUsage(const std::vector<std::string>& roots, const ScanOptions& opts);
+
+  /// Returns the inotify descriptors, readable when update has work to do
+  std::vector<int> fds() const;
+
+  /// Applies the pending changes without blocking. Returns the number of
+  /// files read again, scanned or forgotten.
+  std::size_t update();
+
+  /// Returns the current usage
+  inline const SharedUsage& usage() const { return m_usage.usage(); }
+
+  /// Returns the number of files known in tree i
+  inline std::size_t files(std::size_t i) const { return m_trees[i].files.size(); }
+
+  /// Returns the number of directories watched in tree i
+  inline std::size_t watches(std::size_t i) const { return m_trees[i].watcher.watches(); }
+
+private:
+  /// Device and inode number
+  typedef std::pair<__u64, __u64> InodeKey;
+
+  struct InodeKeyHash {
+    inline std::size_t operator()(const InodeKey& k) const {
+      return std::hash<__u64>()(k.second * 0x9e3779b97f4a7c15ull ^ k.first);
+    }
+  };
+
+  struct Inode {
+    std::vector<Extent> extents;
+    std::size_t links; ///< Paths in the tree linking to it
+  };
+
+  struct Tree {
+    Tree(const std::string& root, const ScanOptions& opts) : root(root), watcher(opts.exclude, opts.oneFileSystem) {}
+
+    std::string root;
+    TreeWatcher watcher;
+    std::map<std::string, InodeKey> files; ///< Inode of each regular file (sorted, to find subtrees)
+    std::unordered_map<InodeKey, Inode, InodeKeyHash> inodes;
+    __u64 dev = 0; ///< Device of the root, for ScanOptions::oneFileSystem
+  };
+
+  /// Scans dir in tree i (whose content must not be known), returning the
+  /// number of files found
+  std::size_t scan(std::size_t i, const std::string& dir);
+
+  /// Reads the file at path in tree i again, or forgets it if it is no
+  /// longer a regular file
+  void refresh(std::size_t i, const std::string& path);
+
+  /// Links path to inode ino with the given extents in tree i, replacing
+  /// the extents of the inode if it is already known
+  void link(std::size_t i, const std::string& path, const InodeKey& ino, std::vector<Extent>&& extents);
+
+  /// Forgets path in tree i, and its inode if it was the last link.
+  /// Returns true if it was known.
+  bool unlink(std::size_t i, const std::string& path);
+
+  /// Forgets dir and everything below it in tree i, returning the number
+  /// of files forgotten
+  std::size_t unlinkTree(std::size_t i, const std::string& dir);
+
+  ScanOptions m_opts;
+  std::vector<Tree> m_trees;
+  IncrementalUsage m_usage;
+};
@@ -0,0 +1,61 @@
+/** Simple work-stealing deque used to distribute directories among
+ * scanning threads.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/// Deque owned by one worker thread, which pushes and pops at the back
+/// (LIFO, depth-first, good locality), while idle workers steal from the
+/// front (FIFO, i.e. the largest pending subtrees). Items are whole
+/// directories, so a plain mutex is cheap enough compared to the work.
+template <class T> class WorkStealingDeque {
+public:
+  /// Pushes an item at the back (owner side)
+  void push(T x) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_deque.push_back(std::move(x));
+  }
+
+  /// Pops an item from the back (owner side). Returns false if empty.
+  bool pop(T& x) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_deque.empty())
+      return false;
+    x = std::move(m_deque.back());
+    m_deque.pop_back();
+    return true;
+  }
+
+  /// Steals an item from the front (thief side). Returns false if empty.
+  bool steal(T& x) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_deque.empty())
+      return false;
+    x = std::move(m_deque.front());
+    m_deque.pop_front();
+    return true;
+  }
+
+private:
+  std::mutex m_mutex;
+  std::deque<T> m_deque;
+};
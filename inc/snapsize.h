@@ -0,0 +1,110 @@
+/** C interface of libsnapsize.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SNAPSIZE_H
+#define SNAPSIZE_H
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Thin wrapper of the Scanner class (see Scanner.hh): a scanning context
+ * that keeps its threads and its cache across queries. Functions taking
+ * a scanner must not be called concurrently on the same one, except
+ * snapsize_scanner_cancel. */
+typedef struct snapsize_scanner snapsize_scanner;
+
+/* Return values */
+#define SNAPSIZE_OK 0
+#define SNAPSIZE_ERROR (-1)     /* See snapsize_last_error */
+#define SNAPSIZE_CANCELLED (-2) /* See snapsize_scanner_cancel */
+
+/* Counters of a query */
+typedef struct snapsize_summary {
+  uint64_t files;             /* Regular files whose extents were read */
+  uint64_t hardlinks_skipped; /* Links to inodes that were already read */
+  uint64_t cache_hits;        /* Files whose extents were taken from the cache */
+  uint64_t errors;            /* Entries that could not be read */
+} snapsize_summary;
+
+/* Called for each regular file read, with the bytes covered by its
+ * extents (possibly by several threads at once) */
+typedef void (*snapsize_file_callback)(void* user, const char* path, uint64_t ino, uint64_t bytes);
+
+/* Called after each directory is read, with the number of regular files
+ * read in it and the change of the bytes scanned so far (possibly by
+ * several threads at once; see ScanProgress in Extents.hh) */
+typedef void (*snapsize_directory_callback)(void* user, const char* path, uint64_t files, int64_t bytes);
+
+/* Creates a scanner with the given number of threads (0 = one per core).
+ * Returns NULL on failure. */
+snapsize_scanner* snapsize_scanner_new(unsigned threads);
+
+/* Destroys a scanner (NULL is ignored) */
+void snapsize_scanner_free(snapsize_scanner* scanner);
+
+/* Sets the callbacks (either may be NULL) and the pointer passed to them */
+void snapsize_scanner_set_callbacks(snapsize_scanner* scanner, snapsize_file_callback on_file,
+                                    snapsize_directory_callback on_directory, void* user);
+
+/* If nonzero, skips the entries on a different filesystem than the
+ * directories scanned */
+void snapsize_scanner_set_one_file_system(snapsize_scanner* scanner, int enable);
+
+/* If nonzero, reads the files of each directory by inode number (see de
+ * --inode-order) */
+void snapsize_scanner_set_inode_order(snapsize_scanner* scanner, int enable);
+
+/* Adds a pattern of entries to skip (see de --exclude). Returns
+ * SNAPSIZE_OK or SNAPSIZE_ERROR. */
+int snapsize_scanner_add_exclude(snapsize_scanner* scanner, const char* pattern);
+
+/* Keeps the extents of unchanged files across queries, loading them from
+ * path if not NULL. Returns SNAPSIZE_ERROR, leaving the file untouched,
+ * if it exists and is not a valid cache, otherwise SNAPSIZE_OK. */
+int snapsize_scanner_use_cache(snapsize_scanner* scanner, const char* path);
+
+/* Writes the cache to the path given to snapsize_scanner_use_cache, at
+ * most max_bytes if nonzero, dropping the files not read since. Returns SNAPSIZE_OK or SNAPSIZE_ERROR. */
+int snapsize_scanner_save_cache(snapsize_scanner* scanner, size_t max_bytes);
+
+/* Makes the running query return SNAPSIZE_CANCELLED as soon as possible.
+ * May be called from any thread, including the callbacks. */
+void snapsize_scanner_cancel(snapsize_scanner* scanner);
+
+/* Scans the n files or directories in paths. For each one, stores its
+ * bytes in total[i] and the bytes not shared with the others in
+ * exclusive[i]; the bytes shared by each pair go to pairwise[i * n + j],
+ * the bytes used by any of them to union_total, and the counters to
+ * summary. Any output may be NULL. Returns SNAPSIZE_OK,
+ * SNAPSIZE_CANCELLED or SNAPSIZE_ERROR. */
+int snapsize_scan(snapsize_scanner* scanner, const char* const* paths, size_t n, uint64_t* total, uint64_t* exclusive,
+                  uint64_t* pairwise, uint64_t* union_total, snapsize_summary* summary);
+
+/* Returns the message of the last error of the scanner (empty if none),
+ * valid until the next call on it */
+const char* snapsize_last_error(const snapsize_scanner* scanner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+/** Bounded-memory estimate of the blocks used by a set of extents
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "BlockSketch.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+using namespace std;
+
+static const char SKETCH_MAGIC[] = "SNAPSZK1";
+static constexpr size_t SKETCH_MAGIC_SIZE = sizeof(SKETCH_MAGIC) - 1;
+
+/// Minimum size of the pending buffer before it is merged
+static constexpr size_t MIN_PENDING = 1 << 10;
+
+size_t BlockSketch::s_defaultSize = 1 << 12;
+
+void BlockSketch::configure(size_t defaultSize) { s_defaultSize = defaultSize; }
+
+BlockSketch::BlockSketch(size_t k) : m_k(k) {
+  if (k < 3)
+    throw invalid_argument("The size of a BlockSketch must be at least 3");
+}
+
+/// Bijective mix of the bits of a block number (the SplitMix64 finalizer),
+/// so that the hashes of any set of blocks look uniformly distributed
+static inline __u64 hashBlock(__u64 b) {
+  b += 0x9e3779b97f4a7c15ULL;
+  b = (b ^ (b >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  b = (b ^ (b >> 27)) * 0x94d049bb133111ebULL;
+  return b ^ (b >> 31);
+}
+
+void BlockSketch::insert(Extent x) {
+  if (!x.length())
+    return;
+  const __u64 first = x.start() >> BLOCK_SHIFT, last = (x.end() - 1) >> BLOCK_SHIFT;
+  for (__u64 b = first;; ++b) {
+    const __u64 h = hashBlock(b);
+    if (h < m_threshold) {
+      m_pending.push_back(h);
+      if (m_pending.size() >= max(m_k, MIN_PENDING))
+        flush();
+    }
+    if (b == last)
+      break;
+  }
+}
+
+void BlockSketch::flush() const {
+  if (m_pending.empty())
+    return;
+  sort(m_pending.begin(), m_pending.end());
+  const size_t mid = m_hashes.size();
+  m_hashes.insert(m_hashes.end(), m_pending.begin(), m_pending.end());
+  m_pending.clear();
+  inplace_merge(m_hashes.begin(), m_hashes.begin() + mid, m_hashes.end());
+  m_hashes.erase(unique(m_hashes.begin(), m_hashes.end()), m_hashes.end());
+  if (m_hashes.size() >= m_k) {
+    m_hashes.resize(m_k);
+    m_threshold = m_hashes.back();
+  }
+}
+
+bool BlockSketch::contains(__u64 hash) const { return binary_search(m_hashes.begin(), m_hashes.end(), hash); }
+
+/// Returns the fraction of the hash range below the given hash (included)
+static inline double hashFraction(__u64 h) { return ldexp(double(h) + 1, -64); }
+
+BlockSketch::Estimate BlockSketch::estimate() const {
+  flush();
+  Estimate res;
+  if (m_hashes.size() < m_k) {
+    res.bytes = __u64(m_hashes.size()) << BLOCK_SHIFT;
+  } else {
+    const double blocks = (m_k - 1) / hashFraction(m_hashes.back());
+    res.bytes = llround(ldexp(blocks, BLOCK_SHIFT));
+    res.error = llround(ldexp(2 * blocks / sqrt(double(m_k - 2)), BLOCK_SHIFT));
+  }
+  return res;
+}
+
+__u64 BlockSketch::runningLength() const {
+  if (m_hashes.size() < m_k)
+    return __u64(m_hashes.size()) << BLOCK_SHIFT;
+  return llround(ldexp((m_k - 1) / hashFraction(m_hashes.back()), BLOCK_SHIFT));
+}
+
+BlockSketch& BlockSketch::operator|=(const BlockSketch& rhs) {
+  if (&rhs == this)
+    return *this;
+  rhs.flush();
+  m_k = min(m_k, rhs.m_k);
+  m_pending.insert(m_pending.end(), rhs.m_hashes.begin(), rhs.m_hashes.end());
+  flush();
+  // The k smallest of the union may be fewer than before
+  if (m_hashes.size() >= m_k) {
+    m_hashes.resize(m_k);
+    m_threshold = m_hashes.back();
+  }
+  return *this;
+}
+
+void BlockSketch::save(const string& path) const {
+  flush();
+  ofstream out(path, ios::binary | ios::trunc);
+  if (!out)
+    throw runtime_error("Could not create sketch file: " + path);
+  const __u64 header[2] = {m_k, m_hashes.size()};
+  out.write(SKETCH_MAGIC, SKETCH_MAGIC_SIZE);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(m_hashes.data()), m_hashes.size() * sizeof(__u64));
+  out.close();
+  if (!out)
+    throw runtime_error("Could not write sketch file: " + path);
+}
+
+BlockSketch BlockSketch::load(const string& path) {
+  ifstream in(path, ios::binary);
+  if (!in)
+    throw runtime_error("Could not open sketch file: " + path);
+  char magic[SKETCH_MAGIC_SIZE];
+  __u64 header[2];
+  if (!in.read(magic, SKETCH_MAGIC_SIZE) || memcmp(magic, SKETCH_MAGIC, SKETCH_MAGIC_SIZE))
+    throw runtime_error("Not a sketch: " + path);
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] < 3 || header[1] > header[0])
+    throw runtime_error("Truncated or corrupted sketch: " + path);
+  BlockSketch res(header[0]);
+  res.m_hashes.resize(header[1]);
+  if (!in.read(reinterpret_cast<char*>(res.m_hashes.data()), header[1] * sizeof(__u64)) ||
+      in.peek() != ifstream::traits_type::eof() || adjacent_find(res.m_hashes.begin(), res.m_hashes.end(), greater_equal<__u64>()) != res.m_hashes.end())
+    throw runtime_error("Truncated or corrupted sketch: " + path);
+  if (res.m_hashes.size() == res.m_k)
+    res.m_threshold = res.m_hashes.back();
+  return res;
+}
+
+SketchUsage sketchUsage(const vector<BlockSketch>& sketches) {
+  const size_t n = sketches.size();
+  SketchUsage res(n);
+  if (!n)
+    return res;
+  BlockSketch u(sketches[0].k());
+  for (const BlockSketch& s : sketches)
+    u |= s;
+  u.flush();
+  const size_t k = u.m_hashes.size();
+  if (!k)
+    return res;
+  // Count the hashes of the union in each sketch, in each sketch alone and
+  // in each pair of sketches. Any hash of the union that a sketch covers is
+  // among its k smallest, so it is found in it.
+  vector<__u64> alone(n), pairs(n * n);
+  vector<size_t> in;
+  for (__u64 h : u.m_hashes) {
+    in.clear();
+    for (size_t i = 0; i < n; ++i)
+      if (sketches[i].contains(h))
+        in.push_back(i);
+    if (in.size() == 1)
+      ++alone[in[0]];
+    for (size_t a : in)
+      for (size_t b : in)
+        ++pairs[a * n + b];
+  }
+  // A fraction c / k of the union, and its error combining the binomial
+  // error of the fraction with the one of the union size
+  const BlockSketch::Estimate total = u.estimate();
+  const double bytesPerHash = double(total.bytes) / k;
+  const bool exact = !total.error;
+  auto estimate = [&](__u64 c, __u64& value, __u64& error) {
+    value = llround(c * bytesPerHash);
+    if (exact)
+      return;
+    const double p = double(c) / k;
+    const double sampling = 2 * bytesPerHash * sqrt(c * (1 - p));
+    error = llround(hypot(sampling, p * total.error));
+  };
+  res.value.unionTotal = total.bytes;
+  res.error.unionTotal = total.error;
+  for (size_t i = 0; i < n; ++i) {
+    estimate(pairs[i * n + i], res.value.total[i], res.error.total[i]);
+    estimate(alone[i], res.value.exclusive[i], res.error.exclusive[i]);
+    __u64 shared;
+    estimate(pairs[i * n + i] - alone[i], shared, res.sharedError[i]);
+  }
+  for (size_t i = 0; i < n * n; ++i)
+    estimate(pairs[i], res.value.pairwise[i], res.error.pairwise[i]);
+  return res;
+}
@@ -0,0 +1,52 @@
+/** Low-level directory reader based on getdents64 (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "DirectoryReader.hh"
+#include <cerrno>
+#include <system_error>
+#include <dirent.h>
+#include <fcntl.h>
+
+DirectoryReader::DirectoryReader(const char* path, std::vector<char>& buffer)
+: m_fd(path, O_RDONLY | O_DIRECTORY | O_NOCTTY | O_CLOEXEC), m_buffer(buffer) {
+  if (m_buffer.size() < DEFAULT_BUFFER_SIZE)
+    m_buffer.resize(DEFAULT_BUFFER_SIZE);
+}
+
+bool DirectoryReader::next(Entry& entry) {
+  while (true) {
+    if (m_pos >= m_len) {
+      ssize_t n = getdents64(m_fd, m_buffer.data(), m_buffer.size());
+      if (n < 0)
+        throw std::system_error(errno, std::generic_category(), "getdents64 failed");
+      if (n == 0)
+        return false;
+      m_pos = 0;
+      m_len = n;
+    }
+    const dirent64* d = reinterpret_cast<const dirent64*>(m_buffer.data() + m_pos);
+    m_pos += d->d_reclen;
+    if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2])))
+      continue;
+    entry.ino = d->d_ino;
+    entry.type = d->d_type;
+    entry.name = d->d_name;
+    return true;
+  }
+}
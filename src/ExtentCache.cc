@@ -0,0 +1,174 @@
+/** Persistent on-disk cache of the extents of each file (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentCache.hh"
+#include "VarInt.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+using namespace std;
+
+static const char CACHE_MAGIC[] = "SNAPSZC2";
+static constexpr size_t CACHE_MAGIC_SIZE = sizeof(CACHE_MAGIC) - 1;
+
+/// Magic of the caches without generation, discarded
+static const char OLD_CACHE_MAGIC[] = "SNAPSZC1";
+
+size_t ExtentCache::KeyHash::operator()(const ExtentCacheKey& k) const {
+  __u64 x = k.ino ^ (k.dev * 0x9e3779b97f4a7c15ULL) ^ ((__u64)k.ctimeSec << 20) ^ k.ctimeNsec ^ (k.generation << 40);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+void ExtentCache::encode(string& out, const ExtentCacheKey& key, const vector<Extent>& extents) {
+  putVarInt(out, key.dev);
+  putVarInt(out, key.ino);
+  putVarInt(out, (__u64)key.ctimeSec);
+  putVarInt(out, key.ctimeNsec);
+  putVarInt(out, key.generation);
+  putVarInt(out, extents.size());
+  __u64 prevEnd = 0;
+  for (const Extent& x : extents) {
+    putVarInt(out, x.start() - prevEnd);
+    putVarInt(out, x.length());
+    prevEnd = x.end();
+  }
+}
+
+bool ExtentCache::decode(const char*& p, const char* end, ExtentCacheKey& key, vector<Extent>* out) {
+  __u64 sec, nsec, n;
+  if (!getVarInt(p, end, key.dev) || !getVarInt(p, end, key.ino) || !getVarInt(p, end, sec)
+      || !getVarInt(p, end, nsec) || !getVarInt(p, end, key.generation) || !getVarInt(p, end, n))
+    return false;
+  key.ctimeSec = (__s64)sec;
+  key.ctimeNsec = nsec;
+  __u64 prevEnd = 0;
+  for (__u64 i = 0; i < n; ++i) {
+    __u64 gap, len;
+    if (!getVarInt(p, end, gap) || !getVarInt(p, end, len))
+      return false;
+    if (out)
+      out->emplace_back(prevEnd + gap, len);
+    prevEnd += gap + len;
+  }
+  return true;
+}
+
+ExtentCache::ExtentCache(string path, bool load) : m_path(move(path)) {
+  // The file is checked even if it is not loaded, as save() replaces it
+  ifstream in(m_path, ios::binary);
+  if (in.is_open()) {
+    m_data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    if (in.bad())
+      throw runtime_error("Could not read cache file: " + m_path);
+    if (!m_data.empty() && m_data.compare(0, CACHE_MAGIC_SIZE, CACHE_MAGIC) != 0
+        && m_data.compare(0, CACHE_MAGIC_SIZE, OLD_CACHE_MAGIC) != 0)
+      throw runtime_error("Not a snapsize cache file: " + m_path);
+    if (!load || m_data.compare(0, CACHE_MAGIC_SIZE, OLD_CACHE_MAGIC) == 0)
+      m_data.clear(); // Discarded, or keys without generation, which may be stale
+  } else if (errno != ENOENT) {
+    throw runtime_error("Could not open cache file: " + m_path + ": " + strerror(errno));
+  }
+  if (!m_data.empty()) {
+    const char* const begin = m_data.data();
+    const char* const end = begin + m_data.size();
+    const char* p = begin + CACHE_MAGIC_SIZE;
+    ExtentCacheKey key;
+    while (p != end) {
+      m_offsets.push_back(p - begin);
+      if (!decode(p, end, key, nullptr))
+        throw runtime_error("Corrupted cache file: " + m_path);
+      m_index.emplace(key, m_offsets.size() - 1);
+    }
+  } else {
+    m_data = CACHE_MAGIC;
+  }
+  m_offsets.push_back(m_data.size());
+  m_used.reset(new atomic<bool>[m_offsets.size()]);
+  for (size_t i = 0; i < m_offsets.size(); ++i)
+    m_used[i] = false;
+}
+
+bool ExtentCache::lookup(const ExtentCacheKey& key, vector<Extent>& out) const {
+  ExtentCacheKey k;
+  auto it = m_index.find(key);
+  if (it != m_index.end()) {
+    const char* p = m_data.data() + m_offsets[it->second];
+    decode(p, m_data.data() + m_data.size(), k, &out);
+    m_used[it->second] = true;
+    ++m_hits;
+    return true;
+  }
+  lock_guard<mutex> lock(m_mutex);
+  auto jt = m_addedIndex.find(key);
+  if (jt == m_addedIndex.end())
+    return false;
+  const char* p = m_added.data() + jt->second;
+  decode(p, m_added.data() + m_added.size(), k, &out);
+  ++m_hits;
+  return true;
+}
+
+void ExtentCache::add(const ExtentCacheKey& key, const vector<Extent>& extents) {
+  lock_guard<mutex> lock(m_mutex);
+  if (m_addedIndex.emplace(key, m_added.size()).second)
+    encode(m_added, key, extents);
+}
+
+void ExtentCache::save(size_t maxBytes) const {
+  lock_guard<mutex> lock(m_mutex);
+  const string tmpPath = m_path + ".tmp";
+  ofstream out(tmpPath, ios::binary | ios::trunc);
+  if (!out)
+    throw runtime_error("Could not write cache file: " + tmpPath);
+  size_t size = CACHE_MAGIC_SIZE;
+  out.write(CACHE_MAGIC, CACHE_MAGIC_SIZE);
+  // Keep the entries added in this run first, then those used, as long as
+  // they fit in maxBytes; the others are dropped
+  vector<size_t> added;
+  for (const auto& kv : m_addedIndex)
+    added.push_back(kv.second);
+  sort(added.begin(), added.end());
+  added.push_back(m_added.size());
+  for (size_t i = 0; i + 1 < added.size(); ++i) {
+    const size_t len = added[i + 1] - added[i];
+    if (maxBytes && size + len > maxBytes)
+      continue;
+    out.write(m_added.data() + added[i], len);
+    size += len;
+  }
+  const size_t nLoaded = m_offsets.size() - 1;
+  for (size_t i = 0; i < nLoaded; ++i) {
+    if (!m_used[i])
+      continue;
+    const size_t len = m_offsets[i + 1] - m_offsets[i];
+    if (maxBytes && size + len > maxBytes)
+      continue;
+    out.write(m_data.data() + m_offsets[i], len);
+    size += len;
+  }
+  out.close();
+  if (!out || rename(tmpPath.c_str(), m_path.c_str()))
+    throw runtime_error("Could not write cache file: " + m_path);
+}
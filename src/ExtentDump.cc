@@ -0,0 +1,136 @@
+/** Compact binary dump of an extent set, for offline set algebra
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentDump.hh"
+#include "UniqueFileDescriptor.hh"
+#include "VarInt.hh"
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+static const char DUMP_MAGIC[] = "SNAPSZD1";
+static constexpr size_t DUMP_MAGIC_SIZE = sizeof(DUMP_MAGIC) - 1;
+
+/// Size of the write buffer
+static constexpr size_t DUMP_BUFFER_SIZE = 1 << 16;
+
+ExtentDumpWriter::ExtentDumpWriter(const string& path) : m_path(path), m_out(path, ios::binary | ios::trunc) {
+  if (!m_out)
+    throw runtime_error("Could not create dump file: " + path);
+  m_buffer.reserve(DUMP_BUFFER_SIZE + 32);
+  m_buffer.append(DUMP_MAGIC, DUMP_MAGIC_SIZE);
+}
+
+ExtentDumpWriter::~ExtentDumpWriter() {
+  if (m_out.is_open()) {
+    try {
+      close();
+    } catch (const exception&) {
+    }
+  }
+}
+
+void ExtentDumpWriter::encodePending() {
+  putVarInt(m_buffer, m_pending.start() - m_prevEnd);
+  putVarInt(m_buffer, m_pending.length());
+  m_prevEnd = m_pending.end();
+  if (m_buffer.size() >= DUMP_BUFFER_SIZE) {
+    m_out.write(m_buffer.data(), m_buffer.size());
+    m_buffer.clear();
+  }
+}
+
+void ExtentDumpWriter::append(const Extent& x) {
+  if (!x.length())
+    return;
+  if (m_pending.length() && x.start() <= m_pending.end()) {
+    if (x.start() < m_pending.end())
+      throw domain_error("Extents must be appended to a dump in order and without overlaps");
+    m_pending |= x;
+    return;
+  }
+  if (x.start() < m_prevEnd)
+    throw domain_error("Extents must be appended to a dump in order and without overlaps");
+  if (m_pending.length())
+    encodePending();
+  m_pending = x;
+}
+
+void ExtentDumpWriter::close() {
+  if (m_pending.length())
+    encodePending();
+  m_pending = Extent();
+  m_out.write(m_buffer.data(), m_buffer.size());
+  m_buffer.clear();
+  m_out.close();
+  if (!m_out)
+    throw runtime_error("Could not write dump file: " + m_path);
+}
+
+MappedExtentDump::iterator& MappedExtentDump::iterator::operator++() {
+  if (m_p == m_end) {
+    m_atEnd = true;
+    m_p = nullptr;
+    return *this;
+  }
+  __u64 gap, len;
+  if (!getVarInt(m_p, m_end, gap) || !getVarInt(m_p, m_end, len))
+    throw runtime_error("Truncated or corrupted extent dump");
+  m_cur = Extent(m_cur.end() + gap, len);
+  m_atEnd = false;
+  return *this;
+}
+
+MappedExtentDump::MappedExtentDump(const char* path) {
+  UniqueFileDescriptor fd(path, O_RDONLY | O_NOCTTY);
+  struct stat st;
+  if (fstat(fd, &st))
+    throw runtime_error(string("Could not stat dump file: ") + path);
+  m_size = st.st_size;
+  if (m_size < DUMP_MAGIC_SIZE)
+    throw runtime_error(string("Not an extent dump: ") + path);
+  void* p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    throw runtime_error(string("Could not map dump file: ") + path);
+  m_data = (const char*)p;
+  madvise(p, m_size, MADV_SEQUENTIAL);
+  if (memcmp(m_data, DUMP_MAGIC, DUMP_MAGIC_SIZE)) {
+    munmap(p, m_size);
+    throw runtime_error(string("Not an extent dump: ") + path);
+  }
+}
+
+MappedExtentDump::~MappedExtentDump() {
+  munmap((void*)m_data, m_size);
+}
+
+MappedExtentDump::iterator MappedExtentDump::begin() const {
+  return iterator(m_data + DUMP_MAGIC_SIZE, m_data + m_size);
+}
+
+__u64 MappedExtentDump::totalLength() const {
+  __u64 total = 0;
+  for (const Extent& x : *this)
+    total += x.length();
+  return total;
+}
@@ -0,0 +1,196 @@
+/** Kernels for the set operations on sorted, coalesced extent arrays
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentKernels.hh"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SNAPSIZE_X86_KERNELS
+#endif
+using namespace std;
+
+// The vector kernels read extents as pairs of 64-bit integers
+static_assert(sizeof(Extent) == 2 * sizeof(__u64) && is_standard_layout<Extent>::value,
+              "Extent must be laid out as {start, length}");
+
+/// Number of extents compared one batch at a time before galloping
+static constexpr size_t LINEAR_SCAN = 16;
+
+/// Number of extents compared inline before calling the kernel
+static constexpr size_t INLINE_SCAN = 4;
+
+/// Returns the index of the first extent of p[0..n) that ends after key, or n
+typedef size_t (*ScanFunction)(const Extent* p, size_t n, __u64 key);
+
+static size_t scanScalar(const Extent* p, size_t n, __u64 key) {
+  for (size_t i = 0; i < n; ++i)
+    if (p[i].end() > key)
+      return i;
+  return n;
+}
+
+#ifdef SNAPSIZE_X86_KERNELS
+// There is no unsigned 64-bit comparison before AVX-512, so both sides
+// are offset by 2^63 and compared as signed
+
+__attribute__((target("sse4.2"))) static size_t scanSse42(const Extent* p, size_t n, __u64 key) {
+  const __m128i bias = _mm_set1_epi64x((long long)(1ULL << 63));
+  const __m128i k = _mm_xor_si128(_mm_set1_epi64x((long long)key), bias);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    const __m128i x0 = _mm_loadu_si128((const __m128i*)(p + i));     // start0 length0
+    const __m128i x1 = _mm_loadu_si128((const __m128i*)(p + i + 1)); // start1 length1
+    const __m128i ends = _mm_add_epi64(_mm_unpacklo_epi64(x0, x1), _mm_unpackhi_epi64(x0, x1));
+    const int m = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_xor_si128(ends, bias), k)));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return i + scanScalar(p + i, n - i, key);
+}
+
+__attribute__((target("avx2"))) static size_t scanAvx2(const Extent* p, size_t n, __u64 key) {
+  const __m256i bias = _mm256_set1_epi64x((long long)(1ULL << 63));
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), bias);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256i x0 = _mm256_loadu_si256((const __m256i*)(p + i));     // s0 l0 | s1 l1
+    const __m256i x1 = _mm256_loadu_si256((const __m256i*)(p + i + 2)); // s2 l2 | s3 l3
+    // Unpacking works within 128-bit lanes: ends are e0 e2 | e1 e3
+    const __m256i ends = _mm256_add_epi64(_mm256_unpacklo_epi64(x0, x1), _mm256_unpackhi_epi64(x0, x1));
+    const int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_xor_si256(ends, bias), k)));
+    if (m)
+      return i + __builtin_ctz((m & 1) | (m >> 1 & 2) | (m << 1 & 4) | (m & 8));
+  }
+  return i + scanScalar(p + i, n - i, key);
+}
+#endif
+
+/// The best kernel supported by the CPU, unless SNAPSIZE_KERNEL asks for
+/// a simpler one
+struct Kernel {
+  const char* name;
+  ScanFunction scan;
+};
+
+static Kernel chooseKernel() {
+  const char* env = getenv("SNAPSIZE_KERNEL");
+  const string forced = env ? env : "";
+#ifdef SNAPSIZE_X86_KERNELS
+  __builtin_cpu_init();
+  if (forced != "scalar" && forced != "sse4.2" && __builtin_cpu_supports("avx2"))
+    return {"avx2", scanAvx2};
+  if (forced != "scalar" && __builtin_cpu_supports("sse4.2"))
+    return {"sse4.2", scanSse42};
+#endif
+  return {"scalar", scanScalar};
+}
+
+static const Kernel s_kernel = chooseKernel();
+
+const char* extentKernelName() { return s_kernel.name; }
+
+size_t firstEndingAfter(const Extent* p, size_t n, __u64 key) {
+  const size_t linear = min(n, LINEAR_SCAN);
+  size_t lo = s_kernel.scan(p, linear, key);
+  if (lo < linear || linear == n)
+    return lo;
+  // Gallop: all the extents before lo end before key
+  size_t step = LINEAR_SCAN;
+  while (lo + step < n && p[lo + step - 1].end() <= key) {
+    lo += step;
+    step *= 2;
+  }
+  const size_t hi = min(n, lo + step);
+  return partition_point(p + lo, p + hi, [key](const Extent& x) { return x.end() <= key; }) - p;
+}
+
+/// Like firstEndingAfter, but looks at the first few extents inline: with
+/// balanced inputs the runs to skip are mostly this short, and calling the
+/// kernel would cost more than the comparisons it saves
+static inline size_t skipEndingBefore(const Extent* p, size_t n, __u64 key) {
+  const size_t inlined = min(n, INLINE_SCAN);
+  for (size_t i = 0; i < inlined; ++i)
+    if (p[i].end() > key)
+      return i;
+  return inlined == n ? n : inlined + firstEndingAfter(p + inlined, n - inlined, key);
+}
+
+void intersectExtents(const Extent* a, size_t na, const Extent* b, size_t nb, vector<Extent>& out) {
+  size_t i = 0, j = 0;
+  while (i < na && j < nb) {
+    if (a[i].end() <= b[j].start()) {
+      i += skipEndingBefore(a + i, na - i, b[j].start());
+    } else if (b[j].end() <= a[i].start()) {
+      j += skipEndingBefore(b + j, nb - j, a[i].start());
+    } else {
+      // Inputs are sorted and disjoint, hence so are the intersections
+      out.push_back(Extent::FromTo(max(a[i].start(), b[j].start()), min(a[i].end(), b[j].end())));
+      // Advance the one that ends first, since the other may still
+      // overlap with the next extent
+      if (a[i].end() < b[j].end())
+        ++i;
+      else
+        ++j;
+    }
+  }
+}
+
+/// Appends p[i..k) to out, coalescing, and sets i to k. Extents after
+/// the first that is not covered by out.back() cannot join anything, so
+/// they are copied in bulk.
+static inline void appendRun(const Extent* p, size_t& i, size_t k, vector<Extent>& out) {
+  if (!out.empty()) {
+    const __u64 end = out.back().end();
+    i += skipEndingBefore(p + i, k - i, end); // Skip the extents covered by out.back()
+    if (i == k)
+      return;
+    if (p[i].start() <= end) {
+      out.back() = Extent::FromTo(out.back().start(), p[i].end());
+      ++i;
+    }
+  }
+  if (k - i > INLINE_SCAN) {
+    out.insert(out.end(), p + i, p + k);
+  } else {
+    for (; i < k; ++i)
+      out.push_back(p[i]);
+  }
+  i = k;
+}
+
+void unionExtents(const Extent* a, size_t na, const Extent* b, size_t nb, vector<Extent>& out) {
+  size_t i = 0, j = 0;
+  while (i < na && j < nb) {
+    // Take the extent that starts first, with all those following it that
+    // end before the other one starts (they cannot join it)
+    if (a[i].start() <= b[j].start()) {
+      const __u64 key = b[j].start() ? b[j].start() - 1 : 0;
+      appendRun(a, i, i + 1 + skipEndingBefore(a + i + 1, na - i - 1, key), out);
+    } else {
+      const __u64 key = a[i].start() - 1;
+      appendRun(b, j, j + 1 + skipEndingBefore(b + j + 1, nb - j - 1, key), out);
+    }
+  }
+  appendRun(a, i, na, out);
+  appendRun(b, j, nb, out);
+}
@@ -0,0 +1,213 @@
+/** Alternative sources of directory trees and file extents, to run the
+ * scan pipeline without a real filesystem (synthetic source and factory).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentSource.hh"
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+using namespace std;
+
+/// Size of the blocks of the synthetic extents
+static constexpr __u64 SYNTHETIC_BLOCK = 4096;
+
+/// Maximum length and gap of synthetic extents, in blocks
+static constexpr __u64 SYNTHETIC_MAX_BLOCKS = 16;
+
+/// Returns the next number of a splitmix64 sequence
+static inline __u64 splitMix64(__u64& state) {
+  __u64 x = (state += 0x9e3779b97f4a7c15ULL);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/// Parses an unsigned integer with an optional k, M or G (decimal) suffix
+static bool parseCount(const string& s, __u64& x) {
+  char* end;
+  errno = 0;
+  x = strtoull(s.c_str(), &end, 10);
+  if (s.empty() || !isdigit((unsigned char)s[0]) || errno)
+    return false;
+  switch (*end) {
+  case 'k': x *= 1000ULL; ++end; break;
+  case 'M': x *= 1000000ULL; ++end; break;
+  case 'G': x *= 1000000000ULL; ++end; break;
+  }
+  return !*end;
+}
+
+/// Parses a probability
+static bool parseProbability(const string& s, double& x) {
+  char* end;
+  x = strtod(s.c_str(), &end);
+  return !s.empty() && !*end && x >= 0 && x <= 1;
+}
+
+unique_ptr<ExtentSource> makeExtentSource(const string& spec) {
+  const size_t colon = spec.find(':');
+  const string kind = spec.substr(0, colon);
+  const string args = (colon == string::npos) ? string() : spec.substr(colon + 1);
+  if (kind == "replay") {
+    if (args.empty())
+      throw invalid_argument("The replay source requires a trace file");
+    return make_unique<ReplayExtentSource>(args);
+  }
+  if (kind != "synthetic")
+    throw invalid_argument("Unknown extent source: " + kind);
+  SyntheticExtentSource::Params p;
+  size_t start = 0;
+  while (start < args.size()) {
+    size_t comma = args.find(',', start);
+    if (comma == string::npos)
+      comma = args.size();
+    const string item = args.substr(start, comma - start);
+    start = comma + 1;
+    const size_t eq = item.find('=');
+    const string key = item.substr(0, eq), value = (eq == string::npos) ? string() : item.substr(eq + 1);
+    bool ok;
+    if (key == "files")
+      ok = parseCount(value, p.files);
+    else if (key == "files-per-dir")
+      ok = parseCount(value, p.filesPerDir);
+    else if (key == "subdirs")
+      ok = parseCount(value, p.subdirs);
+    else if (key == "extents")
+      ok = parseCount(value, p.extentsPerFile);
+    else if (key == "shared")
+      ok = parseProbability(value, p.shared);
+    else if (key == "hardlinks")
+      ok = parseProbability(value, p.hardlinks);
+    else if (key == "seed")
+      ok = parseCount(value, p.seed);
+    else
+      throw invalid_argument("Unknown synthetic source parameter: " + key);
+    if (!ok)
+      throw invalid_argument("Invalid value for " + key + ": " + value);
+  }
+  return make_unique<SyntheticExtentSource>(p);
+}
+
+
+SyntheticExtentSource::SyntheticExtentSource(const Params& params) : m_params(params) {
+  if (!m_params.filesPerDir || !m_params.subdirs || !m_params.extentsPerFile
+      || m_params.extentsPerFile > (1ULL << 20))
+    throw invalid_argument("files-per-dir, subdirs and extents must be positive (extents at most 2^20)");
+  m_dirs = max<__u64>(1, (m_params.files + m_params.filesPerDir - 1) / m_params.filesPerDir);
+  m_region = (2 * m_params.extentsPerFile - 1) * 2 * SYNTHETIC_MAX_BLOCKS * SYNTHETIC_BLOCK;
+  if (m_params.files > ~0ULL / m_region)
+    throw invalid_argument("Too many synthetic files and extents for a 64-bit disk");
+}
+
+__u64 SyntheticExtentSource::hash(__u64 x, __u64 salt) const {
+  __u64 state = m_params.seed * 0xd1b54a32d192ed03ULL ^ x * 0x8cb92ba72f3d8dd7ULL ^ salt;
+  return splitMix64(state);
+}
+
+__u64 SyntheticExtentSource::dirId(const string& path, size_t end) const {
+  if (path.empty() || path[0] != '/')
+    throw runtime_error("Synthetic paths must be absolute");
+  __u64 id = 0;
+  size_t pos = 0;
+  while (pos < end) {
+    size_t slash = path.find('/', pos);
+    if (slash == string::npos || slash > end)
+      slash = end;
+    const string name = path.substr(pos, slash - pos);
+    pos = slash + 1;
+    if (name.empty())
+      continue;
+    __u64 k;
+    if (name[0] != 'd' || !parseCount(name.substr(1), k) || k >= m_params.subdirs || id > m_dirs / m_params.subdirs
+        || id * m_params.subdirs + 1 + k >= m_dirs)
+      throw runtime_error("No such directory");
+    id = id * m_params.subdirs + 1 + k;
+  }
+  return id;
+}
+
+__u64 SyntheticExtentSource::linkTarget(__u64 f) const {
+  // Follow a few links, so that targets are usually not links themselves;
+  // all files reporting the same inode have the same extents anyway
+  for (int i = 0; i < 4 && uniform(f, 1) < m_params.hardlinks; ++i)
+    f = hash(f, 2) % m_params.files;
+  return f;
+}
+
+ExtentSource::Entry SyntheticExtentSource::find(const string& path) const {
+  size_t end = path.find_last_not_of('/');
+  Entry e;
+  e.name = path;
+  if (end == string::npos) { // Root
+    dirId(path, path.size());
+    e.isDir = true;
+    return e;
+  }
+  const size_t slash = path.rfind('/', end);
+  const string name = path.substr(slash + 1, end - slash);
+  if (name[0] == 'f') {
+    const __u64 dir = dirId(path, slash);
+    __u64 j;
+    if (!parseCount(name.substr(1), j) || j >= m_params.filesPerDir || dir * m_params.filesPerDir + j >= m_params.files)
+      throw runtime_error("No such file");
+    e.id = dir * m_params.filesPerDir + j;
+    e.ino = linkTarget(e.id) + 1;
+    e.nlink = (m_params.hardlinks > 0) ? 2 : 1;
+  } else {
+    dirId(path, end + 1);
+    e.isDir = true;
+  }
+  return e;
+}
+
+void SyntheticExtentSource::list(const string& path, vector<Entry>& out) const {
+  const __u64 dir = dirId(path, path.size());
+  Entry e;
+  e.isDir = true;
+  if (dir <= m_dirs / m_params.subdirs)
+    for (__u64 k = 0; k < m_params.subdirs && dir * m_params.subdirs + 1 + k < m_dirs; ++k) {
+      e.name = "d" + to_string(k);
+      out.push_back(e);
+    }
+  e.isDir = false;
+  e.nlink = (m_params.hardlinks > 0) ? 2 : 1;
+  for (__u64 j = 0, f = dir * m_params.filesPerDir; j < m_params.filesPerDir && f < m_params.files; ++j, ++f) {
+    e.name = "f" + to_string(j);
+    e.id = f;
+    e.ino = linkTarget(f) + 1;
+    out.push_back(e);
+  }
+}
+
+void SyntheticExtentSource::extents(const Entry& file, vector<Extent>& out) const {
+  // The content depends on the inode, so that hardlinks are consistent
+  __u64 c = file.ino - 1;
+  if (uniform(c, 3) < m_params.shared)
+    c = hash(c, 4) % m_params.files;
+  __u64 state = hash(c, 5);
+  const __u64 n = 1 + splitMix64(state) % (2 * m_params.extentsPerFile - 1);
+  __u64 pos = c * m_region;
+  for (__u64 i = 0; i < n; ++i) {
+    const __u64 r = splitMix64(state);
+    pos += (1 + r % SYNTHETIC_MAX_BLOCKS) * SYNTHETIC_BLOCK;
+    const __u64 len = (1 + (r >> 32) % SYNTHETIC_MAX_BLOCKS) * SYNTHETIC_BLOCK;
+    out.emplace_back(pos, len);
+    pos += len;
+  }
+}
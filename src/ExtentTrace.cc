@@ -0,0 +1,209 @@
+/** Replay of recorded traces of file extents, and their recording.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentSource.hh"
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+using namespace std;
+
+/// First line of the traces with the device number
+static const char TRACE_HEADER[] = "# snapsize extent trace 2: device, inode, links, extents (start:length,...), path";
+
+/// Returns path with a leading slash, no repeated slashes and no
+/// trailing ones (except for the root)
+static string normalizePath(const string& path) {
+  string res = "/";
+  for (char c : path)
+    if (c != '/' || res.back() != '/')
+      res += c;
+  if (res.size() > 1 && res.back() == '/')
+    res.pop_back();
+  return res;
+}
+
+/// Splits a normalized path into parent directory and name
+static void splitPath(const string& path, string& parent, string& name) {
+  const size_t slash = path.rfind('/');
+  parent = slash ? path.substr(0, slash) : "/";
+  name = path.substr(slash + 1);
+}
+
+/// Parses an unsigned decimal integer from p, advancing it
+static bool parseU64(const char*& p, __u64& x) {
+  if (*p < '0' || *p > '9')
+    return false;
+  char* end;
+  errno = 0;
+  x = strtoull(p, &end, 10);
+  p = end;
+  return !errno;
+}
+
+ReplayExtentSource::ReplayExtentSource(const string& path) {
+  ifstream in(path);
+  if (!in)
+    throw runtime_error("Could not open trace file: " + path);
+  makeDir("/");
+  string line, filePath, parent, name;
+  size_t lineNo = 0;
+  bool hasDev = false;
+  while (getline(in, line)) {
+    ++lineNo;
+    if (lineNo == 1 && line == TRACE_HEADER)
+      hasDev = true;
+    if (line.empty() || line[0] == '#')
+      continue;
+    const char* p = line.c_str();
+    File f;
+    f.first = m_extents.size();
+    f.dev = 0;
+    bool ok = (!hasDev || (parseU64(p, f.dev) && *p++ == '\t')) && parseU64(p, f.ino) && *p++ == '\t' &&
+              parseU64(p, f.nlink) && *p++ == '\t';
+    while (ok && *p != '\t') {
+      __u64 start, length;
+      ok = parseU64(p, start) && *p++ == ':' && parseU64(p, length) && (*p == ',' || *p == '\t');
+      if (ok) {
+        m_extents.emplace_back(start, length);
+        if (*p == ',')
+          ++p;
+      }
+    }
+    if (!ok || !*p++)
+      throw runtime_error("Malformed trace file " + path + " at line " + to_string(lineNo));
+    f.count = m_extents.size() - f.first;
+    filePath.clear();
+    for (; *p; ++p) {
+      if (*p == '\\' && p[1]) {
+        ++p;
+        filePath += (*p == 't') ? '\t' : (*p == 'n') ? '\n' : *p;
+      } else {
+        filePath += *p;
+      }
+    }
+    splitPath(normalizePath(filePath), parent, name);
+    if (name.empty())
+      throw runtime_error("Malformed trace file " + path + " at line " + to_string(lineNo));
+    f.name = name;
+    m_dirs[makeDir(parent)].files.push_back(m_files.size());
+    m_files.push_back(move(f));
+  }
+  if (in.bad())
+    throw runtime_error("Could not read trace file: " + path);
+}
+
+size_t ReplayExtentSource::makeDir(const string& path) {
+  auto it = m_dirIndex.find(path);
+  if (it != m_dirIndex.end())
+    return it->second;
+  if (path != "/") {
+    string parent, name;
+    splitPath(path, parent, name);
+    const size_t p = makeDir(parent);
+    m_dirs[p].dirs.push_back(name);
+  }
+  m_dirs.emplace_back();
+  m_dirIndex.emplace(path, m_dirs.size() - 1);
+  return m_dirs.size() - 1;
+}
+
+ExtentSource::Entry ReplayExtentSource::find(const string& path) const {
+  const string norm = normalizePath(path);
+  Entry e;
+  e.name = path;
+  if (m_dirIndex.count(norm)) {
+    e.isDir = true;
+    return e;
+  }
+  string parent, name;
+  splitPath(norm, parent, name);
+  auto it = m_dirIndex.find(parent);
+  if (it != m_dirIndex.end())
+    for (size_t i : m_dirs[it->second].files)
+      if (m_files[i].name == name) {
+        e.id = i;
+        e.dev = m_files[i].dev;
+        e.ino = m_files[i].ino;
+        e.nlink = m_files[i].nlink;
+        return e;
+      }
+  throw runtime_error("No such file or directory in the trace");
+}
+
+void ReplayExtentSource::list(const string& path, vector<Entry>& out) const {
+  auto it = m_dirIndex.find(normalizePath(path));
+  if (it == m_dirIndex.end())
+    throw runtime_error("No such directory in the trace");
+  const Dir& dir = m_dirs[it->second];
+  Entry e;
+  e.isDir = true;
+  for (const string& name : dir.dirs) {
+    e.name = name;
+    out.push_back(e);
+  }
+  e.isDir = false;
+  for (size_t i : dir.files) {
+    e.name = m_files[i].name;
+    e.id = i;
+    e.dev = m_files[i].dev;
+    e.ino = m_files[i].ino;
+    e.nlink = m_files[i].nlink;
+    out.push_back(e);
+  }
+}
+
+void ReplayExtentSource::extents(const Entry& file, vector<Extent>& out) const {
+  const File& f = m_files.at(file.id);
+  out.insert(out.end(), m_extents.begin() + f.first, m_extents.begin() + f.first + f.count);
+}
+
+
+ExtentTraceWriter::ExtentTraceWriter(const string& path) : m_path(path), m_out(path, ios::trunc) {
+  if (!m_out)
+    throw runtime_error("Could not create trace file: " + path);
+  m_out << TRACE_HEADER << '\n';
+}
+
+void ExtentTraceWriter::add(const string& path, __u64 dev, __u64 ino, __u64 nlink, const vector<Extent>& extents) {
+  string line = to_string(dev) + '\t' + to_string(ino) + '\t' + to_string(nlink) + '\t';
+  for (size_t i = 0; i < extents.size(); ++i) {
+    if (i)
+      line += ',';
+    line += to_string(extents[i].start()) + ':' + to_string(extents[i].length());
+  }
+  line += '\t';
+  for (char c : path) {
+    if (c == '\\' || c == '\t' || c == '\n') {
+      line += '\\';
+      line += (c == '\t') ? 't' : (c == '\n') ? 'n' : c;
+    } else {
+      line += c;
+    }
+  }
+  line += '\n';
+  lock_guard<mutex> lock(m_mutex);
+  m_out << line;
+}
+
+void ExtentTraceWriter::close() {
+  lock_guard<mutex> lock(m_mutex);
+  m_out.close();
+  if (!m_out)
+    throw runtime_error("Could not write trace file: " + m_path);
+}
@@ -19,6 +19,7 @@
  */
 #include "Extents.hh"
 #include <algorithm>
+#include <iterator>
 #include <stdexcept>
 using namespace std;
 
@@ -56,7 +57,8 @@ Extent& Extent::operator|=(const Extent& rhs) {
 
 
 void ExtentSet::insert(Extent x) {
-  m_totalSizeCache = 0; // Invalidate cache
+  if (!x.length())
+    return;
   // Find the last element that starts before x
   iterator it = m_set.lower_bound(x);
   if (it != m_set.begin()) --it;
@@ -68,12 +70,14 @@ void ExtentSet::insert(Extent x) {
       // Remove the old extent, which is now included in x. First `it`
       // is incremented, then its previous value is passed to erase,
       // which will invalidate the old value but not the new one.
+      m_totalLength -= it->length();
       m_set.erase(it++);
     } else
       ++it;
   }
   // Insert the element
   m_set.insert(x);
+  m_totalLength += x.length();
 }
 
 const Extent& ExtentSet::first() const {
@@ -88,15 +92,20 @@ const Extent& ExtentSet::last() const {
   return *(--m_set.end());
 }
 
-__u64 ExtentSet::totalLength() const {
-  if (!m_totalSizeCache)
-    for (const Extent& x : m_set)
-      m_totalSizeCache += x.length();
-  return m_totalSizeCache;
+__u64 ExtentSet::lengthWithin(const Extent& range) const {
+  if (!range.length())
+    return 0;
+  // Start from the last extent starting before the range, which may overlap it
+  iterator it = m_set.lower_bound(Extent(range.start(), 1));
+  if (it != m_set.begin() && prev(it)->end() > range.start())
+    --it;
+  __u64 res = 0;
+  for (; it != m_set.end() && it->start() < range.end(); ++it)
+    res += (*it & range).length();
+  return res;
 }
 
 ExtentSet& ExtentSet::operator&=(const ExtentSet& rhs) {
-  // No need to invalidate m_totalSizeCache (clear or assignment will do it)
   if (empty() || rhs.empty() || rhs.last().end() <= first().start() || last().end() <= rhs.first().start())
     clear();
   else
@@ -110,24 +119,25 @@ ExtentSet operator&(const ExtentSet& lhs, const ExtentSet& rhs) {
     return res;
 
   ExtentSet::iterator a = lhs.begin(), b = rhs.begin();
-  while (a != lhs.end()) { // Iterate on lhs
-    if (a->end() <= b->start()) { // a is entirely before b
-      ++a; // Advance a
-    } else {
-      // Advance b until an overlap is found
-      do {
-        if (a->overlaps(*b))
-          res.insert(*a & *b);
-        ++b;
-      } while (b != rhs.end() && b->start() < a->end());
-      if (b == rhs.end()) break;
+  while (a != lhs.end() && b != rhs.end()) {
+    // Inputs are sorted and disjoint, hence so are the intersections,
+    // which can be appended without searching for their position
+    if (a->overlaps(*b)) {
+      const Extent x = *a & *b;
+      res.m_set.emplace_hint(res.m_set.end(), x);
+      res.m_totalLength += x.length();
     }
+    // Advance the one that ends first, since the other may still overlap
+    // with the next extent of the other set
+    if (a->end() < b->end())
+      ++a;
+    else
+      ++b;
   }
   return res;
 }
 
 ExtentSet& ExtentSet::operator|=(const ExtentSet& rhs) {
-  // No need to invalidate m_totalSizeCache (insert will do it)
   for (const Extent& x : rhs)
     insert(x);
   return *this;
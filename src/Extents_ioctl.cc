@@ -18,91 +18,948 @@
  * You should have received a copy of the GNU General Public License
  * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
  */
+#include "BlockSketch.hh"
+#include "DirectoryReader.hh"
+#include "ExtentCache.hh"
+#include "ExtentSource.hh"
 #include "Extents.hh"
+#include "FlatExtentSet.hh"
+#include "HybridExtentSet.hh"
+#include "InodeSet.hh"
+#include "IoUring.hh"
+#include "ScanStats.hh"
+#include "SpillingExtentSet.hh"
+#include "ThreadPool.hh"
+#include "TreeUsage.hh"
 #include "UniqueFileDescriptor.hh"
 #include "UniqueMAllocPtr.hh"
+#include "WorkStealingDeque.hh"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstring>
+#include <exception>
 #include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <linux/btrfs.h>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
 
-static void insertFromFileImpl(const char* path, ExtentSet& es, UniqueMAllocPtr<fiemap>& fm) {
-  // Open file
-  UniqueFileDescriptor fd(path, O_RDONLY | O_NOATIME | O_NOCTTY | O_NOFOLLOW);
-  // Allocate fiemap (if necessary)
-  fm.realloc(sizeof(fiemap));
-  memset(fm, 0, sizeof(fiemap));
-  fm->fm_length = ~((decltype(fm->fm_length))0);
-  // Retrieve number of extents
-  if (ioctl(fd, FS_IOC_FIEMAP, (void*)fm) < 0)
-    throw std::runtime_error("ioctl FS_IOC_FIEMAP (1st) failed");
-  // Resize fiemap
-  fm.realloc(sizeof(fiemap) + sizeof(fiemap_extent) * fm->fm_mapped_extents);
-  memset(fm->fm_extents, 0, sizeof(fiemap_extent) * fm->fm_mapped_extents);
-  fm->fm_extent_count = fm->fm_mapped_extents;
-  fm->fm_mapped_extents = 0;
-  // Retrieve extents
-  if (ioctl(fd, FS_IOC_FIEMAP, (void*)fm) < 0)
-    throw std::runtime_error("ioctl FS_IOC_FIEMAP (2nd) failed");
-  for (decltype(fm->fm_mapped_extents) i = 0; i < fm->fm_mapped_extents; ++i) {
-    // Do not count unaligned blocks, as it typically is due to inline data,
-    // i.e. data in the same block as metadata (happens for short files), which
-    // means that typically a dummy extent is returned (block #0)
-    if (fm->fm_extents[i].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_NOT_ALIGNED)) {
-      // std::cerr << "DEBUG "
-      //   << "path=" << path
-      //   << ", i=" << i << ", n=" << fm->fm_mapped_extents
-      //   << ", logical=" << fm->fm_extents[i].fe_logical
-      //   << ", physical=" << fm->fm_extents[i].fe_physical
-      //   << ", length=" << fm->fm_extents[i].fe_length
-      //   << ", flags=" << fm->fm_extents[i].fe_flags << '\n';
-      continue;
-    }
-    es.insert(Extent(fm->fm_extents[i].fe_physical, fm->fm_extents[i].fe_length));
+/// Number of extents retrieved by each FS_IOC_FIEMAP call. Files with
+/// more extents are read in chunks, so the buffer size stays bounded
+/// (about 28 KiB) however fragmented the file is.
+static constexpr __u32 FIEMAP_CHUNK_EXTENTS = 512;
+
+/// Flags used to open regular files before calling FS_IOC_FIEMAP
+static constexpr int FILE_OPEN_FLAGS = O_RDONLY | O_NOATIME | O_NOCTTY | O_NOFOLLOW;
+
+/// Inserts all the extents of the open file fd into es, updating stats
+/// if not null. If sync, the dirty data of the file is written back first
+/// (FIEMAP_FLAG_SYNC).
+template <class Set>
+static void insertFromFd(int fd, Set& es, UniqueMAllocPtr<fiemap>& fm, ScanStats* stats = nullptr, bool sync = false) {
+  // Allocate fiemap (if necessary, the buffer is reused across files)
+  if (fm.realloc(sizeof(fiemap) + sizeof(fiemap_extent) * FIEMAP_CHUNK_EXTENTS) && stats)
+    ++stats->bufferReallocs;
+  // Retrieve extents one chunk at a time, restarting after the last
+  // logical position returned, until the last extent is found
+  __u64 start = 0;
+  while (true) {
+    memset(fm, 0, sizeof(fiemap));
+    fm->fm_start = start;
+    fm->fm_length = ~((decltype(fm->fm_length))0) - start;
+    fm->fm_extent_count = FIEMAP_CHUNK_EXTENTS;
+    if (sync && !start)
+      fm->fm_flags = FIEMAP_FLAG_SYNC;
+    {
+      ScanTimer timer(stats ? &stats->ioctlNs : nullptr);
+      if (ioctl(fd, FS_IOC_FIEMAP, (void*)fm) < 0)
+        throw std::runtime_error("ioctl FS_IOC_FIEMAP failed");
+    }
+    const __u32 n = fm->fm_mapped_extents;
+    ScanTimer timer(stats ? &stats->insertNs : nullptr);
+    __u32 inserted = 0;
+    for (__u32 i = 0; i < n; ++i) {
+      // Do not count unaligned blocks, as it typically is due to inline data,
+      // i.e. data in the same block as metadata (happens for short files), which
+      // means that typically a dummy extent is returned (block #0)
+      if (fm->fm_extents[i].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_NOT_ALIGNED))
+        continue;
+      es.insert(Extent(fm->fm_extents[i].fe_physical, fm->fm_extents[i].fe_length));
+      ++inserted;
+    }
+    if (stats) {
+      ++stats->fiemapCalls;
+      stats->extentsReturned += n;
+      stats->extentsInserted += inserted;
+    }
+    // A partially filled buffer also means there is nothing left
+    if (n < FIEMAP_CHUNK_EXTENTS || (fm->fm_extents[n - 1].fe_flags & FIEMAP_EXTENT_LAST))
+      break;
+    start = fm->fm_extents[n - 1].fe_logical + fm->fm_extents[n - 1].fe_length;
   }
 }
 
-void ExtentSet::insertFromFile(const char* path) {
-  UniqueMAllocPtr<fiemap> fm(sizeof(fiemap));
-  if (!std::filesystem::is_symlink(path))
-    insertFromFileImpl(path, *this, fm);
+template <class Set>
+static void insertFromFileImpl(const char* path, Set& es, UniqueMAllocPtr<fiemap>& fm, bool sync) {
+  UniqueFileDescriptor fd(path, FILE_OPEN_FLAGS);
+  insertFromFd(fd, es, fm, nullptr, sync);
+}
+
+/// Collects the extents of a single file, to be stored in the cache
+struct ExtentRecorder {
+  std::vector<Extent>& extents;
+
+  inline void insert(Extent x) { extents.push_back(x); }
+
+  /// Sorts the extents and joins the contiguous ones
+  void coalesce() {
+    std::sort(extents.begin(), extents.end());
+    std::size_t w = 0;
+    for (std::size_t r = 0; r < extents.size(); ++r) {
+      if (w && extents[w - 1].end() >= extents[r].start())
+        extents[w - 1] |= extents[r];
+      else
+        extents[w++] = extents[r];
+    }
+    extents.resize(w);
+  }
+};
+
+/// Returns the path of an entry of directory `dir`, for error messages
+static std::string entryPath(const std::string& dir, const char* name) {
+  if (!dir.empty() && dir.back() == '/')
+    return dir + name;
+  return dir + '/' + name;
+}
+
+bool isExcluded(const std::vector<std::string>& patterns, const std::string& dir, const char* name) {
+  std::string path; // Built only for patterns with a slash
+  for (const std::string& pattern : patterns) {
+    if (pattern.find('/') == std::string::npos) {
+      if (!fnmatch(pattern.c_str(), name, 0))
+        return true;
+    } else {
+      if (path.empty())
+        path = entryPath(dir, name);
+      if (!fnmatch(pattern.c_str(), path.c_str(), FNM_PATHNAME))
+        return true;
+    }
+  }
+  return false;
 }
 
-void ExtentSet::insertFromDir(const char* path, bool stopOnError) {
-  UniqueMAllocPtr<fiemap> fm(sizeof(fiemap)); // Reuse the same memory to save allocation calls
-  std::filesystem::recursive_directory_iterator it(path), it_before;
-  const std::filesystem::recursive_directory_iterator end; // The default constructor gives and end iterator
-  std::error_code ec;
-  while (it != end) {
-    // Look into the file pointed by it
+/// Number of files whose open, statx and close are batched in the same
+/// io_uring submission
+static constexpr unsigned URING_BATCH = 256;
+
+/// Returns the number of files to batch through io_uring, at most
+/// URING_BATCH: the files of a batch stay open until its closes are
+/// submitted, so those of all the threads must fit in RLIMIT_NOFILE (with
+/// as many descriptors to spare for the directories and the rest)
+static unsigned uringBatchSize(unsigned nThreads) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY)
+    return URING_BATCH;
+  return std::clamp<rlim_t>(limit.rlim_cur / (2 * nThreads), 1, URING_BATCH);
+}
+
+/// Per-thread buffers used to batch the metadata syscalls of the files of
+/// a directory through io_uring
+struct UringBatch {
+  UringBatch()
+  : ring(URING_BATCH), stx(URING_BATCH), res(URING_BATCH), statOk(URING_BATCH), read(URING_BATCH) {
+    names.reserve(URING_BATCH);
+  }
+
+  IoUring ring;
+  std::vector<std::string> names; // Files queued for the current directory
+  std::vector<struct statx> stx;
+  std::vector<__s32> res; // Result of the last operation of each file
+  std::vector<char> statOk, read; // Whether statx succeeded, whether the file must be read
+
+  /// Returns the device of file k from its statx result
+  inline dev_t dev(unsigned k) const { return makedev(stx[k].stx_dev_major, stx[k].stx_dev_minor); }
+
+  /// Returns the cache key of file k from its statx result
+  inline ExtentCacheKey key(unsigned k, __u64 generation) const {
+    const struct statx& x = stx[k];
+    return ExtentCacheKey{dev(k), x.stx_ino, x.stx_ctime.tv_sec, x.stx_ctime.tv_nsec, generation};
+  }
+
+  /// Waits for n completions, storing their results in res
+  void reap(unsigned n) {
+    __u64 k;
+    __s32 r;
+    while (n) {
+      if (ring.complete(k, r)) {
+        res[k] = r;
+        --n;
+      } else {
+        ring.submit(n);
+      }
+    }
+  }
+};
+
+/// A directory queued by a DirScan, with the node of the DirTree its
+/// files are accounted to and its depth below the root
+struct QueuedDir {
+  std::string path;
+  std::size_t node = 0, depth = 0;
+};
+
+/// Per-thread state of a DirScan
+template <class Set> struct DirScanWorker {
+  DirScanWorker(unsigned index, Set* es, ScanSummary& summary) : index(index), es(es), summary(summary) {}
+
+  const unsigned index;
+  Set* es; // Set of the directory being read
+  ScanSummary& summary;
+  std::size_t node = 0, depth = 0; // Of the directory being read
+  UniqueMAllocPtr<fiemap> fm{sizeof(fiemap)};
+  std::vector<char> buffer; // For getdents64
+  std::vector<Extent> extents; // For the cache, the trace and the source
+  std::vector<ExtentSource::Entry> entries; // For the source
+  std::vector<std::pair<__u64, std::string>> files; // Inode and name of the files of a directory, for inodeOrder
+  std::unique_ptr<UringBatch> uring; // Null if io_uring is not used
+  std::unordered_map<__u64, __u64> generations; // Of each device, see DirScan::keyGeneration
+  ScanStats* stats = nullptr; // Null if not requested
+
+  /// Returns the given timing counter, or null if stats are not requested
+  inline __u64* timing(__u64 ScanStats::*t) const { return stats ? &(stats->*t) : nullptr; }
+
+  /// Updates the peak of stored extents, if stats are requested
+  inline void samplePeak() const {
+    if (stats)
+      stats->peakSetExtents = std::max<__u64>(stats->peakSetExtents, es->storedExtents());
+  }
+};
+
+/// State of a directory scan. Directories are distributed among the
+/// workers with work-stealing deques; each worker reads whole directories
+/// with getdents64 and opens their files with openat, so paths are only
+/// resolved once per directory (and built only for error messages and
+/// the trace). With an ExtentSource, directories are listed and files
+/// read through it instead.
+struct DirScan {
+  DirScan(unsigned nThreads, const ScanOptions& opts)
+  : deques(nThreads), stopOnError(opts.stopOnError), useIoUring(opts.ioUring && !opts.source && IoUring::supported()),
+    uringBatch(useIoUring ? uringBatchSize(nThreads) : 0),
+    seen(opts.skipHardlinks ? &seenInodes : nullptr), cache(opts.source ? nullptr : opts.cache), source(opts.source),
+    trace(opts.trace), progress(opts.progress), cancel(opts.cancel),
+    oneFileSystem(opts.oneFileSystem && !opts.source), inodeOrder(opts.inodeOrder), exclude(opts.exclude) {
+    if (opts.ioUring && !opts.source && !useIoUring)
+      std::cerr << "io_uring is not available, using synchronous system calls" << std::endl;
+  }
+
+  std::vector<WorkStealingDeque<QueuedDir>> deques;
+  std::atomic<std::size_t> pending{0}; // Directories queued or being read
+  std::atomic<bool> stop{false};
+  std::atomic<bool> cancelled{false}; // Stopped by the cancellation
+  const bool stopOnError, useIoUring;
+  const unsigned uringBatch; // Files per io_uring batch
+  std::mutex errorMutex; // Protects std::cerr, firstError and tree
+  std::exception_ptr firstError;
+  ConcurrentInodeSet seenInodes;
+  ConcurrentInodeSet* const seen; // Null if hardlinks are not skipped
+  ExtentCache* const cache; // Null if not used
+  const ExtentSource* const source; // Null for the filesystem
+  FileExtentsRecorder* const trace; // Null if not used
+  ScanProgress* const progress; // Null if not used
+  const std::atomic<bool>* const cancel; // Null if not used
+  DirTree* tree = nullptr; // Null if all files go to the same set
+  std::size_t maxDepth = 0; // Of the nodes of tree
+  const bool oneFileSystem;
+  dev_t rootDev = 0; // Device of the directory scanned, if oneFileSystem
+  const bool inodeOrder;
+  const std::vector<std::string>& exclude;
+
+  /// Reports an error on stderr; if stopOnError, saves it and stops all workers
+  void report(const std::string& p, const char* what, std::exception_ptr ex, ScanSummary& summary) {
+    ++summary.errors;
+    std::lock_guard<std::mutex> lock(errorMutex);
+    std::cerr << std::quoted(p) << ": " << what << std::endl;
+    if (stopOnError) {
+      if (!firstError)
+        firstError = ex;
+      stop = true;
+    }
+  }
+
+  /// Returns true if the workers must stop, because of an error or of a
+  /// cancellation
+  bool stopped() {
+    if (cancel && *cancel) {
+      cancelled = true;
+      stop = true;
+    }
+    return stop;
+  }
+
+  /// Pushes a directory on the deque of worker `i`
+  void push(unsigned i, QueuedDir dir) {
+    ++pending;
+    deques[i].push(std::move(dir));
+  }
+
+  /// Queues the root directory of the scan on the deque of worker 0
+  void start(const char* path) {
+    struct stat st;
+    if (oneFileSystem && !stat(path, &st)) // Otherwise reading it fails too
+      rootDev = st.st_dev;
+    push(0, QueuedDir{path});
+  }
+
+  /// Queues subdirectory `name` of `dir` on the deque of worker w, adding
+  /// a node of the tree for it if it is not deeper than maxDepth
+  template <class Set>
+  void pushSubdir(const std::string& dir, const char* name, DirScanWorker<Set>& w) {
+    QueuedDir sub{entryPath(dir, name), w.node, w.depth + 1};
+    if (tree && sub.depth <= maxDepth) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      sub.node = tree->parent.size();
+      tree->parent.push_back(w.node);
+      tree->names.emplace_back(name);
+    }
+    push(w.index, std::move(sub));
+  }
+
+  /// Returns true if entry `name` of `dir` matches one of the exclude
+  /// patterns, counting it in the stats of w
+  template <class Set>
+  bool excluded(const std::string& dir, const char* name, DirScanWorker<Set>& w) const {
+    return isExcluded(exclude, dir, name) && countSkipped(&ScanStats::excludedSkipped, w);
+  }
+
+  /// Returns true if device dev is not the one of the scanned directory
+  /// (with oneFileSystem), counting the entry in the stats of w
+  template <class Set>
+  bool onOtherFileSystem(dev_t dev, DirScanWorker<Set>& w) const {
+    return oneFileSystem && dev != rootDev && countSkipped(&ScanStats::otherFsSkipped, w);
+  }
+
+  /// Returns the generation for the cache keys of the files of device dev
+  /// in the directory open in dirfd (see ExtentCacheKey): that of its
+  /// btrfs subvolume if it is read-only, otherwise 0. Asked once per
+  /// device and worker.
+  template <class Set>
+  __u64 keyGeneration(int dirfd, __u64 dev, DirScanWorker<Set>& w) const {
+    if (!cache)
+      return 0;
+    auto it = w.generations.find(dev);
+    if (it != w.generations.end())
+      return it->second;
+    struct stat st;
+    if (fstat(dirfd, &st) || st.st_dev != dev) // A file bind mount: ask its own directory
+      return 0;
+    btrfs_ioctl_get_subvol_info_args info;
+    const bool readOnly = !ioctl(dirfd, BTRFS_IOC_GET_SUBVOL_INFO, &info) && (info.flags & BTRFS_SUBVOL_RDONLY);
+    return w.generations.emplace(dev, readOnly ? info.generation : 0).first->second;
+  }
+
+  /// Increments the given counter in the stats of w, if requested, and
+  /// returns true
+  template <class Set>
+  static bool countSkipped(__u64 ScanStats::*counter, DirScanWorker<Set>& w) {
+    if (w.stats)
+      ++(w.stats->*counter);
+    return true;
+  }
+
+  /// Gets a directory from the deque of worker `i`, or steals one from
+  /// the others. Returns false when the scan is over.
+  bool next(unsigned i, QueuedDir& dir) {
+    const unsigned n = deques.size();
+    while (!stopped()) {
+      if (deques[i].pop(dir))
+        return true;
+      for (unsigned j = 1; j < n; ++j)
+        if (deques[(i + j) % n].steal(dir))
+          return true;
+      if (!pending)
+        return false;
+      std::this_thread::yield();
+    }
+    return false;
+  }
+
+  /// Inserts the extents of file `name` of `dir`, collected in w.extents,
+  /// into w.es, also recording them to the trace if needed
+  template <class Set>
+  void addExtents(const std::string& dir, const char* name, __u64 dev, __u64 ino, __u64 nlink, DirScanWorker<Set>& w) {
+    {
+      ScanTimer timer(w.timing(&ScanStats::insertNs));
+      for (const Extent& x : w.extents)
+        w.es->insert(x);
+    }
+    if (trace)
+      trace->add(entryPath(dir, name), dev, ino, nlink, w.extents);
+  }
+
+  /// Decides whether a file must be read, given its metadata. Returns
+  /// false if it is a hardlink to an inode that was already scanned, or
+  /// if its extents were found in the cache (and inserted into w.es).
+  template <class Set>
+  bool needsRead(__u64 dev, __u64 ino, __u64 nlink, const ExtentCacheKey& key, const std::string& dir, const char* name,
+                 DirScanWorker<Set>& w) {
+    if (seen && nlink > 1 && !seen->insert(dev, ino)) {
+      ++w.summary.hardlinksSkipped;
+      return false;
+    }
+    if (cache) {
+      w.extents.clear();
+      if (cache->lookup(key, w.extents)) {
+        addExtents(dir, name, dev, ino, nlink, w);
+        ++w.summary.cacheHits;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Reads the extents of the open file fd (`name` in `dir`) into w.es,
+  /// also adding them to the cache if key is not null
+  template <class Set>
+  void readFile(int fd, const ExtentCacheKey* key, const std::string& dir, const char* name, __u64 dev, __u64 ino,
+                __u64 nlink, DirScanWorker<Set>& w) {
+    if (key || trace) {
+      w.extents.clear();
+      ExtentRecorder recorder{w.extents};
+      insertFromFd(fd, recorder, w.fm, w.stats);
+      recorder.coalesce();
+      if (key)
+        cache->add(*key, w.extents);
+      addExtents(dir, name, dev, ino, nlink, w);
+    } else {
+      insertFromFd(fd, *w.es, w.fm, w.stats);
+    }
+    ++w.summary.files;
+  }
+
+  /// Scans a regular file of the directory open in dirfd. If hardlinks
+  /// are skipped or the cache is used, the file is stat'ed first and it
+  /// is opened only if needsRead.
+  template <class Set>
+  void scanFile(int dirfd, const std::string& dir, const char* name, DirScanWorker<Set>& w) {
+    struct stat st;
+    bool haveStat;
+    {
+      ScanTimer timer(w.timing(&ScanStats::openNs));
+      // If fstatat fails, let openat report the error (and skip the cache)
+      haveStat = (seen || cache || trace || oneFileSystem) && !fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+    }
+    ExtentCacheKey key{};
+    if (!haveStat) {
+      st.st_dev = 0;
+      st.st_ino = 0;
+      st.st_nlink = 1;
+    } else {
+      if (onOtherFileSystem(st.st_dev, w)) // A file bind mount
+        return;
+      key = ExtentCacheKey{st.st_dev, st.st_ino, st.st_ctim.tv_sec, (__u32)st.st_ctim.tv_nsec,
+                           keyGeneration(dirfd, st.st_dev, w)};
+      if (!needsRead(st.st_dev, st.st_ino, st.st_nlink, key, dir, name, w))
+        return;
+    }
+    std::optional<UniqueFileDescriptor> fd;
+    {
+      ScanTimer timer(w.timing(&ScanStats::openNs));
+      fd.emplace(dirfd, name, FILE_OPEN_FLAGS);
+    }
+    readFile(*fd, (haveStat && cache) ? &key : nullptr, dir, name, st.st_dev, st.st_ino, st.st_nlink, w);
+    ScanTimer timer(w.timing(&ScanStats::openNs));
+    fd.reset(); // Closes the file
+  }
+
+  /// Same as scanFile for all the files queued in w.uring->names, but
+  /// statx, openat and close are submitted in batches, so that they run
+  /// concurrently and cost one io_uring_enter per batch. Only the FIEMAP
+  /// ioctl is called synchronously. The batch is emptied even if this
+  /// throws, closing the files left open.
+  template <class Set>
+  void scanFileBatch(int dirfd, const std::string& dir, DirScanWorker<Set>& w) {
+    UringBatch& b = *w.uring;
+    const unsigned n = b.names.size();
+    unsigned firstOpen = n; // The files from firstOpen on with read set are open (if res >= 0)
     try {
-      if (!it->is_symlink() && it->is_regular_file())
-        insertFromFileImpl(it->path().c_str(), *this, fm);
+      scanFileBatch(dirfd, dir, w, firstOpen);
+    } catch (...) {
+      for (unsigned k = firstOpen; k < n; ++k)
+        if (b.read[k] && b.res[k] >= 0)
+          ::close(b.res[k]);
+      b.names.clear();
+      throw;
+    }
+    b.names.clear();
+  }
+
+  /// Body of scanFileBatch, updating firstOpen as the files are opened
+  /// and then queued to be closed
+  template <class Set>
+  void scanFileBatch(int dirfd, const std::string& dir, DirScanWorker<Set>& w, unsigned& firstOpen) {
+    UringBatch& b = *w.uring;
+    const unsigned n = b.names.size();
+    std::fill(b.read.begin(), b.read.begin() + n, 1);
+    std::fill(b.statOk.begin(), b.statOk.begin() + n, 0);
+    if (seen || cache || trace || oneFileSystem) {
+      unsigned nStat = 0;
+      for (unsigned k = 0; k < n; ++k) {
+        if (b.ring.statx(dirfd, b.names[k].c_str(), AT_SYMLINK_NOFOLLOW, STATX_NLINK | STATX_INO | STATX_CTIME,
+                         &b.stx[k], k))
+          ++nStat;
+        else
+          b.res[k] = -EBUSY; // The ring is full: openat reports the errors
+      }
+      {
+        ScanTimer timer(w.timing(&ScanStats::openNs));
+        b.ring.submit(nStat);
+        b.reap(nStat);
+      }
+      for (unsigned k = 0; k < n; ++k) {
+        // If statx fails, let openat report the error (and skip the cache)
+        if (b.res[k])
+          continue;
+        const struct statx& x = b.stx[k];
+        b.statOk[k] = 1;
+        b.read[k] = !onOtherFileSystem(b.dev(k), w)
+                    && needsRead(b.dev(k), x.stx_ino, x.stx_nlink, b.key(k, keyGeneration(dirfd, b.dev(k), w)), dir,
+                                 b.names[k].c_str(), w);
+      }
+    }
+    unsigned nOpen = 0;
+    for (unsigned k = 0; k < n; ++k) {
+      if (!b.read[k])
+        continue;
+      if (b.ring.openat(dirfd, b.names[k].c_str(), FILE_OPEN_FLAGS, k)) {
+        ++nOpen;
+      } else { // The ring is full
+        ScanTimer timer(w.timing(&ScanStats::openNs));
+        b.res[k] = openat(dirfd, b.names[k].c_str(), FILE_OPEN_FLAGS);
+        b.res[k] = b.res[k] < 0 ? -errno : b.res[k];
+      }
+    }
+    {
+      ScanTimer timer(w.timing(&ScanStats::openNs));
+      b.ring.submit(nOpen);
+      b.reap(nOpen);
+    }
+    firstOpen = 0;
+    unsigned nClose = 0;
+    for (unsigned k = 0; k < n; ++k) {
+      if (!b.read[k])
+        continue;
+      if (b.res[k] < 0) {
+        std::runtime_error ex("Could not open file: " + b.names[k]);
+        report(entryPath(dir, b.names[k].c_str()), ex.what(), std::make_exception_ptr(ex), w.summary);
+        continue;
+      }
+      try {
+        const ExtentCacheKey key = b.key(k, b.statOk[k] ? keyGeneration(dirfd, b.dev(k), w) : 0);
+        const struct statx& x = b.stx[k];
+        readFile(b.res[k], (b.statOk[k] && cache) ? &key : nullptr, dir, b.names[k].c_str(),
+                 b.statOk[k] ? b.dev(k) : 0, b.statOk[k] ? x.stx_ino : 0, b.statOk[k] ? x.stx_nlink : 1, w);
+      } catch (const std::exception& ex) {
+        report(entryPath(dir, b.names[k].c_str()), ex.what(), std::current_exception(), w.summary);
+      }
+      firstOpen = k + 1;
+      if (b.ring.close(b.res[k], k)) {
+        ++nClose;
+      } else { // The ring is full
+        ScanTimer timer(w.timing(&ScanStats::openNs));
+        ::close(b.res[k]);
+      }
+    }
+    ScanTimer timer(w.timing(&ScanStats::openNs));
+    b.ring.submit(nClose);
+    b.reap(nClose);
+  }
+
+  /// Scans file `name` of the directory open in dirfd, or queues it for
+  /// the next io_uring batch
+  template <class Set>
+  void readOrQueue(int dirfd, const std::string& dir, const char* name, DirScanWorker<Set>& w) {
+    if (!w.uring) {
+      scanFile(dirfd, dir, name, w);
+    } else {
+      w.uring->names.emplace_back(name);
+      if (w.uring->names.size() == uringBatch)
+        scanFileBatch(dirfd, dir, w);
+    }
+  }
+
+  /// Reads the next entry of reader (see DirectoryReader::next), timing
+  /// it if stats are requested
+  template <class Set>
+  static bool nextEntry(DirectoryReader& reader, DirectoryReader::Entry& entry, DirScanWorker<Set>& w) {
+    ScanTimer timer(w.timing(&ScanStats::readdirNs));
+    return reader.next(entry);
+  }
+
+  /// Reads all the entries of dir, scanning regular files and queueing
+  /// subdirectories. Symlinks are never followed. Excluded entries are
+  /// skipped before being stat'ed or opened, and with oneFileSystem the
+  /// subdirectories are stat'ed to skip mount points. With inodeOrder,
+  /// the files are read after the whole directory, by inode number. If
+  /// the directory cannot be read, the error is reported and the rest of
+  /// it is skipped.
+  template <class Set>
+  void scanDir(const std::string& dir, DirScanWorker<Set>& w) {
+    try {
+      std::optional<DirectoryReader> opened;
+      {
+        ScanTimer timer(w.timing(&ScanStats::readdirNs));
+        opened.emplace(dir.c_str(), w.buffer);
+      }
+      DirectoryReader& reader = *opened;
+      if (w.stats)
+        ++w.stats->directories;
+      DirectoryReader::Entry entry;
+      while (!stopped() && nextEntry(reader, entry, w)) {
+        unsigned char type = entry.type;
+        try {
+          if (!exclude.empty() && excluded(dir, entry.name, w))
+            continue;
+          struct stat st;
+          bool haveStat = false;
+          // Not all filesystems fill d_type, and mount points are found by device
+          if (type == DT_UNKNOWN || (type == DT_DIR && oneFileSystem)) {
+            if (fstatat(reader.fd(), entry.name, &st, AT_SYMLINK_NOFOLLOW))
+              throw std::system_error(errno, std::generic_category(), "cannot stat");
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            haveStat = true;
+          }
+          if (type == DT_DIR) {
+            if (haveStat && onOtherFileSystem(st.st_dev, w))
+              continue;
+            pushSubdir(dir, entry.name, w);
+          } else if (type == DT_REG) {
+            if (inodeOrder)
+              w.files.emplace_back(haveStat ? st.st_ino : entry.ino, entry.name);
+            else
+              readOrQueue(reader.fd(), dir, entry.name, w);
+          } else if (w.stats) {
+            ++w.stats->otherSkipped;
+          }
+        } catch (const std::exception& ex) {
+          report(entryPath(dir, entry.name), ex.what(), std::current_exception(), w.summary);
+        }
+      }
+      if (inodeOrder) {
+        // Inode numbers roughly follow the layout of the inode tables, so
+        // reading them in order turns random seeks into a forward sweep
+        std::sort(w.files.begin(), w.files.end());
+        for (const std::pair<__u64, std::string>& f : w.files) {
+          if (stopped())
+            break;
+          try {
+            readOrQueue(reader.fd(), dir, f.second.c_str(), w);
+          } catch (const std::exception& ex) {
+            report(entryPath(dir, f.second.c_str()), ex.what(), std::current_exception(), w.summary);
+          }
+        }
+        w.files.clear();
+      }
+      if (w.uring && !w.uring->names.empty())
+        scanFileBatch(reader.fd(), dir, w);
     } catch (const std::exception& ex) {
-      std::cerr << it->path() << ": " << ex.what() << std::endl;
-      if (stopOnError)
-        throw;
-    }
-    // Try to loop to the next file, checking for errors and reporting them
-    it_before = it; // Save the value of it, since increment() will make it invalid (i.e. an end pointer) on error
-    it.increment(ec);
-    if (ec) {
-      // Check if we called disable_recursion_pending at the previous iteration.
-      // If we did and `it` still failed to increment, we are in an infinite loop.
-      // We break it with an exception, because there is nothing else to do.
-      if (!it_before.recursion_pending()) {
-        throw std::filesystem::filesystem_error("cannot increment recursive directory iterator even after skipping the previous file", ec);
-      }
-      // Take the path from it_before, since it will be invalid (i.e. points to (directory_entry*)nullptr) on error
-      std::cerr << it_before->path() << ": cannot increment recursive directory iterator: " << ec.message() << std::endl;
-      if (stopOnError)
-        throw std::filesystem::filesystem_error("cannot increment recursive directory iterator", ec);
-      it = it_before; // Restore the value before the error
-      it.disable_recursion_pending(); // Try again at next loop, skipping the current directory
+      w.files.clear();
+      if (w.uring)
+        w.uring->names.clear();
+      report(dir, ex.what(), std::current_exception(), w.summary);
     }
   }
+
+  /// Same as scanDir, for the directory `dir` of the ExtentSource
+  template <class Set>
+  void scanSourceDir(const std::string& dir, DirScanWorker<Set>& w) {
+    try {
+      ScanTimer timer(w.timing(&ScanStats::readdirNs));
+      w.entries.clear();
+      source->list(dir, w.entries);
+      if (w.stats)
+        ++w.stats->directories;
+    } catch (const std::exception& ex) {
+      report(dir, ex.what(), std::current_exception(), w.summary);
+      return;
+    }
+    for (const ExtentSource::Entry& e : w.entries) {
+      if (stopped())
+        break;
+      if (!exclude.empty() && excluded(dir, e.name.c_str(), w))
+        continue;
+      if (e.isDir) {
+        pushSubdir(dir, e.name.c_str(), w);
+        continue;
+      }
+      try {
+        if (seen && e.nlink > 1 && e.ino && !seen->insert(e.dev, e.ino)) {
+          ++w.summary.hardlinksSkipped;
+          continue;
+        }
+        w.extents.clear();
+        {
+          ScanTimer timer(w.timing(&ScanStats::ioctlNs));
+          source->extents(e, w.extents);
+        }
+        if (w.stats) {
+          w.stats->extentsReturned += w.extents.size();
+          w.stats->extentsInserted += w.extents.size();
+        }
+        addExtents(dir, e.name.c_str(), e.dev, e.ino, e.nlink, w);
+        ++w.summary.files;
+      } catch (const std::exception& ex) {
+        report(entryPath(dir, e.name.c_str()), ex.what(), std::current_exception(), w.summary);
+      }
+    }
+  }
+
+  /// Body of worker i, inserting the extents into es, or if it is null
+  /// into the set of the node of each directory in nodes (created as
+  /// needed)
+  template <class Set>
+  void worker(unsigned i, Set* es, std::vector<std::unique_ptr<Set>>* nodes, ScanSummary& summary,
+              ScanStats* stats) {
+    DirScanWorker<Set> w(i, es, summary);
+    w.stats = stats;
+    if (useIoUring) {
+      try {
+        w.uring = std::make_unique<UringBatch>();
+      } catch (const std::system_error&) {
+        // Fall back to synchronous calls for this thread (e.g. out of memlock)
+      }
+    }
+    QueuedDir dir;
+    while (next(i, dir)) {
+      if (nodes) {
+        if (nodes->size() <= dir.node)
+          nodes->resize(dir.node + 1);
+        std::unique_ptr<Set>& s = (*nodes)[dir.node];
+        if (!s)
+          s = std::make_unique<Set>();
+        w.es = s.get();
+      }
+      w.node = dir.node;
+      w.depth = dir.depth;
+      const std::size_t filesBefore = summary.files + summary.cacheHits;
+      const __u64 bytesBefore = progress ? w.es->runningLength() : 0;
+      if (source)
+        scanSourceDir(dir.path, w);
+      else
+        scanDir(dir.path, w);
+      if (progress && !stop)
+        progress->directoryDone(dir.path, summary.files + summary.cacheHits - filesBefore,
+                                __s64(w.es->runningLength() - bytesBefore));
+      w.samplePeak();
+      --pending;
+    }
+  }
+
+  /// Calls worker(i) for each of the n workers, on the threads of
+  /// opts.pool if given or on new threads otherwise (worker 0 always runs
+  /// on the calling thread), then rethrows the first error if the scan
+  /// stopped on it
+  template <class F>
+  void run(unsigned n, const ScanOptions& opts, F worker) {
+    if (opts.pool) {
+      opts.pool->run(n, worker);
+    } else {
+      std::vector<std::thread> threads;
+      for (unsigned i = 1; i < n; ++i)
+        threads.emplace_back(worker, i);
+      worker(0);
+      for (std::thread& t : threads)
+        t.join();
+    }
+    if (firstError && !cancelled)
+      std::rethrow_exception(firstError);
+  }
+
+  /// Returns the sum of the counters of the workers, also adding them to
+  /// opts.stats. Throws ScanCancelled if the scan was cancelled, so it is
+  /// called after merging the sets of the workers.
+  ScanSummary finish(const std::vector<ScanSummary>& summaries, const std::vector<ScanStats>& stats,
+                     const ScanOptions& opts) const {
+    ScanSummary summary;
+    for (const ScanSummary& s : summaries)
+      summary += s;
+    if (opts.stats) {
+      for (const ScanStats& s : stats)
+        *opts.stats += s;
+      opts.stats->files += summary.files;
+      opts.stats->hardlinksSkipped += summary.hardlinksSkipped;
+      opts.stats->cacheHits += summary.cacheHits;
+      opts.stats->errors += summary.errors;
+    }
+    if (cancelled)
+      throw ScanCancelled();
+    return summary;
+  }
+};
+
+/// Returns the number of workers of a scan
+static unsigned scanThreads(const ScanOptions& opts) {
+  return opts.pool ? opts.pool->size() : opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+template <class Set>
+static void insertFromFileTop(const char* path, Set& es, bool sync) {
+  UniqueMAllocPtr<fiemap> fm(sizeof(fiemap));
+  if (!std::filesystem::is_symlink(path))
+    insertFromFileImpl(path, es, fm, sync);
+}
+
+/// If path is a single file (a regular file, or a file of opts.source),
+/// inserts its extents into es like a scan of its directory would,
+/// passing it to opts.trace and counting it in opts.stats, and returns
+/// true. Returns false, doing nothing, for anything else (a directory, or
+/// an error left to be reported by the scan).
+template <class Set>
+static bool insertSingleFile(const char* path, Set& es, const ScanOptions& opts) {
+  std::vector<Extent> extents;
+  __u64 dev, ino, nlink;
+  if (opts.source) {
+    const ExtentSource::Entry root = opts.source->find(path);
+    if (root.isDir)
+      return false;
+    opts.source->extents(root, extents);
+    if (opts.stats) {
+      opts.stats->extentsReturned += extents.size();
+      opts.stats->extentsInserted += extents.size();
+    }
+    dev = root.dev;
+    ino = root.ino;
+    nlink = root.nlink;
+  } else {
+    struct stat st;
+    if (lstat(path, &st) || !S_ISREG(st.st_mode))
+      return false;
+    UniqueMAllocPtr<fiemap> fm(sizeof(fiemap));
+    UniqueFileDescriptor fd(path, FILE_OPEN_FLAGS);
+    ExtentRecorder recorder{extents};
+    insertFromFd(fd, recorder, fm, opts.stats);
+    recorder.coalesce();
+    dev = st.st_dev;
+    ino = st.st_ino;
+    nlink = st.st_nlink;
+  }
+  for (const Extent& x : extents)
+    es.insert(x);
+  if (opts.trace)
+    opts.trace->add(path, dev, ino, nlink, extents);
+  if (opts.stats)
+    ++opts.stats->files;
+  return true;
+}
+
+template <class Set>
+static ScanSummary insertFromDirTop(const char* path, Set& es, const ScanOptions& opts) {
+  if (insertSingleFile(path, es, opts)) {
+    ScanSummary summary;
+    summary.files = 1;
+    return summary;
+  }
+  const unsigned nThreads = scanThreads(opts);
+  DirScan scan(nThreads, opts);
+  std::vector<Set> sets(nThreads - 1); // Per-thread sets and counters, merged at the end
+  std::vector<ScanSummary> summaries(nThreads);
+  std::vector<ScanStats> stats(opts.stats ? nThreads : 0);
+  scan.start(path);
+  scan.run(nThreads, opts, [&](unsigned i) { // The calling thread fills es directly
+    scan.worker<Set>(i, i ? &sets[i - 1] : &es, nullptr, summaries[i], opts.stats ? &stats[i] : nullptr);
+  });
+  {
+    ScanTimer timer(opts.stats ? &stats[0].insertNs : nullptr);
+    for (const Set& s : sets)
+      es.parallelUnion(s, nThreads, opts.pool);
+  }
+  return scan.finish(summaries, stats, opts);
+}
+
+template <class Set>
+ScanSummary insertFromDirTree(const char* path, std::size_t maxDepth, const ScanOptions& opts, DirTree& tree,
+                              std::deque<Set>& sets) {
+  tree = DirTree();
+  sets.clear();
+  sets.resize(1);
+  if (insertSingleFile(path, sets[0], opts)) {
+    ScanSummary summary;
+    summary.files = 1;
+    return summary;
+  }
+  const unsigned nThreads = scanThreads(opts);
+  // A hardlink adds the extents to the node of each of its directories:
+  // skipping the links seen in other nodes would make them exclusive
+  ScanOptions treeOpts = opts;
+  treeOpts.skipHardlinks = false;
+  DirScan scan(nThreads, treeOpts);
+  scan.tree = &tree;
+  scan.maxDepth = maxDepth;
+  std::vector<std::vector<std::unique_ptr<Set>>> nodes(nThreads); // Per-thread sets of each node
+  std::vector<ScanSummary> summaries(nThreads);
+  std::vector<ScanStats> stats(opts.stats ? nThreads : 0);
+  scan.start(path);
+  scan.run(nThreads, opts, [&](unsigned i) {
+    scan.worker<Set>(i, nullptr, &nodes[i], summaries[i], opts.stats ? &stats[i] : nullptr);
+  });
+  {
+    ScanTimer timer(opts.stats ? &stats[0].insertNs : nullptr);
+    sets.resize(tree.parent.size());
+    for (std::vector<std::unique_ptr<Set>>& v : nodes)
+      for (std::size_t k = 0; k < v.size(); ++k) {
+        if (!v[k])
+          continue;
+        if (sets[k].empty())
+          std::swap(sets[k], *v[k]);
+        else
+          sets[k].parallelUnion(*v[k], nThreads, opts.pool);
+        v[k].reset();
+      }
+  }
+  return scan.finish(summaries, stats, opts);
 }
+
+template ScanSummary insertFromDirTree(const char*, std::size_t, const ScanOptions&, DirTree&, std::deque<ExtentSet>&);
+template ScanSummary insertFromDirTree(const char*, std::size_t, const ScanOptions&, DirTree&, std::deque<FlatExtentSet>&);
+template ScanSummary insertFromDirTree(const char*, std::size_t, const ScanOptions&, DirTree&,
+                                       std::deque<SpillingExtentSet>&);
+template ScanSummary insertFromDirTree(const char*, std::size_t, const ScanOptions&, DirTree&,
+                                       std::deque<HybridExtentSet>&);
+
+void ExtentSet::insertFromFile(const char* path, bool sync) { insertFromFileTop(path, *this, sync); }
+
+ScanSummary ExtentSet::insertFromDir(const char* path, const ScanOptions& opts) { return insertFromDirTop(path, *this, opts); }
+
+void FlatExtentSet::insertFromFile(const char* path, bool sync) { insertFromFileTop(path, *this, sync); }
+
+ScanSummary FlatExtentSet::insertFromDir(const char* path, const ScanOptions& opts) { return insertFromDirTop(path, *this, opts); }
+
+void SpillingExtentSet::insertFromFile(const char* path, bool sync) { insertFromFileTop(path, *this, sync); }
+
+ScanSummary SpillingExtentSet::insertFromDir(const char* path, const ScanOptions& opts) { return insertFromDirTop(path, *this, opts); }
+
+void HybridExtentSet::insertFromFile(const char* path, bool sync) { insertFromFileTop(path, *this, sync); }
+
+ScanSummary HybridExtentSet::insertFromDir(const char* path, const ScanOptions& opts) { return insertFromDirTop(path, *this, opts); }
+
+void BlockSketch::insertFromFile(const char* path, bool sync) { insertFromFileTop(path, *this, sync); }
+
+ScanSummary BlockSketch::insertFromDir(const char* path, const ScanOptions& opts) { return insertFromDirTop(path, *this, opts); }
@@ -0,0 +1,112 @@
+/** Bytes used by each file of the scanned trees (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "FileUsage.hh"
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+using namespace std;
+
+void FileUsage::add(const string& path, __u64, __u64, __u64 nlink, const vector<Extent>& extents) {
+  lock_guard<mutex> lock(m_mutex);
+  if (m_totals.size() >= ~__u32(0))
+    throw length_error("Too many files to rank");
+  const __u32 file = m_totals.size();
+  const size_t first = m_records.size();
+  for (const Extent& x : extents)
+    if (x.length())
+      m_records.push_back({x.start(), x.end(), file});
+  // The extents of a file must not overlap for the sweep to count files
+  const auto begin = m_records.begin() + first;
+  if (!is_sorted(begin, m_records.end()))
+    sort(begin, m_records.end());
+  auto out = begin;
+  for (auto it = begin; it != m_records.end(); ++it) {
+    if (out != begin && it->start <= (out - 1)->end)
+      (out - 1)->end = max((out - 1)->end, it->end);
+    else
+      *out++ = *it;
+  }
+  m_records.erase(out, m_records.end());
+  __u64 total = 0;
+  for (auto it = begin; it != m_records.end(); ++it)
+    total += it->end - it->start;
+  m_totals.push_back(total);
+  m_links.push_back(min<__u64>(nlink, ~__u32(0)));
+  m_paths += path;
+  m_pathEnds.push_back(m_paths.size());
+}
+
+size_t FileUsage::files() const {
+  lock_guard<mutex> lock(m_mutex);
+  return m_totals.size();
+}
+
+vector<FileUsage::Entry> FileUsage::top(size_t k) {
+  lock_guard<mutex> lock(m_mutex);
+  sort(m_records.begin(), m_records.end());
+
+  // The records covering the current position, by end: a segment is
+  // exclusive to a file when only one of its records is there
+  vector<__u64> exclusive(m_totals.size(), 0);
+  typedef pair<__u64, __u32> Active;
+  priority_queue<Active, vector<Active>, greater<Active>> active;
+  __u64 pos = 0;
+  for (size_t r = 0;; ++r) {
+    const bool done = r == m_records.size();
+    const __u64 next = done ? ~__u64(0) : m_records[r].start;
+    while (!active.empty() && active.top().first <= next) {
+      if (active.size() == 1)
+        exclusive[active.top().second] += active.top().first - pos;
+      pos = active.top().first;
+      active.pop();
+    }
+    if (done)
+      break;
+    if (active.size() == 1)
+      exclusive[active.top().second] += next - pos;
+    pos = next;
+    active.emplace(m_records[r].end, m_records[r].file);
+  }
+
+  // Keep the k largest in a min-heap, preferring the files recorded first
+  typedef pair<__u64, __u32> Ranked; // Exclusive bytes, ~file
+  priority_queue<Ranked, vector<Ranked>, greater<Ranked>> heap;
+  for (__u32 i = 0; k && i < exclusive.size(); ++i) {
+    const Ranked x(exclusive[i], ~i);
+    if (heap.size() < k) {
+      heap.push(x);
+    } else if (heap.top() < x) {
+      heap.pop();
+      heap.push(x);
+    }
+  }
+  vector<Entry> res(heap.size());
+  for (size_t i = res.size(); i--; heap.pop()) {
+    const __u32 file = ~heap.top().second;
+    const __u64 start = file ? m_pathEnds[file - 1] : 0;
+    res[i].path = m_paths.substr(start, m_pathEnds[file] - start);
+    res[i].total = m_totals[file];
+    res[i].exclusive = heap.top().first;
+    res[i].links = m_links[file];
+  }
+  return res;
+}
@@ -0,0 +1,131 @@
+/** Cache-friendly extent set backed by a sorted vector (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "FlatExtentSet.hh"
+#include "ExtentKernels.hh"
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+/// Returns the sum of the lengths of v[from..to)
+static __u64 sumLengths(const vector<Extent>& v, size_t from, size_t to) {
+  return accumulate(v.begin() + from, v.begin() + to, __u64(0), [](__u64 s, const Extent& x) { return s + x.length(); });
+}
+
+/// Joins contiguous extents of the sorted range [v.begin() + from, v.end())
+/// in place, also joining the first of them with v[from - 1] if possible.
+static void coalesce(vector<Extent>& v, size_t from) {
+  size_t w = from;
+  for (size_t r = from; r < v.size(); ++r) {
+    if (w && v[w - 1].end() >= v[r].start())
+      v[w - 1] |= v[r];
+    else
+      v[w++] = v[r];
+  }
+  v.resize(w);
+}
+
+void FlatExtentSet::flush() const {
+  if (m_pending.empty())
+    return;
+  sort(m_pending.begin(), m_pending.end());
+  coalesce(m_pending, 0);
+  const size_t mid = m_set.size();
+  // Elements before this position are not moved by the merge and are
+  // already coalesced, so there is no need to look at them again
+  const size_t from = lower_bound(m_set.begin(), m_set.end(), m_pending.front()) - m_set.begin();
+  // Coalescing may also change the extent before from, so the total is
+  // updated with the lengths of the extents from there on
+  const size_t changed = from ? from - 1 : 0;
+  m_totalLength -= sumLengths(m_set, changed, mid);
+  m_set.insert(m_set.end(), m_pending.begin(), m_pending.end());
+  m_pending.clear();
+  m_pendingLength = 0;
+  inplace_merge(m_set.begin() + from, m_set.begin() + mid, m_set.end());
+  coalesce(m_set, from);
+  m_totalLength += sumLengths(m_set, changed, m_set.size());
+  m_prefixValid = false;
+}
+
+const Extent& FlatExtentSet::first() const {
+  if (empty())
+    throw out_of_range("The FlatExtentSet is empty");
+  flush();
+  return m_set.front();
+}
+
+const Extent& FlatExtentSet::last() const {
+  if (empty())
+    throw out_of_range("The FlatExtentSet is empty");
+  flush();
+  return m_set.back();
+}
+
+__u64 FlatExtentSet::lengthWithin(const Extent& range) const {
+  flush();
+  if (!m_prefixValid) {
+    m_prefix.resize(m_set.size() + 1);
+    m_prefix[0] = 0;
+    for (size_t i = 0; i < m_set.size(); ++i)
+      m_prefix[i + 1] = m_prefix[i] + m_set[i].length();
+    m_prefixValid = true;
+  }
+  if (!range.length())
+    return 0;
+  const size_t i = firstEndingAfter(m_set.data(), m_set.size(), range.start());
+  const size_t j = partition_point(m_set.begin() + i, m_set.end(), [&](const Extent& x) { return x.start() < range.end(); }) - m_set.begin();
+  if (i >= j)
+    return 0;
+  // Only the first and the last extent can stick out of the range
+  __u64 res = m_prefix[j] - m_prefix[i];
+  if (m_set[i].start() < range.start())
+    res -= range.start() - m_set[i].start();
+  if (m_set[j - 1].end() > range.end())
+    res -= m_set[j - 1].end() - range.end();
+  return res;
+}
+
+FlatExtentSet operator&(const FlatExtentSet& lhs, const FlatExtentSet& rhs) {
+  FlatExtentSet res;
+  lhs.flush();
+  rhs.flush();
+  intersectExtents(lhs.m_set.data(), lhs.m_set.size(), rhs.m_set.data(), rhs.m_set.size(), res.m_set);
+  res.m_totalLength = sumLengths(res.m_set, 0, res.m_set.size());
+  return res;
+}
+
+FlatExtentSet& FlatExtentSet::operator|=(const FlatExtentSet& rhs) {
+  if (&rhs == this || rhs.empty())
+    return *this;
+  flush();
+  rhs.flush();
+  if (m_set.empty()) {
+    m_set = rhs.m_set;
+    m_totalLength = rhs.m_totalLength;
+  } else {
+    vector<Extent> res;
+    res.reserve(m_set.size() + rhs.m_set.size());
+    unionExtents(m_set.data(), m_set.size(), rhs.m_set.data(), rhs.m_set.size(), res);
+    m_set.swap(res);
+    m_totalLength = sumLengths(m_set, 0, m_set.size());
+  }
+  m_prefixValid = false;
+  return *this;
+}
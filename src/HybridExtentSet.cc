@@ -0,0 +1,440 @@
+/** Extent set mixing run lists and block bitmaps (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "HybridExtentSet.hh"
+#include "ExtentKernels.hh"
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+using namespace std;
+
+typedef HybridExtentSet Hybrid;
+
+/// Size of a chunk in bytes
+static constexpr __u64 CHUNK_SIZE = __u64(1) << Hybrid::CHUNK_SHIFT;
+
+static inline bool isAligned(const Extent& x) { return !((x.start() | x.length()) & (Hybrid::BLOCK_SIZE - 1)); }
+
+/// Returns the sum of the lengths of v
+static __u64 sumLengths(const vector<Extent>& v) {
+  return accumulate(v.begin(), v.end(), __u64(0), [](__u64 s, const Extent& x) { return s + x.length(); });
+}
+
+/// Returns the first block from pos on whose bit equals value, or CHUNK_BLOCKS
+static size_t findBit(const vector<__u64>& bits, size_t pos, bool value) {
+  size_t w = pos / 64;
+  if (w >= Hybrid::BITMAP_WORDS)
+    return Hybrid::CHUNK_BLOCKS;
+  __u64 word = (value ? bits[w] : ~bits[w]) & (~__u64(0) << (pos % 64));
+  while (!word) {
+    if (++w == Hybrid::BITMAP_WORDS)
+      return Hybrid::CHUNK_BLOCKS;
+    word = value ? bits[w] : ~bits[w];
+  }
+  return w * 64 + __builtin_ctzll(word);
+}
+
+/// Sets the bits of the blocks [from, to), returning how many were not set
+static __u64 setBits(vector<__u64>& bits, size_t from, size_t to) {
+  __u64 added = 0;
+  for (size_t w = from / 64; w <= (to - 1) / 64; ++w) {
+    __u64 mask = ~__u64(0);
+    if (w == from / 64)
+      mask &= ~__u64(0) << (from % 64);
+    if (w == (to - 1) / 64)
+      mask &= ~__u64(0) >> (63 - (to - 1) % 64);
+    added += __builtin_popcountll(mask & ~bits[w]);
+    bits[w] |= mask;
+  }
+  return added;
+}
+
+/// Sets the bits of the blocks covered by the given aligned runs,
+/// returning how many were not set
+static __u64 setRuns(vector<__u64>& bits, const vector<Extent>& runs, __u64 base) {
+  __u64 added = 0;
+  for (const Extent& x : runs)
+    added += setBits(bits, (x.start() - base) >> Hybrid::BLOCK_SHIFT, (x.end() - base) >> Hybrid::BLOCK_SHIFT);
+  return added;
+}
+
+// The bitmap loops are compiled with and without the POPCNT instruction,
+// and the best version is chosen when the program is loaded
+
+/// Returns the number of set bits in bits[from, to)
+__attribute__((target_clones("popcnt", "default"))) static __u64 countBits(const vector<__u64>& bits, size_t from, size_t to) {
+  if (from >= to)
+    return 0;
+  __u64 n = 0;
+  for (size_t w = from / 64; w <= (to - 1) / 64; ++w) {
+    __u64 mask = ~__u64(0);
+    if (w == from / 64)
+      mask &= ~__u64(0) << (from % 64);
+    if (w == (to - 1) / 64)
+      mask &= ~__u64(0) >> (63 - (to - 1) % 64);
+    n += __builtin_popcountll(bits[w] & mask);
+  }
+  return n;
+}
+
+/// dst |= src, returning the number of set bits in the result
+__attribute__((target_clones("popcnt", "default"))) static __u64 orBits(vector<__u64>& dst, const vector<__u64>& src) {
+  __u64 n = 0;
+  for (size_t w = 0; w < Hybrid::BITMAP_WORDS; ++w) {
+    dst[w] |= src[w];
+    n += __builtin_popcountll(dst[w]);
+  }
+  return n;
+}
+
+/// out = a & b, returning the number of set bits in the result
+__attribute__((target_clones("popcnt", "default"))) static __u64 andBits(const vector<__u64>& a, const vector<__u64>& b, vector<__u64>& out) {
+  out.resize(Hybrid::BITMAP_WORDS);
+  __u64 n = 0;
+  for (size_t w = 0; w < Hybrid::BITMAP_WORDS; ++w) {
+    out[w] = a[w] & b[w];
+    n += __builtin_popcountll(out[w]);
+  }
+  return n;
+}
+
+/// Returns the number of runs of set bits, i.e. of the set bits whose
+/// previous bit is not set
+__attribute__((target_clones("popcnt", "default"))) static size_t countRuns(const vector<__u64>& bits) {
+  size_t n = 0;
+  __u64 carry = 0; // Last bit of the previous word
+  for (__u64 w : bits) {
+    n += __builtin_popcountll(w & ~(w << 1 | carry));
+    carry = w >> 63;
+  }
+  return n;
+}
+
+/// Appends the runs of set bits to out, as extents starting at base
+static void bitmapRuns(const vector<__u64>& bits, __u64 base, vector<Extent>& out) {
+  for (size_t b = findBit(bits, 0, true); b < Hybrid::CHUNK_BLOCKS;) {
+    const size_t e = findBit(bits, b, false);
+    out.push_back(Extent::FromTo(base + (__u64(b) << Hybrid::BLOCK_SHIFT), base + (__u64(e) << Hybrid::BLOCK_SHIFT)));
+    b = findBit(bits, e, true);
+  }
+}
+
+/// Converts a run list of aligned extents to a bitmap
+static void toBitmap(vector<Extent>& runs, vector<__u64>& bits, __u64 base) {
+  bits.assign(Hybrid::BITMAP_WORDS, 0);
+  setRuns(bits, runs, base);
+  vector<Extent>().swap(runs);
+}
+
+/// Converts a bitmap to a run list
+static void toRuns(vector<__u64>& bits, vector<Extent>& runs, __u64 base) {
+  runs.clear();
+  bitmapRuns(bits, base, runs);
+  vector<__u64>().swap(bits);
+}
+
+/// Returns the runs of the chunk, converting the bitmap into tmp if needed
+static const vector<Extent>& runsOf(const vector<Extent>& runs, const vector<__u64>& bits, __u64 base, vector<Extent>& tmp) {
+  if (bits.empty())
+    return runs;
+  bitmapRuns(bits, base, tmp);
+  return tmp;
+}
+
+
+void HybridExtentSet::normalize(Chunk& c, __u64 base) {
+  if (c.bits.empty()) {
+    c.aligned = all_of(c.runs.begin(), c.runs.end(), isAligned);
+    if (c.runs.size() > MAX_RUNS && c.aligned)
+      toBitmap(c.runs, c.bits, base);
+  } else if (countRuns(c.bits) <= MAX_RUNS / 2) {
+    toRuns(c.bits, c.runs, base);
+    c.aligned = true;
+  }
+}
+
+void HybridExtentSet::recount() {
+  m_totalLength = 0;
+  m_stored = 0;
+  for (const auto& p : m_chunks) {
+    m_totalLength += p.second.length;
+    m_stored += stored(p.second);
+  }
+}
+
+void HybridExtentSet::insert(Extent x) {
+  if (!x.length())
+    return;
+  // Split at chunk boundaries (the last chunk ends at 2^64, i.e. 0)
+  for (__u64 start = x.start(); start < x.end();) {
+    const __u64 index = start >> CHUNK_SHIFT;
+    const __u64 chunkEnd = (index + 1) << CHUNK_SHIFT;
+    const __u64 end = (chunkEnd && chunkEnd < x.end()) ? chunkEnd : x.end();
+    insertIntoChunk(index, m_chunks[index], Extent::FromTo(start, end));
+    start = end;
+  }
+}
+
+void HybridExtentSet::insertIntoChunk(__u64 index, Chunk& c, Extent x) {
+  const __u64 base = index << CHUNK_SHIFT;
+  m_stored -= stored(c);
+  if (!c.bits.empty()) {
+    if (isAligned(x)) {
+      const __u64 added = setBits(c.bits, (x.start() - base) >> BLOCK_SHIFT, (x.end() - base) >> BLOCK_SHIFT) << BLOCK_SHIFT;
+      c.length += added;
+      m_totalLength += added;
+      m_stored += stored(c);
+      return;
+    }
+    toRuns(c.bits, c.runs, base);
+    c.aligned = true;
+  }
+  // Replace the runs that overlap or touch x with their union
+  vector<Extent>& r = c.runs;
+  const size_t i = firstEndingAfter(r.data(), r.size(), x.start() ? x.start() - 1 : 0);
+  size_t j = i;
+  __u64 lo = x.start(), hi = x.end(), removed = 0;
+  for (; j < r.size() && r[j].start() <= hi; ++j) {
+    lo = min(lo, r[j].start());
+    hi = max(hi, r[j].end());
+    removed += r[j].length();
+  }
+  if (i == j) {
+    r.insert(r.begin() + i, x);
+  } else {
+    r[i] = Extent::FromTo(lo, hi);
+    r.erase(r.begin() + i + 1, r.begin() + j);
+  }
+  const __u64 added = (hi - lo) - removed;
+  c.length += added;
+  m_totalLength += added;
+  c.aligned = c.aligned && isAligned(x);
+  if (r.size() > MAX_RUNS && c.aligned)
+    toBitmap(c.runs, c.bits, base);
+  m_stored += stored(c);
+}
+
+size_t HybridExtentSet::size() const {
+  size_t n = 0;
+  for (iterator it = begin(); it != end(); ++it)
+    ++n;
+  return n;
+}
+
+size_t HybridExtentSet::bitmapChunks() const {
+  return count_if(m_chunks.begin(), m_chunks.end(), [](const ChunkMap::value_type& p) { return !p.second.bits.empty(); });
+}
+
+size_t HybridExtentSet::memoryUsage() const {
+  // A map node holds the value and three pointers and a color
+  size_t res = m_chunks.size() * (sizeof(ChunkMap::value_type) + 4 * sizeof(void*));
+  for (const auto& p : m_chunks)
+    res += p.second.runs.capacity() * sizeof(Extent) + p.second.bits.capacity() * sizeof(__u64);
+  return res;
+}
+
+Extent HybridExtentSet::first() const {
+  if (empty())
+    throw out_of_range("The HybridExtentSet is empty");
+  return *begin();
+}
+
+/// Returns the last run of a non-empty chunk
+static Extent lastRun(const vector<Extent>& runs, const vector<__u64>& bits, __u64 base) {
+  if (bits.empty())
+    return runs.back();
+  size_t w = Hybrid::BITMAP_WORDS - 1;
+  while (!bits[w])
+    --w;
+  const size_t end = w * 64 + 64 - __builtin_clzll(bits[w]);
+  // Look for the last unset bit before end
+  size_t start = end - 1;
+  while (start && (bits[(start - 1) / 64] >> ((start - 1) % 64) & 1))
+    --start;
+  return Extent::FromTo(base + (__u64(start) << Hybrid::BLOCK_SHIFT), base + (__u64(end) << Hybrid::BLOCK_SHIFT));
+}
+
+Extent HybridExtentSet::last() const {
+  if (empty())
+    throw out_of_range("The HybridExtentSet is empty");
+  ChunkMap::const_iterator it = prev(m_chunks.end());
+  Extent x = lastRun(it->second.runs, it->second.bits, it->first << CHUNK_SHIFT);
+  // Join the runs that end where the following chunk starts
+  while (it != m_chunks.begin() && x.start() == it->first << CHUNK_SHIFT) {
+    const ChunkMap::const_iterator p = prev(it);
+    if (p->first + 1 != it->first)
+      break;
+    const Extent y = lastRun(p->second.runs, p->second.bits, p->first << CHUNK_SHIFT);
+    if (y.end() != x.start())
+      break;
+    x = Extent::FromTo(y.start(), x.end());
+    it = p;
+  }
+  return x;
+}
+
+__u64 HybridExtentSet::lengthWithin(const Extent& range) const {
+  if (!range.length())
+    return 0;
+  __u64 res = 0;
+  for (auto it = m_chunks.lower_bound(range.start() >> CHUNK_SHIFT); it != m_chunks.end() && (it->first << CHUNK_SHIFT) < range.end(); ++it) {
+    const Chunk& c = it->second;
+    const __u64 base = it->first << CHUNK_SHIFT;
+    // Offsets of the range within the chunk
+    const __u64 lo = range.start() > base ? range.start() - base : 0;
+    const __u64 hi = min(range.end() - base, CHUNK_SIZE);
+    if (!lo && hi == CHUNK_SIZE) {
+      res += c.length;
+    } else if (c.bits.empty()) {
+      const size_t i = firstEndingAfter(c.runs.data(), c.runs.size(), base + lo);
+      for (size_t k = i; k < c.runs.size() && c.runs[k].start() < base + hi; ++k)
+        res += (c.runs[k] & Extent::FromTo(base + lo, base + hi)).length();
+    } else {
+      // Count the blocks touched by the range, then remove the parts of
+      // the first and the last one that are outside it
+      const size_t first = lo >> BLOCK_SHIFT, last = (hi - 1) >> BLOCK_SHIFT;
+      res += countBits(c.bits, first, last + 1) << BLOCK_SHIFT;
+      if (c.bits[first / 64] >> (first % 64) & 1)
+        res -= lo & (BLOCK_SIZE - 1);
+      if (c.bits[last / 64] >> (last % 64) & 1)
+        res -= (BLOCK_SIZE - (hi & (BLOCK_SIZE - 1))) & (BLOCK_SIZE - 1);
+    }
+  }
+  return res;
+}
+
+void HybridExtentSet::unionChunk(Chunk& dst, const Chunk& src, __u64 base) {
+  if (!dst.bits.empty() && !src.bits.empty()) {
+    dst.length = orBits(dst.bits, src.bits) << BLOCK_SHIFT;
+  } else if (!dst.bits.empty() && src.aligned) {
+    dst.length += setRuns(dst.bits, src.runs, base) << BLOCK_SHIFT;
+  } else if (!src.bits.empty() && dst.aligned) {
+    dst.bits = src.bits;
+    dst.length = src.length + (setRuns(dst.bits, dst.runs, base) << BLOCK_SHIFT);
+    vector<Extent>().swap(dst.runs);
+  } else {
+    vector<Extent> a, b, res;
+    const vector<Extent>& ra = runsOf(dst.runs, dst.bits, base, a);
+    const vector<Extent>& rb = runsOf(src.runs, src.bits, base, b);
+    res.reserve(ra.size() + rb.size());
+    unionExtents(ra.data(), ra.size(), rb.data(), rb.size(), res);
+    dst.runs.swap(res);
+    vector<__u64>().swap(dst.bits);
+    dst.length = sumLengths(dst.runs);
+  }
+  normalize(dst, base);
+}
+
+void HybridExtentSet::intersectChunk(const Chunk& a, const Chunk& b, __u64 base, Chunk& out) {
+  if (!a.bits.empty() && !b.bits.empty()) {
+    out.length = andBits(a.bits, b.bits, out.bits) << BLOCK_SHIFT;
+  } else if ((!a.bits.empty() && b.aligned) || (!b.bits.empty() && a.aligned)) {
+    const Chunk& bitmap = a.bits.empty() ? b : a;
+    const Chunk& runs = a.bits.empty() ? a : b;
+    vector<__u64> mask(BITMAP_WORDS, 0);
+    setRuns(mask, runs.runs, base);
+    out.length = andBits(bitmap.bits, mask, out.bits) << BLOCK_SHIFT;
+  } else {
+    vector<Extent> ta, tb;
+    const vector<Extent>& ra = runsOf(a.runs, a.bits, base, ta);
+    const vector<Extent>& rb = runsOf(b.runs, b.bits, base, tb);
+    intersectExtents(ra.data(), ra.size(), rb.data(), rb.size(), out.runs);
+    out.length = sumLengths(out.runs);
+  }
+  if (out.length)
+    normalize(out, base);
+}
+
+HybridExtentSet operator&(const HybridExtentSet& lhs, const HybridExtentSet& rhs) {
+  HybridExtentSet res;
+  auto i = lhs.m_chunks.begin(), j = rhs.m_chunks.begin();
+  while (i != lhs.m_chunks.end() && j != rhs.m_chunks.end()) {
+    if (i->first < j->first) {
+      ++i;
+    } else if (j->first < i->first) {
+      ++j;
+    } else {
+      HybridExtentSet::Chunk c;
+      HybridExtentSet::intersectChunk(i->second, j->second, i->first << HybridExtentSet::CHUNK_SHIFT, c);
+      if (c.length)
+        res.m_chunks.emplace_hint(res.m_chunks.end(), i->first, move(c));
+      ++i;
+      ++j;
+    }
+  }
+  res.recount();
+  return res;
+}
+
+HybridExtentSet& HybridExtentSet::operator|=(const HybridExtentSet& rhs) {
+  if (&rhs == this || rhs.empty())
+    return *this;
+  for (const auto& p : rhs.m_chunks) {
+    auto it = m_chunks.lower_bound(p.first);
+    if (it == m_chunks.end() || it->first != p.first)
+      m_chunks.emplace_hint(it, p.first, p.second);
+    else
+      unionChunk(it->second, p.second, p.first << CHUNK_SHIFT);
+  }
+  recount();
+  return *this;
+}
+
+bool HybridExtentSet::iterator::nextPiece(Extent& x) {
+  for (; m_chunk != m_end; ++m_chunk, m_pos = 0) {
+    const Chunk& c = m_chunk->second;
+    if (c.bits.empty()) {
+      if (m_pos < c.runs.size()) {
+        x = c.runs[m_pos++];
+        return true;
+      }
+    } else {
+      const size_t b = findBit(c.bits, m_pos, true);
+      if (b < CHUNK_BLOCKS) {
+        const size_t e = findBit(c.bits, b, false);
+        const __u64 base = m_chunk->first << CHUNK_SHIFT;
+        x = Extent::FromTo(base + (__u64(b) << BLOCK_SHIFT), base + (__u64(e) << BLOCK_SHIFT));
+        m_pos = e;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+HybridExtentSet::iterator& HybridExtentSet::iterator::operator++() {
+  if (m_hasNext) {
+    m_cur = m_next;
+    m_hasNext = false;
+  } else if (!nextPiece(m_cur)) {
+    m_atEnd = true;
+    return *this;
+  }
+  // Runs within a chunk are already coalesced, but the last one may
+  // continue in the next chunk
+  while (nextPiece(m_next)) {
+    if (m_next.start() != m_cur.end()) {
+      m_hasNext = true;
+      break;
+    }
+    m_cur = Extent::FromTo(m_cur.start(), m_next.end());
+  }
+  return *this;
+}
@@ -0,0 +1,131 @@
+/** Shared usage of extent sets kept up to date as extents come and go
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "IncrementalUsage.hh"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+using namespace std;
+
+void IncrementalUsage::add(size_t i, const vector<Extent>& extents) {
+  for (const Extent& x : extents)
+    update(i, x, 1);
+}
+
+void IncrementalUsage::remove(size_t i, const vector<Extent>& extents) {
+  // Check everything first, so that a failure leaves the usage unchanged
+  for (const Extent& x : extents) {
+    if (!x.length())
+      continue;
+    __u64 pos = x.start();
+    auto it = m_segments.upper_bound(pos);
+    if (it != m_segments.begin())
+      --it;
+    while (pos < x.end()) {
+      if (it == m_segments.end() || it->first > pos || it->second.end <= pos || !it->second.counts[i])
+        throw logic_error("IncrementalUsage: removing extents that were not added");
+      pos = it->second.end;
+      ++it;
+    }
+  }
+  for (const Extent& x : extents)
+    update(i, x, -1);
+}
+
+void IncrementalUsage::update(size_t i, const Extent& x, int delta) {
+  if (!x.length())
+    return;
+  split(x.start());
+  split(x.end());
+  __u64 pos = x.start();
+  auto it = m_segments.lower_bound(pos);
+  while (pos < x.end()) {
+    if (it == m_segments.end() || it->first > pos) {
+      // Gap: only reached when adding
+      const __u64 end = it == m_segments.end() ? x.end() : min(it->first, x.end());
+      Segment s{end, vector<__u32>(m_usage.n)};
+      s.counts[i] = 1;
+      account(end - pos, s.counts, false);
+      it = next(m_segments.emplace_hint(it, pos, move(s)));
+      pos = end;
+      continue;
+    }
+    Segment& s = it->second;
+    const __u64 len = s.end - pos;
+    account(len, s.counts, true);
+    s.counts[i] += delta;
+    pos = s.end;
+    if (all_of(s.counts.begin(), s.counts.end(), [](__u32 c) { return !c; })) {
+      it = m_segments.erase(it);
+    } else {
+      account(len, s.counts, false);
+      ++it;
+    }
+  }
+  // Join the pieces left by split and the segments whose counts became equal
+  it = m_segments.lower_bound(x.start());
+  if (it != m_segments.begin())
+    --it;
+  while (it != m_segments.end() && it->first < x.end())
+    it = joinNext(it);
+}
+
+void IncrementalUsage::split(__u64 pos) {
+  auto it = m_segments.upper_bound(pos);
+  if (it == m_segments.begin())
+    return;
+  --it;
+  if (it->first == pos || it->second.end <= pos)
+    return;
+  Segment tail{it->second.end, it->second.counts};
+  it->second.end = pos;
+  m_segments.emplace_hint(next(it), pos, move(tail));
+}
+
+IncrementalUsage::SegmentMap::iterator IncrementalUsage::joinNext(SegmentMap::iterator it) {
+  auto next = std::next(it);
+  while (next != m_segments.end() && next->first == it->second.end && next->second.counts == it->second.counts) {
+    it->second.end = next->second.end;
+    next = m_segments.erase(next);
+  }
+  return next;
+}
+
+void IncrementalUsage::account(__u64 len, const vector<__u32>& counts, bool subtract) {
+  // Unsigned arithmetic wraps around, so subtracting is adding -len
+  const __u64 d = subtract ? -len : len;
+  const size_t n = m_usage.n;
+  size_t active = 0, last = 0;
+  for (size_t a = 0; a < n; ++a) {
+    if (!counts[a])
+      continue;
+    ++active;
+    last = a;
+    for (size_t b = 0; b < n; ++b)
+      if (counts[b])
+        m_usage.pairwise[a * n + b] += d;
+    m_usage.total[a] += d;
+  }
+  if (!active)
+    return;
+  m_usage.unionTotal += d;
+  if (active == 1)
+    m_usage.exclusive[last] += d;
+}
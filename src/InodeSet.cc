@@ -0,0 +1,99 @@
+/** Compact hash set of (device, inode) pairs (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "InodeSet.hh"
+#include <utility>
+using namespace std;
+
+/// Mixes device and inode numbers (splitmix64 finalizer)
+static inline __u64 hashInode(__u64 dev, __u64 ino) {
+  __u64 x = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+InodeSet::InodeSet(size_t capacity) {
+  size_t n = 16;
+  while (n < 2 * capacity)
+    n *= 2;
+  m_initialSlots = n;
+}
+
+size_t InodeSet::find(__u64 dev, __u64 ino) const {
+  const size_t mask = m_slots.size() - 1;
+  size_t i = hashInode(dev, ino) & mask;
+  while (m_slots[i].ino && (m_slots[i].ino != ino || m_slots[i].dev != dev))
+    i = (i + 1) & mask;
+  return i;
+}
+
+bool InodeSet::insert(__u64 dev, __u64 ino) {
+  if (!ino) // Cannot be stored, treat it as always new
+    return true;
+  if (m_slots.empty())
+    m_slots.resize(m_initialSlots);
+  size_t i = find(dev, ino);
+  if (m_slots[i].ino)
+    return false;
+  if (2 * (m_size + 1) > m_slots.size()) {
+    grow();
+    i = find(dev, ino);
+  }
+  m_slots[i].dev = dev;
+  m_slots[i].ino = ino;
+  ++m_size;
+  return true;
+}
+
+bool InodeSet::contains(__u64 dev, __u64 ino) const {
+  return !m_slots.empty() && m_slots[find(dev, ino)].ino;
+}
+
+void InodeSet::grow() {
+  vector<Slot> old(2 * m_slots.size());
+  swap(old, m_slots);
+  for (const Slot& s : old)
+    if (s.ino)
+      m_slots[find(s.dev, s.ino)] = s;
+}
+
+/// Initial capacity of each shard, which grows as needed
+static constexpr size_t SHARD_CAPACITY = 8;
+
+ConcurrentInodeSet::ConcurrentInodeSet() {
+  for (Shard& shard : m_shards)
+    shard.set = InodeSet(SHARD_CAPACITY);
+}
+
+bool ConcurrentInodeSet::insert(__u64 dev, __u64 ino) {
+  // Use the high bits, the low ones select the slot within the shard
+  Shard& shard = m_shards[hashInode(dev, ino) >> 58];
+  lock_guard<mutex> lock(shard.mutex);
+  return shard.set.insert(dev, ino);
+}
+
+size_t ConcurrentInodeSet::size() const {
+  size_t n = 0;
+  for (const Shard& shard : m_shards) {
+    lock_guard<mutex> lock(shard.mutex);
+    n += shard.set.size();
+  }
+  return n;
+}
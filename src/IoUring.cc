@@ -0,0 +1,187 @@
+/** Minimal io_uring wrapper used to batch metadata syscalls
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "IoUring.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline unsigned loadAcquire(const unsigned* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void storeRelease(unsigned* p, unsigned x) { __atomic_store_n(p, x, __ATOMIC_RELEASE); }
+
+static void* mapRing(int fd, std::size_t size, __u64 offset) {
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  if (p == MAP_FAILED)
+    throw std::system_error(errno, std::generic_category(), "io_uring mmap failed");
+  return p;
+}
+
+IoUring::IoUring(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    throw std::system_error(errno, std::generic_category(), "io_uring_setup failed");
+  m_fd = fd;
+  m_sqEntries = params.sq_entries;
+  m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  // The destructor is not called if the constructor throws
+  try {
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+      m_sqRing = m_cqRing = mapRing(fd, m_sqRingSize, IORING_OFF_SQ_RING);
+    } else {
+      m_sqRing = mapRing(fd, m_sqRingSize, IORING_OFF_SQ_RING);
+      m_cqRing = mapRing(fd, m_cqRingSize, IORING_OFF_CQ_RING);
+    }
+    m_sqes = (io_uring_sqe*)mapRing(fd, m_sqesSize, IORING_OFF_SQES);
+  } catch (...) {
+    release();
+    throw;
+  }
+  char* sq = (char*)m_sqRing;
+  m_sqHead = (unsigned*)(sq + params.sq_off.head);
+  m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+  m_sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+  m_sqArray = (unsigned*)(sq + params.sq_off.array);
+  char* cq = (char*)m_cqRing;
+  m_cqHead = (unsigned*)(cq + params.cq_off.head);
+  m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+  m_cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+  m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+  m_sqeTail = m_submitted = *m_sqTail;
+}
+
+void IoUring::release() {
+  if (m_sqes)
+    munmap(m_sqes, m_sqesSize);
+  if (m_cqRing && m_cqRing != m_sqRing)
+    munmap(m_cqRing, m_cqRingSize);
+  if (m_sqRing)
+    munmap(m_sqRing, m_sqRingSize);
+  m_sqes = nullptr;
+  m_sqRing = m_cqRing = nullptr;
+  if (m_fd > -1)
+    ::close(m_fd);
+  m_fd = -1;
+}
+
+bool IoUring::supported() {
+  static const bool result = [] {
+    try {
+      IoUring ring(1);
+      std::vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+      io_uring_probe* probe = (io_uring_probe*)buf.data();
+      if (syscall(__NR_io_uring_register, ring.m_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+      for (int op : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_CLOSE})
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+          return false;
+      return true;
+    } catch (const std::system_error&) {
+      return false;
+    }
+  }();
+  return result;
+}
+
+io_uring_sqe* IoUring::nextSqe() {
+  if (m_sqeTail - loadAcquire(m_sqHead) >= m_sqEntries)
+    return nullptr;
+  const unsigned i = m_sqeTail & *m_sqMask;
+  io_uring_sqe* sqe = &m_sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sqArray[i] = i;
+  ++m_sqeTail;
+  return sqe;
+}
+
+bool IoUring::openat(int dirfd, const char* path, int flags, __u64 userData) {
+  io_uring_sqe* sqe = nextSqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = dirfd;
+  sqe->addr = (__u64)path;
+  sqe->open_flags = flags;
+  sqe->user_data = userData;
+  return true;
+}
+
+bool IoUring::statx(int dirfd, const char* path, int flags, unsigned mask, struct statx* buf, __u64 userData) {
+  io_uring_sqe* sqe = nextSqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (__u64)path;
+  sqe->len = mask;
+  sqe->off = (__u64)buf;
+  sqe->statx_flags = flags;
+  sqe->user_data = userData;
+  return true;
+}
+
+bool IoUring::close(int fd, __u64 userData) {
+  io_uring_sqe* sqe = nextSqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  sqe->user_data = userData;
+  return true;
+}
+
+void IoUring::submit(unsigned waitNr) {
+  storeRelease(m_sqTail, m_sqeTail);
+  do {
+    const unsigned toSubmit = m_sqeTail - m_submitted;
+    const unsigned flags = waitNr ? IORING_ENTER_GETEVENTS : 0;
+    if (!toSubmit && !waitNr)
+      return;
+    int n = syscall(__NR_io_uring_enter, m_fd, toSubmit, waitNr, flags, nullptr, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "io_uring_enter failed");
+    }
+    m_submitted += n;
+    if (m_submitted == m_sqeTail)
+      return; // Waiting (if requested) has been done by the same call
+  } while (true);
+}
+
+bool IoUring::complete(__u64& userData, __s32& res) {
+  const unsigned head = *m_cqHead;
+  if (head == loadAcquire(m_cqTail))
+    return false;
+  const io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+  userData = cqe.user_data;
+  res = cqe.res;
+  storeRelease(m_cqHead, head + 1);
+  return true;
+}
@@ -0,0 +1,364 @@
+/** Multi-threaded union and intersection of extent sets.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentKernels.hh"
+#include "Extents.hh"
+#include "FlatExtentSet.hh"
+#include "HybridExtentSet.hh"
+#include "ThreadPool.hh"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// The address space is split at sampled extent starts into more ranges
+// than threads, and the threads take the ranges from a shared counter.
+// Each range is computed with the serial kernels on the extents that
+// overlap it, clipped to its boundaries; the extents cut by a boundary are
+// then joined again, so the results are the same as the serial ones.
+
+/// Below this number of extents the serial operators are used
+static constexpr size_t MIN_PARALLEL = 1 << 15;
+
+/// Ranges per thread, to even out unbalanced splitters
+static constexpr size_t RANGES_PER_THREAD = 4;
+
+/// Samples taken per range to choose the splitters
+static constexpr size_t SAMPLES_PER_RANGE = 16;
+
+/// Signature of intersectExtents and unionExtents
+typedef void (*Kernel)(const Extent* a, size_t na, const Extent* b, size_t nb, vector<Extent>& out);
+
+/// Returns the number of threads to use (0 = one per core)
+static unsigned resolveThreads(unsigned threads) {
+  return threads ? threads : max(1u, thread::hardware_concurrency());
+}
+
+/// Calls f(r) for each r in [0, n) on up to the given number of threads
+/// (those of pool if not null), rethrowing the first exception thrown
+static void parallelFor(size_t n, unsigned threads, const function<void(size_t)>& f, ThreadPool* pool = nullptr) {
+  atomic<size_t> next(0);
+  exception_ptr error;
+  mutex errorMutex;
+  auto work = [&]() {
+    try {
+      for (size_t r; (r = next++) < n;)
+        f(r);
+    } catch (...) {
+      lock_guard<mutex> lock(errorMutex);
+      if (!error)
+        error = current_exception();
+      next = n;
+    }
+  };
+  if (pool) {
+    pool->run(min<size_t>({threads, n, pool->size()}), [&](unsigned) { work(); });
+  } else {
+    vector<thread> workers;
+    for (size_t i = 1; i < min<size_t>(threads, n); ++i)
+      workers.emplace_back(work);
+    work();
+    for (thread& t : workers)
+      t.join();
+  }
+  if (error)
+    rethrow_exception(error);
+}
+
+/// Appends the starts of count extents of v, evenly spaced by rank
+static void sampleArray(const vector<Extent>& v, size_t count, vector<__u64>& samples) {
+  for (size_t k = 0; k < count && !v.empty(); ++k)
+    samples.push_back(v[k * v.size() / count].start());
+}
+
+/// Appends the starts of the extents found at count addresses evenly
+/// spaced over [lo, hi). A tree cannot be sampled by rank, so these
+/// ranges are balanced by address span rather than by number of extents
+static void sampleTree(const set<Extent>& s, __u64 lo, __u64 hi, size_t count, vector<__u64>& samples) {
+  for (size_t k = 0; k < count; ++k) {
+    const __u64 addr = lo + (__u64)((long double)(hi - lo) * k / count);
+    auto it = s.lower_bound(Extent(addr, 1));
+    if (it != s.end())
+      samples.push_back(it->start());
+  }
+}
+
+/// Returns the boundaries of (at most) the given number of ranges, from
+/// zero to the maximum address, at the quantiles of the samples
+static vector<__u64> boundaries(vector<__u64>& samples, size_t ranges) {
+  sort(samples.begin(), samples.end());
+  vector<__u64> bounds{0};
+  for (size_t k = 1; k < ranges && !samples.empty(); ++k) {
+    const __u64 x = samples[k * samples.size() / ranges];
+    if (x > bounds.back())
+      bounds.push_back(x);
+  }
+  bounds.push_back(numeric_limits<__u64>::max());
+  return bounds;
+}
+
+/// Returns the extents of v that overlap [lo, hi)
+static pair<const Extent*, const Extent*> slice(const vector<Extent>& v, __u64 lo, __u64 hi) {
+  const Extent* first = v.data() + firstEndingAfter(v.data(), v.size(), lo);
+  const Extent* last = partition_point(first, v.data() + v.size(), [hi](const Extent& x) { return x.start() < hi; });
+  return {first, last};
+}
+
+/// Returns the extents of s that overlap [lo, hi)
+static pair<set<Extent>::const_iterator, set<Extent>::const_iterator> slice(const set<Extent>& s, __u64 lo, __u64 hi) {
+  auto first = s.lower_bound(Extent(lo, 1));
+  if (first != s.begin() && prev(first)->end() > lo)
+    --first;
+  return {first, s.lower_bound(Extent(hi, 1))};
+}
+
+/// Clips v, the result of a kernel on the extents overlapping [lo, hi),
+/// to [lo, hi): only the first and the last extents can cross them
+static void clip(vector<Extent>& v, __u64 lo, __u64 hi) {
+  if (v.empty())
+    return;
+  v.front() = Extent::FromTo(max(v.front().start(), lo), v.front().end());
+  v.back() = Extent::FromTo(v.back().start(), min(v.back().end(), hi));
+}
+
+/// Joins the extents cut at the boundaries of the ranges, returning for
+/// each part the index of its first extent not joined to a previous one
+static vector<size_t> stitch(vector<vector<Extent>>& parts) {
+  vector<size_t> first(parts.size(), 0);
+  Extent* last = nullptr;
+  for (size_t r = 0; r < parts.size(); ++r) {
+    if (parts[r].empty())
+      continue;
+    if (last && last->end() == parts[r].front().start()) {
+      *last = Extent::FromTo(last->start(), parts[r].front().end());
+      first[r] = 1;
+    }
+    if (parts[r].size() > first[r])
+      last = &parts[r].back();
+  }
+  return first;
+}
+
+/// Applies kernel to each range of a and b, returning the results of the
+/// ranges, stitched, and the index of the first extent of each of them
+static vector<vector<Extent>> applyKernel(Kernel kernel, const vector<Extent>& a, const vector<Extent>& b,
+                                          unsigned threads, vector<size_t>& first, ThreadPool* pool = nullptr) {
+  const size_t ranges = threads * RANGES_PER_THREAD, count = ranges * SAMPLES_PER_RANGE;
+  vector<__u64> samples;
+  sampleArray(a, count * a.size() / (a.size() + b.size()) + 1, samples);
+  sampleArray(b, count * b.size() / (a.size() + b.size()) + 1, samples);
+  const vector<__u64> bounds = boundaries(samples, ranges);
+  vector<vector<Extent>> parts(bounds.size() - 1);
+  parallelFor(parts.size(), threads, [&](size_t r) {
+    const auto sa = slice(a, bounds[r], bounds[r + 1]), sb = slice(b, bounds[r], bounds[r + 1]);
+    kernel(sa.first, sa.second - sa.first, sb.first, sb.second - sb.first, parts[r]);
+    clip(parts[r], bounds[r], bounds[r + 1]);
+  }, pool);
+  first = stitch(parts);
+  return parts;
+}
+
+/// Same as above, for non-empty trees: the extents of each range are
+/// copied to arrays for the kernel
+static vector<vector<Extent>> applyKernel(Kernel kernel, const set<Extent>& a, const set<Extent>& b,
+                                          unsigned threads, vector<size_t>& first, ThreadPool* pool = nullptr) {
+  const size_t ranges = threads * RANGES_PER_THREAD, count = ranges * SAMPLES_PER_RANGE;
+  const __u64 lo = min(a.begin()->start(), b.begin()->start());
+  const __u64 hi = max(a.rbegin()->end(), b.rbegin()->end());
+  vector<__u64> samples;
+  sampleTree(a, lo, hi, count * a.size() / (a.size() + b.size()) + 1, samples);
+  sampleTree(b, lo, hi, count * b.size() / (a.size() + b.size()) + 1, samples);
+  const vector<__u64> bounds = boundaries(samples, ranges);
+  vector<vector<Extent>> parts(bounds.size() - 1);
+  parallelFor(parts.size(), threads, [&](size_t r) {
+    const auto sa = slice(a, bounds[r], bounds[r + 1]), sb = slice(b, bounds[r], bounds[r + 1]);
+    vector<Extent> va, vb; // Filled in a single pass (the size of a slice is not known)
+    for (auto it = sa.first; it != sa.second; ++it)
+      va.push_back(*it);
+    for (auto it = sb.first; it != sb.second; ++it)
+      vb.push_back(*it);
+    kernel(va.data(), va.size(), vb.data(), vb.size(), parts[r]);
+    clip(parts[r], bounds[r], bounds[r + 1]);
+  }, pool);
+  first = stitch(parts);
+  return parts;
+}
+
+/// Concatenates the stitched parts into out, freeing them, and returns
+/// the total length
+static __u64 concatenate(vector<vector<Extent>>& parts, const vector<size_t>& first, unsigned threads,
+                         vector<Extent>& out, ThreadPool* pool = nullptr) {
+  vector<size_t> offset(parts.size() + 1, 0);
+  for (size_t r = 0; r < parts.size(); ++r)
+    offset[r + 1] = offset[r] + parts[r].size() - first[r];
+  out.resize(offset.back());
+  vector<__u64> lengths(parts.size(), 0);
+  parallelFor(parts.size(), threads, [&](size_t r) {
+    for (size_t i = first[r]; i < parts[r].size(); ++i) {
+      out[offset[r] + i - first[r]] = parts[r][i];
+      lengths[r] += parts[r][i].length();
+    }
+    vector<Extent>().swap(parts[r]);
+  }, pool);
+  __u64 total = 0;
+  for (__u64 l : lengths)
+    total += l;
+  return total;
+}
+
+/// Builds out (which must be empty) from the stitched parts, freeing them,
+/// and returns its total length. Each thread allocates the nodes of a
+/// range, which are then moved to out in order (each at the end, in
+/// amortized constant time).
+static __u64 build(vector<vector<Extent>>& parts, const vector<size_t>& first, unsigned threads, set<Extent>& out,
+                   ThreadPool* pool = nullptr) {
+  vector<set<Extent>> trees(parts.size());
+  vector<__u64> lengths(parts.size(), 0);
+  parallelFor(parts.size(), threads, [&](size_t r) {
+    for (size_t i = first[r]; i < parts[r].size(); ++i) {
+      trees[r].emplace_hint(trees[r].end(), parts[r][i]);
+      lengths[r] += parts[r][i].length();
+    }
+    vector<Extent>().swap(parts[r]);
+  }, pool);
+  __u64 total = 0;
+  for (size_t r = 0; r < trees.size(); ++r) {
+    while (!trees[r].empty())
+      out.insert(out.end(), trees[r].extract(trees[r].begin()));
+    total += lengths[r];
+  }
+  return total;
+}
+
+
+ExtentSet parallelIntersection(const ExtentSet& lhs, const ExtentSet& rhs, unsigned threads) {
+  threads = resolveThreads(threads);
+  if (threads == 1 || lhs.empty() || rhs.empty() || lhs.size() + rhs.size() < MIN_PARALLEL)
+    return lhs & rhs;
+  vector<size_t> first;
+  vector<vector<Extent>> parts = applyKernel(intersectExtents, lhs.m_set, rhs.m_set, threads, first);
+  ExtentSet res;
+  res.m_totalLength = build(parts, first, threads, res.m_set);
+  return res;
+}
+
+ExtentSet& ExtentSet::parallelUnion(const ExtentSet& rhs, unsigned threads, ThreadPool* pool) {
+  threads = resolveThreads(threads);
+  if (&rhs == this || rhs.empty())
+    return *this;
+  if (empty()) {
+    m_set = rhs.m_set;
+    m_totalLength = rhs.m_totalLength;
+    return *this;
+  }
+  // The whole tree is rebuilt, which is not worth it to add a few extents
+  if (threads == 1 || rhs.size() < MIN_PARALLEL || rhs.size() * 8 < size())
+    return *this |= rhs;
+  vector<size_t> first;
+  vector<vector<Extent>> parts = applyKernel(unionExtents, m_set, rhs.m_set, threads, first, pool);
+  set<Extent> res;
+  m_totalLength = build(parts, first, threads, res, pool);
+  m_set.swap(res);
+  return *this;
+}
+
+
+FlatExtentSet parallelIntersection(const FlatExtentSet& lhs, const FlatExtentSet& rhs, unsigned threads) {
+  threads = resolveThreads(threads);
+  if (threads == 1 || lhs.empty() || rhs.empty() || lhs.storedExtents() + rhs.storedExtents() < MIN_PARALLEL)
+    return lhs & rhs;
+  lhs.flush();
+  rhs.flush();
+  vector<size_t> first;
+  vector<vector<Extent>> parts = applyKernel(intersectExtents, lhs.m_set, rhs.m_set, threads, first);
+  FlatExtentSet res;
+  res.m_totalLength = concatenate(parts, first, threads, res.m_set);
+  return res;
+}
+
+FlatExtentSet& FlatExtentSet::parallelUnion(const FlatExtentSet& rhs, unsigned threads, ThreadPool* pool) {
+  threads = resolveThreads(threads);
+  if (threads == 1 || &rhs == this || empty() || rhs.empty() || storedExtents() + rhs.storedExtents() < MIN_PARALLEL)
+    return *this |= rhs;
+  flush();
+  rhs.flush();
+  vector<size_t> first;
+  vector<vector<Extent>> parts = applyKernel(unionExtents, m_set, rhs.m_set, threads, first, pool);
+  vector<Extent> res;
+  m_totalLength = concatenate(parts, first, threads, res, pool);
+  m_set.swap(res);
+  m_prefixValid = false;
+  return *this;
+}
+
+
+// Chunks of a HybridExtentSet are independent, so they are simply
+// distributed among the threads, without splitting the address space
+
+HybridExtentSet parallelIntersection(const HybridExtentSet& lhs, const HybridExtentSet& rhs, unsigned threads) {
+  threads = resolveThreads(threads);
+  if (threads == 1 || lhs.m_chunks.size() < 2 || rhs.m_chunks.size() < 2)
+    return lhs & rhs;
+  typedef HybridExtentSet::ChunkMap::const_iterator ChunkIterator;
+  vector<pair<ChunkIterator, ChunkIterator>> pairs;
+  for (ChunkIterator i = lhs.m_chunks.begin(), j = rhs.m_chunks.begin(); i != lhs.m_chunks.end() && j != rhs.m_chunks.end();) {
+    if (i->first < j->first) {
+      ++i;
+    } else if (j->first < i->first) {
+      ++j;
+    } else {
+      pairs.emplace_back(i++, j++);
+    }
+  }
+  vector<HybridExtentSet::Chunk> chunks(pairs.size());
+  parallelFor(pairs.size(), threads, [&](size_t r) {
+    HybridExtentSet::intersectChunk(pairs[r].first->second, pairs[r].second->second, pairs[r].first->first << HybridExtentSet::CHUNK_SHIFT, chunks[r]);
+  });
+  HybridExtentSet res;
+  for (size_t r = 0; r < pairs.size(); ++r)
+    if (chunks[r].length)
+      res.m_chunks.emplace_hint(res.m_chunks.end(), pairs[r].first->first, move(chunks[r]));
+  res.recount();
+  return res;
+}
+
+HybridExtentSet& HybridExtentSet::parallelUnion(const HybridExtentSet& rhs, unsigned threads, ThreadPool* pool) {
+  threads = resolveThreads(threads);
+  if (threads == 1 || &rhs == this || rhs.m_chunks.size() < 2)
+    return *this |= rhs;
+  // The chunks missing here are copied serially, the others joined in parallel
+  vector<pair<Chunk*, ChunkMap::const_iterator>> shared;
+  for (ChunkMap::const_iterator p = rhs.m_chunks.begin(); p != rhs.m_chunks.end(); ++p) {
+    auto it = m_chunks.lower_bound(p->first);
+    if (it == m_chunks.end() || it->first != p->first)
+      m_chunks.emplace_hint(it, p->first, p->second);
+    else
+      shared.emplace_back(&it->second, p);
+  }
+  parallelFor(shared.size(), threads, [&](size_t r) {
+    unionChunk(*shared[r].first, shared[r].second->second, shared[r].second->first << CHUNK_SHIFT);
+  }, pool);
+  recount();
+  return *this;
+}
@@ -0,0 +1,76 @@
+/** Optional instrumentation of directory scans (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ScanStats.hh"
+#include <algorithm>
+#include <iomanip>
+#include <string>
+using namespace std;
+
+/// Calls f(name, counter of each struct...) for each counter of the given
+/// structs (or f(name, nanoseconds...) for the timings), in output order
+template <class F, class... S>
+static void forEachStat(F f, S&... s) {
+  f("files", s.files...);
+  f("directories", s.directories...);
+  f("hardlinksSkipped", s.hardlinksSkipped...);
+  f("cacheHits", s.cacheHits...);
+  f("otherSkipped", s.otherSkipped...);
+  f("excludedSkipped", s.excludedSkipped...);
+  f("otherFsSkipped", s.otherFsSkipped...);
+  f("errors", s.errors...);
+  f("fiemapCalls", s.fiemapCalls...);
+  f("extentsReturned", s.extentsReturned...);
+  f("extentsInserted", s.extentsInserted...);
+  f("coalescedExtents", s.coalescedExtents...);
+  f("bufferReallocs", s.bufferReallocs...);
+  f("peakSetExtents", s.peakSetExtents...);
+  f("readdirNs", s.readdirNs...);
+  f("openNs", s.openNs...);
+  f("ioctlNs", s.ioctlNs...);
+  f("insertNs", s.insertNs...);
+  f("wallNs", s.wallNs...);
+}
+
+ScanStats& ScanStats::operator+=(const ScanStats& rhs) {
+  // Peaks of sets alive at the same time add up, like the counters
+  forEachStat([](const char*, __u64& x, const __u64& y) { x += y; }, *this, rhs);
+  peakRssKiB = max(peakRssKiB, rhs.peakRssKiB);
+  return *this;
+}
+
+void ScanStats::writeJson(ostream& out) const {
+  char sep = '{';
+  forEachStat([&](const char* name, __u64 x) {
+    out << sep << '"' << name << "\":" << x;
+    sep = ',';
+  }, *this);
+  out << ",\"peakRssKiB\":" << peakRssKiB << "}\n";
+}
+
+void ScanStats::print(ostream& out) const {
+  forEachStat([&](const char* name, __u64 x) {
+    const string n = name;
+    if (n.size() > 2 && n.compare(n.size() - 2, 2, "Ns") == 0)
+      out << setw(18) << left << n.substr(0, n.size() - 2) + " (s)" << fixed << setprecision(3) << x * 1e-9 << '\n';
+    else
+      out << setw(18) << left << n << x << '\n';
+  }, *this);
+  out << setw(18) << left << "peakRss (KiB)" << peakRssKiB << endl;
+}
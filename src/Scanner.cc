@@ -0,0 +1,85 @@
+/** Reusable scanning context, the entry point of libsnapsize
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Scanner.hh"
+#include "FlatExtentSet.hh"
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <sys/stat.h>
+using namespace std;
+
+Scanner::Scanner(const ScanOptions& opts) : m_opts(opts), m_pool(opts.threads) {}
+
+void Scanner::useCache(const string& path) {
+  m_cache = make_unique<ExtentCache>(path, !path.empty());
+}
+
+void Scanner::saveCache(size_t maxBytes) const {
+  if (!m_cache)
+    throw logic_error("Scanner::saveCache: no cache in use");
+  m_cache->save(maxBytes);
+}
+
+ScanOptions Scanner::queryOptions() {
+  m_cancel = false;
+  ScanOptions opts = m_opts;
+  opts.pool = &m_pool;
+  opts.cache = m_cache.get();
+  opts.trace = m_onFile ? this : nullptr;
+  opts.progress = m_onDirectory ? this : nullptr;
+  opts.cancel = &m_cancel;
+  return opts;
+}
+
+bool Scanner::readFile(const string& path, vector<Extent>& extents) {
+  if (m_opts.source)
+    return false;
+  struct stat st;
+  if (lstat(path.c_str(), &st))
+    throw system_error(errno, generic_category(), "Could not stat " + path);
+  if (S_ISDIR(st.st_mode))
+    return false;
+  if (!S_ISREG(st.st_mode))
+    throw runtime_error("Neither regular file nor directory: " + path);
+  FlatExtentSet es;
+  es.insertFromFile(path.c_str());
+  extents.assign(es.begin(), es.end());
+  if (m_onFile)
+    m_onFile(path, st.st_ino, extents);
+  return true;
+}
+
+SharedUsage Scanner::usage(const vector<string>& paths, ScanSummary* summary) {
+  const ScanOptions opts = queryOptions(); // A cancellation between two paths stops the query
+  vector<FlatExtentSet> sets(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const ScanSummary s = scanPath(paths[i], sets[i], opts);
+    if (summary)
+      *summary += s;
+  }
+  return sharedUsage(sets);
+}
+
+void Scanner::add(const string& path, __u64, __u64 ino, __u64, const vector<Extent>& extents) {
+  m_onFile(path, ino, extents);
+}
+
+void Scanner::directoryDone(const string& path, size_t files, __s64 bytes) { m_onDirectory(path, files, bytes); }
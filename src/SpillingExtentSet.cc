@@ -0,0 +1,199 @@
+/** External-memory extent set, spilling sorted runs to disk when it
+ * exceeds a memory budget (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "SpillingExtentSet.hh"
+#include "ExtentSweep.hh"
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+using namespace std;
+
+size_t SpillingExtentSet::s_defaultMemoryLimit = 1ULL << 30;
+string SpillingExtentSet::s_tempDir;
+
+void SpillingExtentSet::configure(size_t defaultMemoryLimit, string tempDir) {
+  s_defaultMemoryLimit = defaultMemoryLimit;
+  s_tempDir = move(tempDir);
+}
+
+SpillingExtentSet::Run::~Run() {
+  map.reset();
+  if (!path.empty()) // Not mapped yet
+    unlink(path.c_str());
+}
+
+void SpillingExtentSet::Run::mapAndUnlink() {
+  map = make_unique<MappedExtentDump>(path.c_str());
+  unlink(path.c_str());
+  path.clear();
+}
+
+string SpillingExtentSet::tempFile() {
+  string dir = s_tempDir;
+  if (dir.empty()) {
+    const char* tmp = getenv("TMPDIR");
+    dir = (tmp && *tmp) ? tmp : "/tmp";
+  }
+  string path = dir + "/snapsize-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+    throw runtime_error("Could not create temporary file in " + dir);
+  close(fd);
+  return path;
+}
+
+void SpillingExtentSet::insert(Extent x) {
+  m_mem.insert(x);
+  m_totalValid = false;
+  // Vectors double their capacity when they grow, so spilling at half the
+  // budget keeps the peak within it
+  if (2 * m_mem.memoryUsage() > m_memoryLimit)
+    spill();
+}
+
+void SpillingExtentSet::clear() {
+  m_mem = FlatExtentSet();
+  m_runs.clear();
+  m_totalSize = 0;
+  m_totalValid = true;
+  m_runsLength = 0;
+}
+
+void SpillingExtentSet::spill() const {
+  if (m_mem.empty())
+    return;
+  auto run = make_shared<Run>(tempFile());
+  writeExtentDump(run->path, m_mem);
+  m_runsLength += m_mem.totalLength();
+  run->mapAndUnlink();
+  m_runs.push_back(move(run));
+  m_mem = FlatExtentSet(); // Also releases the memory
+  if (m_runs.size() > MAX_RUNS)
+    mergeRuns();
+}
+
+void SpillingExtentSet::mergeRuns() const {
+  if (m_runs.size() < 2)
+    return;
+  vector<pair<MappedExtentDump::iterator, MappedExtentDump::iterator>> ranges;
+  for (const shared_ptr<Run>& r : m_runs)
+    ranges.emplace_back(r->map->begin(), r->map->end());
+  auto run = make_shared<Run>(tempFile());
+  ExtentDumpWriter w(run->path);
+  m_runsLength = 0;
+  sweepExtents(move(ranges), [&](__u64 start, __u64 end, const vector<size_t>&) {
+    w.append(Extent::FromTo(start, end));
+    m_runsLength += end - start;
+  });
+  w.close();
+  run->mapAndUnlink();
+  m_runs.clear();
+  m_runs.push_back(move(run));
+}
+
+void SpillingExtentSet::consolidate() const {
+  if (m_runs.empty())
+    return;
+  spill();
+  mergeRuns();
+}
+
+size_t SpillingExtentSet::size() const {
+  size_t n = 0;
+  for (iterator it = begin(); it != end(); ++it)
+    ++n;
+  return n;
+}
+
+Extent SpillingExtentSet::first() const {
+  if (empty())
+    throw out_of_range("The SpillingExtentSet is empty");
+  return *begin();
+}
+
+Extent SpillingExtentSet::last() const {
+  if (empty())
+    throw out_of_range("The SpillingExtentSet is empty");
+  Extent x;
+  for (iterator it = begin(); it != end(); ++it)
+    x = *it;
+  return x;
+}
+
+SpillingExtentSet::iterator SpillingExtentSet::begin() const {
+  consolidate();
+  if (m_runs.empty())
+    return iterator(m_mem.begin());
+  return iterator(m_runs[0]->map->begin());
+}
+
+SpillingExtentSet::iterator SpillingExtentSet::end() const {
+  consolidate();
+  if (m_runs.empty())
+    return iterator(m_mem.end());
+  return iterator(m_runs[0]->map->end());
+}
+
+__u64 SpillingExtentSet::totalLength() const {
+  if (!m_totalValid) {
+    m_totalSize = 0;
+    for (iterator it = begin(); it != end(); ++it)
+      m_totalSize += it->length();
+    m_totalValid = true;
+  }
+  return m_totalSize;
+}
+
+__u64 SpillingExtentSet::lengthWithin(const Extent& range) const {
+  __u64 res = 0;
+  for (iterator it = begin(), e = end(); it != e && it->start() < range.end(); ++it)
+    res += (*it & range).length();
+  return res;
+}
+
+SpillingExtentSet operator&(const SpillingExtentSet& lhs, const SpillingExtentSet& rhs) {
+  SpillingExtentSet res(lhs.m_memoryLimit);
+  SpillingExtentSet::iterator a = lhs.begin(), b = rhs.begin();
+  const SpillingExtentSet::iterator aEnd = lhs.end(), bEnd = rhs.end();
+  while (a != aEnd && b != bEnd) {
+    if (a->overlaps(*b))
+      res.insert(*a & *b);
+    if (a->end() < b->end())
+      ++a;
+    else
+      ++b;
+  }
+  return res;
+}
+
+SpillingExtentSet& SpillingExtentSet::operator|=(const SpillingExtentSet& rhs) {
+  if (&rhs == this || rhs.empty())
+    return *this;
+  // Runs are immutable, so they can just be shared and merged later
+  for (const shared_ptr<Run>& r : rhs.m_runs)
+    m_runs.push_back(r);
+  m_runsLength += rhs.m_runsLength;
+  for (const Extent& x : rhs.m_mem)
+    insert(x);
+  m_totalValid = false;
+  if (m_runs.size() > MAX_RUNS)
+    mergeRuns();
+  return *this;
+}
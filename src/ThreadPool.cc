@@ -0,0 +1,96 @@
+/** Fixed set of threads reused across parallel runs (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ThreadPool.hh"
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (!threads)
+    threads = max(1u, thread::hardware_concurrency());
+  m_threads.reserve(threads - 1);
+  for (unsigned i = 1; i < threads; ++i)
+    m_threads.emplace_back(&ThreadPool::loop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_exit = true;
+  }
+  m_start.notify_all();
+  for (thread& t : m_threads)
+    t.join();
+}
+
+void ThreadPool::run(unsigned n, const function<void(unsigned)>& f) {
+  if (n > size())
+    throw invalid_argument("ThreadPool::run: more tasks than threads");
+  if (!n)
+    return;
+  lock_guard<mutex> runLock(m_runMutex);
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_task = &f;
+    m_n = n;
+    m_running = n - 1;
+    m_error = nullptr;
+    ++m_generation;
+  }
+  m_start.notify_all();
+  try {
+    f(0);
+  } catch (...) {
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_error)
+      m_error = current_exception();
+  }
+  unique_lock<mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return !m_running; });
+  m_task = nullptr;
+  if (m_error)
+    rethrow_exception(m_error);
+}
+
+void ThreadPool::loop(unsigned i) {
+  unsigned generation = 0;
+  unique_lock<mutex> lock(m_mutex);
+  while (true) {
+    m_start.wait(lock, [&] { return m_exit || m_generation != generation; });
+    if (m_exit)
+      return;
+    generation = m_generation;
+    if (i >= m_n)
+      continue;
+    const function<void(unsigned)>& f = *m_task;
+    lock.unlock();
+    try {
+      f(i);
+    } catch (...) {
+      lock.lock();
+      if (!m_error)
+        m_error = current_exception();
+      lock.unlock();
+    }
+    lock.lock();
+    if (!--m_running)
+      m_done.notify_one();
+  }
+}
@@ -0,0 +1,165 @@
+/** Change notifications for a directory tree, through inotify
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "TreeWatcher.hh"
+#include "DirectoryReader.hh"
+#include "Extents.hh"
+#include <cerrno>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <system_error>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+/// Events watched on each directory
+static constexpr __u32 WATCH_MASK =
+  IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+/// Returns the path of entry `name` of directory `dir`
+static string childPath(const string& dir, const char* name) {
+  if (!dir.empty() && dir.back() == '/')
+    return dir + name;
+  return dir + '/' + name;
+}
+
+TreeWatcher::TreeWatcher(const vector<string>& exclude, bool oneFileSystem)
+: m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC), "inotify_init1"), m_exclude(exclude), m_oneFileSystem(oneFileSystem),
+  m_buffer(DirectoryReader::DEFAULT_BUFFER_SIZE) {}
+
+void TreeWatcher::watchTree(const string& dir) {
+  vector<string> stack{dir};
+  while (!stack.empty()) {
+    const string path = move(stack.back());
+    stack.pop_back();
+    struct stat st;
+    if (lstat(path.c_str(), &st)) {
+      // Removed in the meantime: its parent reports it
+      if (errno != ENOENT)
+        cerr << quoted(path) << ": " << system_error(errno, generic_category()).what() << endl;
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode))
+      continue;
+    if (m_oneFileSystem) {
+      if (!m_haveDev) {
+        m_dev = st.st_dev;
+        m_haveDev = true;
+      } else if (st.st_dev != m_dev) {
+        continue;
+      }
+    }
+    const int wd = inotify_add_watch(m_fd, path.c_str(), WATCH_MASK);
+    if (wd < 0) {
+      if (errno == ENOSPC || errno == ENOMEM)
+        throw system_error(errno, generic_category(), "Could not watch " + path);
+      cerr << quoted(path) << ": " << system_error(errno, generic_category()).what() << endl;
+      continue;
+    }
+    // The same directory under another name (e.g. moved without events)
+    auto old = m_paths.find(wd);
+    if (old != m_paths.end() && old->second != path)
+      m_watches.erase(old->second);
+    m_paths[wd] = path;
+    m_watches[path] = wd;
+    try {
+      DirectoryReader reader(path.c_str(), m_buffer);
+      DirectoryReader::Entry entry;
+      while (reader.next(entry))
+        if ((entry.type == DT_DIR || entry.type == DT_UNKNOWN) && !isExcluded(m_exclude, path, entry.name))
+          stack.push_back(childPath(path, entry.name));
+    } catch (const exception& e) {
+      cerr << quoted(path) << ": " << e.what() << endl;
+    }
+  }
+}
+
+void TreeWatcher::unwatchTree(const string& dir) {
+  auto unwatch = [&](map<string, int>::iterator it) {
+    // Fails harmlessly if the kernel already removed the watch
+    inotify_rm_watch(m_fd, it->second);
+    m_paths.erase(it->second);
+    return m_watches.erase(it);
+  };
+  auto it = m_watches.find(dir);
+  if (it != m_watches.end())
+    unwatch(it);
+  // The subdirectories are the paths in [prefix, prefix with '/' + 1)
+  const string prefix = !dir.empty() && dir.back() == '/' ? dir : dir + '/';
+  string last = prefix;
+  ++last.back();
+  for (it = m_watches.lower_bound(prefix); it != m_watches.end() && it->first < last;)
+    it = unwatch(it);
+}
+
+bool TreeWatcher::read(vector<Event>& events) {
+  alignas(inotify_event) char buffer[1 << 16];
+  bool any = false;
+  while (true) {
+    const ssize_t n = ::read(m_fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EAGAIN)
+        return any;
+      if (errno == EINTR)
+        continue;
+      throw system_error(errno, generic_category(), "Could not read inotify events");
+    }
+    any = true;
+    const inotify_event* ev;
+    for (ssize_t pos = 0; pos < n; pos += sizeof(inotify_event) + ev->len) {
+      ev = reinterpret_cast<const inotify_event*>(buffer + pos);
+      if (ev->mask & IN_Q_OVERFLOW) {
+        events.push_back({Event::Overflow, string()});
+        continue;
+      }
+      auto it = m_paths.find(ev->wd);
+      if (it == m_paths.end()) // Events queued before unwatchTree
+        continue;
+      if (ev->mask & IN_IGNORED) {
+        auto w = m_watches.find(it->second);
+        if (w != m_watches.end() && w->second == ev->wd)
+          m_watches.erase(w);
+        m_paths.erase(it);
+        continue;
+      }
+      if (!ev->len || isExcluded(m_exclude, it->second, ev->name))
+        continue;
+      const string path = childPath(it->second, ev->name); // watchTree may invalidate it
+      const bool dir = ev->mask & IN_ISDIR;
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (dir) {
+          watchTree(path);
+          events.push_back({Event::DirAdded, path});
+        } else {
+          events.push_back({Event::Changed, path});
+        }
+      } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (dir)
+          unwatchTree(path);
+        events.push_back({dir ? Event::DirRemoved : Event::Removed, path});
+      } else if (ev->mask & IN_CLOSE_WRITE) {
+        events.push_back({Event::Changed, path});
+      }
+    }
+  }
+}
@@ -20,8 +20,10 @@
  */
 #include "UniqueFileDescriptor.hh"
 #include <algorithm>
+#include <cerrno>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <fcntl.h>
 #include <unistd.h>
 using namespace std::string_literals;
@@ -32,10 +34,21 @@ UniqueFileDescriptor::UniqueFileDescriptor(const char* file, int flag) : m_fd(-1
     throw std::runtime_error("Could not open file: "s + m_path);
 }
 
+UniqueFileDescriptor::UniqueFileDescriptor(int dirfd, const char* file, int flag) : m_fd(-1), m_path(file) {
+  m_fd = openat(dirfd, m_path.c_str(), flag);
+  if (m_fd < 0)
+    throw std::runtime_error("Could not open file: "s + m_path);
+}
+
+UniqueFileDescriptor::UniqueFileDescriptor(int fd, const char* what) : m_fd(fd) {
+  if (m_fd < 0)
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
 UniqueFileDescriptor& UniqueFileDescriptor::operator=(UniqueFileDescriptor&& x) {
   close();
   m_fd = std::exchange(x.m_fd, -1);
-  m_path = std::exchange(x.m_path, nullptr);
+  m_path = std::exchange(x.m_path, std::string());
   return *this;
 }
 
@@ -0,0 +1,197 @@
+/** Shared usage of directory trees kept up to date while they change
+ * (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "WatchedUsage.hh"
+#include "FlatExtentSet.hh"
+#include <cerrno>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <utility>
+#include <sys/stat.h>
+using namespace std;
+
+/// Collects the files read by a scan, to link them once it is over
+class FileCollector : public FileExtentsRecorder {
+public:
+  struct File {
+    string path;
+    __u64 dev, ino;
+    vector<Extent> extents;
+  };
+
+  void add(const string& path, __u64 dev, __u64 ino, __u64, const vector<Extent>& extents) override {
+    lock_guard<mutex> lock(m_mutex);
+    files.push_back({path, dev, ino, extents});
+  }
+
+  vector<File> files;
+
+private:
+  mutex m_mutex;
+};
+
+WatchedUsage::WatchedUsage(const vector<string>& roots, const ScanOptions& opts) : m_opts(opts), m_usage(roots.size()) {
+  m_opts.skipHardlinks = false; // Every link must be known
+  m_trees.reserve(roots.size());
+  for (size_t i = 0; i < roots.size(); ++i) {
+    m_trees.emplace_back(roots[i], m_opts);
+    struct stat st;
+    if (!stat(roots[i].c_str(), &st))
+      m_trees[i].dev = st.st_dev;
+    scan(i, roots[i]);
+  }
+}
+
+vector<int> WatchedUsage::fds() const {
+  vector<int> res;
+  for (const Tree& t : m_trees)
+    res.push_back(t.watcher.fd());
+  return res;
+}
+
+size_t WatchedUsage::scan(size_t i, const string& dir) {
+  // Watch first, so that nothing changed during the scan is missed (it
+  // may be read twice)
+  m_trees[i].watcher.watchTree(dir);
+  FileCollector collector;
+  ScanOptions opts = m_opts;
+  opts.trace = &collector;
+  FlatExtentSet discarded; // The extents are taken from the collector
+  discarded.insertFromDir(dir.c_str(), opts);
+  discarded.clear();
+  for (FileCollector::File& f : collector.files)
+    link(i, f.path, {f.dev, f.ino}, move(f.extents));
+  return collector.files.size();
+}
+
+size_t WatchedUsage::update() {
+  size_t changed = 0;
+  vector<TreeWatcher::Event> events;
+  for (size_t i = 0; i < m_trees.size(); ++i) {
+    Tree& t = m_trees[i];
+    events.clear();
+    if (!t.watcher.read(events))
+      continue;
+    // Directories are handled in order; a file is just compared with what
+    // is on disk at the end, however many events it had
+    set<string> dirty;
+    for (const TreeWatcher::Event& e : events) {
+      switch (e.type) {
+      case TreeWatcher::Event::Changed:
+      case TreeWatcher::Event::Removed:
+        dirty.insert(e.path);
+        break;
+      case TreeWatcher::Event::DirAdded:
+        changed += unlinkTree(i, e.path) + scan(i, e.path);
+        break;
+      case TreeWatcher::Event::DirRemoved:
+        changed += unlinkTree(i, e.path);
+        break;
+      case TreeWatcher::Event::Overflow:
+        cerr << quoted(t.root) << ": too many changes at once, scanning it again" << endl;
+        t.watcher.unwatchTree(t.root);
+        changed += unlinkTree(i, t.root) + scan(i, t.root);
+        dirty.clear();
+        break;
+      }
+    }
+    for (const string& path : dirty)
+      refresh(i, path);
+    changed += dirty.size();
+  }
+  return changed;
+}
+
+void WatchedUsage::refresh(size_t i, const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) || !S_ISREG(st.st_mode) || (m_opts.oneFileSystem && st.st_dev != m_trees[i].dev)) {
+    unlink(i, path);
+    return;
+  }
+  FlatExtentSet extents;
+  try {
+    // With delayed allocation the new blocks have no address until they
+    // are written back, which no event would report: force it
+    extents.insertFromFile(path.c_str(), true);
+  } catch (const exception& e) {
+    // Like a scan, skip the files that cannot be read
+    cerr << quoted(path) << ": " << e.what() << endl;
+    unlink(i, path);
+    return;
+  }
+  link(i, path, {st.st_dev, st.st_ino}, vector<Extent>(extents.begin(), extents.end()));
+}
+
+void WatchedUsage::link(size_t i, const string& path, const InodeKey& ino, vector<Extent>&& extents) {
+  Tree& t = m_trees[i];
+  auto f = t.files.find(path);
+  const bool known = f != t.files.end() && f->second == ino;
+  if (f != t.files.end() && !known) // Replaced by another inode
+    unlink(i, path);
+  auto it = t.inodes.find(ino);
+  if (it == t.inodes.end()) {
+    m_usage.add(i, extents);
+    t.inodes.emplace(ino, Inode{move(extents), 1});
+  } else {
+    Inode& inode = it->second;
+    if (inode.extents != extents) {
+      m_usage.remove(i, inode.extents);
+      m_usage.add(i, extents);
+      inode.extents = move(extents);
+    }
+    if (!known)
+      ++inode.links;
+  }
+  t.files[path] = ino;
+}
+
+bool WatchedUsage::unlink(size_t i, const string& path) {
+  Tree& t = m_trees[i];
+  auto f = t.files.find(path);
+  if (f == t.files.end())
+    return false;
+  auto it = t.inodes.find(f->second);
+  if (!--it->second.links) {
+    m_usage.remove(i, it->second.extents);
+    t.inodes.erase(it);
+  }
+  t.files.erase(f);
+  return true;
+}
+
+size_t WatchedUsage::unlinkTree(size_t i, const string& dir) {
+  Tree& t = m_trees[i];
+  // The files below dir are the paths in [prefix, prefix with '/' + 1)
+  const string prefix = !dir.empty() && dir.back() == '/' ? dir : dir + '/';
+  string last = prefix;
+  ++last.back();
+  size_t res = unlink(i, dir);
+  auto f = t.files.lower_bound(prefix);
+  while (f != t.files.end() && f->first < last) {
+    const string path = (f++)->first; // unlink erases it
+    unlink(i, path);
+    ++res;
+  }
+  return res;
+}
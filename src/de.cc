@@ -17,12 +17,50 @@
  * You should have received a copy of the GNU General Public License
  * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
  */
+#include "BlockSketch.hh"
 #include "HumanSize.hh"
+#include "ExtentCache.hh"
+#include "ExtentDump.hh"
+#include "ExtentSource.hh"
 #include "Extents.hh"
+#include "FileUsage.hh"
+#include "FlatExtentSet.hh"
+#include "HybridExtentSet.hh"
+#include "ScanStats.hh"
+#include "SharedUsage.hh"
+#include "SpillingExtentSet.hh"
+#include "TreeUsage.hh"
+#include "UniqueFileDescriptor.hh"
+#include "WatchedUsage.hh"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 using namespace std;
 using namespace std::filesystem;
 using namespace std::string_literals;
@@ -35,36 +73,1076 @@ static path resolve_path(path p) {
   return p;
 }
 
+/// Parses a non-negative decimal integer, returning false on failure
+static bool parseUnsigned(const char* s, unsigned long& x) {
+  char* end;
+  errno = 0;
+  x = strtoul(s, &end, 10);
+  return isdigit(*s) && !*end && !errno;
+}
+
+class ScanMonitor;
+
+/// Largest value of -j: each thread has its own stack and buffers
+static constexpr unsigned long MAX_THREADS = 1024;
+
+/// Command-line options
+struct Options {
+  bool humanReadable = false, verbose = false, shared = false;
+  ScanOptions scan;
+  vector<const char*> files;
+  const char* cachePath = nullptr;
+  unsigned long cacheMaxSize = 0;
+  unsigned long memoryLimit = 0;
+  unsigned long regionSize = 0;
+  bool breakdown = false; // --max-depth or --summarize
+  unsigned long maxDepth = 0;
+  const char* sourceSpec = nullptr;
+  const char* tracePath = nullptr;
+  bool stats = false;
+  const char* statsJson = nullptr;
+  bool cacheReset = false;
+  const char* dumpDir = nullptr;
+  bool fromDumps = false;
+  vector<const char*> keepDumps;
+  const char* writeUnion = nullptr;
+  const char* writeIntersection = nullptr;
+  unsigned long approxSize = 0; // Size of the sketches for --approx (0 = exact)
+  const char* sketchDir = nullptr;
+  bool fromSketches = false;
+  bool watch = false;
+  unsigned long watchInterval = 0; // Minimum seconds between reports
+  const char* watchSocket = nullptr;
+  unsigned long progressInterval = 0; // Seconds between progress reports (0 = none)
+  unsigned long timeBudget = 0; // Seconds before stopping the scan (0 = no limit)
+  ScanMonitor* monitor = nullptr; // Null without --progress and --time-budget
+  unsigned long topFiles = 0; // Files to rank for --top (0 = none)
+  FileUsage* fileUsage = nullptr; // Null without --top
+};
+
+/// Returns the path of the dump (or sketch) of an argument: the argument
+/// with slashes replaced by underscores, followed by extension, in
+/// directory dir
+static string dumpPath(const char* dir, const char* file, const char* extension) {
+  string name = file;
+  for (char& c : name)
+    if (c == '/')
+      c = '_';
+  const size_t first = name.find_first_not_of('_'), last = name.find_last_not_of('_');
+  name = (first == string::npos) ? "root" : name.substr(first, last - first + 1);
+  return (path(dir) / (name + extension)).string();
+}
+
+/// Prints a size, human-readable if requested
+static void printSize(__u64 sz, bool humanReadable, ostream& out = cout) {
+  if (humanReadable)
+    out << HumanSize(sz);
+  else
+    out << sz;
+}
+
+/// Prints an estimated size followed by its error, human-readable if requested
+static void printEstimate(__u64 sz, __u64 error, bool humanReadable, ostream& out = cout) {
+  printSize(sz, humanReadable, out);
+  out << "+-";
+  printSize(error, humanReadable, out);
+}
+
+/// Reports the summary of a directory scan on stderr (for -v)
+static void printSummary(const char* file, const ScanSummary& summary) {
+  cerr << file << ": " << summary.files << " files, " << summary.hardlinksSkipped << " hardlinks skipped, "
+       << summary.cacheHits << " cached, " << summary.errors << " errors" << endl;
+}
+
+/// Reports the progress of the scan on stderr every interval (for
+/// --progress) and cancels it when the time budget runs out (for
+/// --time-budget), from a thread of its own. The workers only add the
+/// files and bytes of each directory to two atomic counters, so reading
+/// the running totals never waits for them nor walks the sets.
+class ScanMonitor : public ScanProgress {
+public:
+  /// Constructor with the arguments (for the reports), the seconds
+  /// between reports and the time budget (0 = none)
+  ScanMonitor(const vector<const char*>& files, bool humanReadable, unsigned long interval, unsigned long budget)
+  : m_files(files), m_humanReadable(humanReadable), m_interval(interval), m_budget(budget),
+    m_start(chrono::steady_clock::now()), m_thread(&ScanMonitor::loop, this) {}
+
+  ~ScanMonitor() override {
+    {
+      lock_guard<mutex> lock(m_mutex);
+      m_done = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+  }
+
+  void directoryDone(const string&, size_t files, __s64 bytes) override {
+    m_argFiles += files;
+    m_argBytes += bytes;
+  }
+
+  /// Called before scanning argument i
+  void startArgument(size_t i) {
+    lock_guard<mutex> lock(m_mutex);
+    m_current = i;
+    m_argFiles = 0;
+    m_argBytes = 0;
+  }
+
+  /// Called after scanning an argument, with the bytes of all the
+  /// arguments scanned so far (their union, or their sum if unknown)
+  void finishArgument(__u64 finishedBytes) {
+    lock_guard<mutex> lock(m_mutex);
+    m_finishedFiles += m_argFiles;
+    m_finishedBytes = finishedBytes;
+    m_current = m_files.size();
+  }
+
+  /// Becomes true when the time budget runs out (see ScanOptions::cancel)
+  inline const atomic<bool>& expired() const { return m_expired; }
+
+private:
+  /// Body of the thread: sleeps until the next report or the deadline
+  void loop() {
+    typedef chrono::steady_clock Clock;
+    const Clock::time_point deadline = m_start + chrono::seconds(m_budget);
+    Clock::time_point next = m_start + chrono::seconds(m_interval);
+    unique_lock<mutex> lock(m_mutex);
+    while (!m_done) {
+      Clock::time_point wake = Clock::time_point::max();
+      if (m_interval)
+        wake = next;
+      if (m_budget && !m_expired)
+        wake = min(wake, deadline);
+      if (wake == Clock::time_point::max())
+        m_wake.wait(lock);
+      else
+        m_wake.wait_until(lock, wake);
+      if (m_done)
+        break;
+      const Clock::time_point now = Clock::now();
+      if (m_budget && !m_expired && now >= deadline) {
+        m_expired = true;
+        cerr << "Time budget of " << m_budget << " s exhausted, reporting partial results" << endl;
+      }
+      if (m_interval && now >= next) {
+        report(now - m_start);
+        next += chrono::seconds(m_interval) * ((now - next) / chrono::seconds(m_interval) + 1);
+      }
+    }
+  }
+
+  /// Prints a report (with m_mutex locked)
+  void report(chrono::steady_clock::duration elapsed) {
+    const double seconds = chrono::duration<double>(elapsed).count();
+    const __u64 argFiles = m_argFiles, argBytes = max<__s64>(m_argBytes, 0);
+    const bool scanning = m_current < m_files.size();
+    const __u64 files = m_finishedFiles + (scanning ? argFiles : 0);
+    ostringstream out;
+    out << "progress " << __u64(seconds) << "s: ";
+    if (scanning) {
+      out << m_files[m_current] << " (" << m_current + 1 << '/' << m_files.size() << ") " << argFiles << " files, ";
+      printSize(argBytes, m_humanReadable, out);
+      out << "; ";
+    }
+    out << "all " << files << " files, ";
+    printSize(m_finishedBytes + (scanning ? argBytes : 0), m_humanReadable, out);
+    out << ", " << __u64(seconds > 0 ? files / seconds : 0) << " files/s\n";
+    cerr << out.str() << flush;
+  }
+
+  const vector<const char*>& m_files;
+  const bool m_humanReadable;
+  const unsigned long m_interval, m_budget;
+  const chrono::steady_clock::time_point m_start;
+  atomic<__u64> m_argFiles{0}; ///< Files of the current argument
+  atomic<__s64> m_argBytes{0}; ///< Bytes of the current argument (see ScanProgress)
+  atomic<bool> m_expired{false};
+  mutex m_mutex; ///< Protects the members below and the reports
+  condition_variable m_wake;
+  size_t m_current = SIZE_MAX; ///< Argument being scanned, if less than m_files.size()
+  __u64 m_finishedFiles = 0, m_finishedBytes = 0;
+  bool m_done = false;
+  thread m_thread; ///< Last, so that it starts after the rest is ready
+};
+
+/// Counts the extents of a scanned argument for the stats and writes its
+/// dump, if requested
+template <class Set>
+static void saveArgument(const char* file, const Set& es, const Options& opts) {
+  if (opts.scan.stats)
+    opts.scan.stats->coalescedExtents += es.size();
+  if (opts.dumpDir) {
+    try {
+      writeExtentDump(dumpPath(opts.dumpDir, file, ".extents"), es);
+    } catch (const exception& ex) {
+      cerr << file << ": " << ex.what() << endl;
+    }
+  }
+}
+
+/// Writes the sketch of a scanned argument, if requested
+static void saveArgument(const char* file, const BlockSketch& sketch, const Options& opts) {
+  if (opts.sketchDir) {
+    try {
+      sketch.save(dumpPath(opts.sketchDir, file, ".sketch"));
+    } catch (const exception& ex) {
+      cerr << file << ": " << ex.what() << endl;
+    }
+  }
+}
+
+/// Inserts the extents of a file or directory argument into es,
+/// reporting errors on stderr. Returns false if the time budget ran out
+/// (es is left with the extents read so far, and no dump is written).
+template <class Set>
+static bool scanArgument(const char* file, Set& es, const Options& opts) {
+  try {
+    ScanSummary summary;
+    bool isDir = true;
+    if (opts.scan.source) { // Virtual tree, not on the filesystem
+      summary = es.insertFromDir(file, opts.scan);
+    } else {
+      path p = resolve_path(file);
+      isDir = is_directory(p);
+      if (!isDir && !is_regular_file(p))
+        throw runtime_error("Neither regular file nor directory");
+      // A regular file is read as a scan of one file, for --top, --stats and --record-trace
+      summary = es.insertFromDir(p.c_str(), opts.scan);
+    }
+    if (isDir && opts.verbose)
+      printSummary(file, summary);
+  } catch (const ScanCancelled&) {
+    return false;
+  } catch (const exception& ex) {
+    cerr << file << ": " << ex.what() << endl;
+  }
+  saveArgument(file, es, opts);
+  return true;
+}
+
+/// Joins a directory path and the name of an entry
+static string joinPath(const string& dir, const string& name) {
+  return (!dir.empty() && dir.back() == '/') ? dir + name : dir + '/' + name;
+}
+
+/// Scans an argument for --max-depth, inserting its extents into es and
+/// printing the size and the exclusive bytes (those not shared with the
+/// rest of the argument) of each directory up to the maximum depth, after
+/// its subdirectories like du. A single walk (see insertFromDirTree) puts
+/// the files of each directory into their own set (those deeper than the
+/// maximum depth into the set of their ancestor at that depth), then a
+/// single sweep over these sets attributes every byte to the directories
+/// that contain it.
+template <class Set>
+static void scanBreakdown(const char* file, Set& es, const Options& opts) {
+  string root;
+  try {
+    if (opts.scan.source) {
+      if (opts.scan.source->find(file).isDir)
+        root = file;
+    } else {
+      path p = resolve_path(file);
+      if (is_directory(p))
+        root = p.string();
+    }
+  } catch (const exception& ex) {
+    cerr << file << ": " << ex.what() << endl;
+    return;
+  }
+  if (root.empty()) { // A single file, which has no other files to share with
+    scanArgument(file, es, opts);
+    const __u64 size = es.totalLength();
+    printSize(size, opts.humanReadable);
+    cout << '\t';
+    printSize(size, opts.humanReadable);
+    cout << '\t' << file << '\n';
+    return;
+  }
+
+  DirTree tree;
+  deque<Set> sets;
+  try {
+    const ScanSummary summary = insertFromDirTree(root.c_str(), opts.maxDepth, opts.scan, tree, sets);
+    if (opts.verbose)
+      printSummary(file, summary);
+  } catch (const exception& ex) {
+    cerr << file << ": " << ex.what() << endl;
+    return;
+  }
+
+  // Print like du, in postorder with the subdirectories sorted by name
+  const size_t n = tree.parent.size();
+  vector<vector<size_t>> children(n);
+  for (size_t i = 1; i < n; ++i)
+    children[tree.parent[i]].push_back(i);
+  vector<string> names(n);
+  names[0] = file;
+  vector<size_t> postorder;
+  function<void(size_t)> visit = [&](size_t i) {
+    sort(children[i].begin(), children[i].end(), [&](size_t a, size_t b) { return tree.names[a] < tree.names[b]; });
+    for (size_t c : children[i]) {
+      names[c] = joinPath(names[i], tree.names[c]);
+      visit(c);
+    }
+    postorder.push_back(i);
+  };
+  visit(0);
+
+  vector<pair<typename Set::iterator, typename Set::iterator>> ranges;
+  for (const Set& s : sets)
+    ranges.emplace_back(s.begin(), s.end());
+  const TreeUsage usage = treeUsage(tree.parent, ranges);
+  sweepExtents(ranges, [&](__u64 start, __u64 end, const vector<size_t>&) { es.insert(Extent::FromTo(start, end)); });
+  for (size_t i : postorder) {
+    printSize(usage.total[i], opts.humanReadable);
+    cout << '\t';
+    printSize(usage.exclusive[i], opts.humanReadable);
+    cout << '\t' << names[i] << '\n';
+  }
+  saveArgument(file, es, opts);
+}
+
+/// Prints the result of sharedUsage for the given arguments, each value
+/// followed by its error if estimated (for --approx), marking the total
+/// if partial
+static void printSharedUsage(const SharedUsage& usage, const vector<const char*>& files, bool humanReadable,
+                             const SketchUsage* estimate = nullptr, ostream& out = cout, bool partial = false) {
+  const SharedUsage* error = estimate ? &estimate->error : nullptr;
+  auto print = [&](__u64 value, __u64 err) {
+    if (error)
+      printEstimate(value, err, humanReadable, out);
+    else
+      printSize(value, humanReadable, out);
+  };
+  // Size, exclusive (i.e. freed if deleted) and shared bytes of each argument
+  for (size_t i = 0; i < usage.n; ++i) {
+    print(usage.total[i], error ? error->total[i] : 0);
+    out << '\t';
+    print(usage.exclusive[i], error ? error->exclusive[i] : 0);
+    out << '\t';
+    print(usage.total[i] - usage.exclusive[i], estimate ? estimate->sharedError[i] : 0);
+    out << '\t' << files[i] << '\n';
+  }
+  print(usage.unionTotal, error ? error->unionTotal : 0);
+  out << (partial ? "\ttotal\t(partial)\n" : "\ttotal\n");
+  // Pairwise shared bytes, one row per argument
+  for (size_t i = 0; i < usage.n; ++i) {
+    for (size_t j = 0; j < usage.n; ++j) {
+      print(usage.shared(i, j), error ? error->shared(i, j) : 0);
+      out << '\t';
+    }
+    out << files[i] << '\n';
+  }
+}
+
+/// Prints the files with the most exclusive bytes (for --top), after an
+/// empty line: their size, exclusive and shared bytes like --shared, and
+/// their number of links if they have other hardlinks
+static void printTopFiles(const Options& opts) {
+  if (!opts.fileUsage)
+    return;
+  cout << '\n';
+  for (const FileUsage::Entry& e : opts.fileUsage->top(opts.topFiles)) {
+    printSize(e.total, opts.humanReadable);
+    cout << '\t';
+    printSize(e.exclusive, opts.humanReadable);
+    cout << '\t';
+    printSize(e.total - e.exclusive, opts.humanReadable);
+    cout << '\t' << e.path;
+    if (e.links > 1)
+      cout << "\t(" << e.links << " links)";
+    cout << '\n';
+  }
+}
+
+/// Scans all the arguments, then reports their exclusive and shared
+/// bytes computed with a single sweep over all sets
+template <class Set>
+static int runShared(const Options& opts) {
+  vector<Set> sets(opts.files.size());
+  vector<string> labels(opts.files.begin(), opts.files.end());
+  bool partial = false;
+  __u64 finished = 0;
+  for (size_t i = 0; i < sets.size(); ++i) {
+    if (partial) { // After the time budget ran out
+      labels[i] += "\t(not scanned)";
+      continue;
+    }
+    if (opts.monitor)
+      opts.monitor->startArgument(i);
+    if (!scanArgument(opts.files[i], sets[i], opts)) {
+      partial = true;
+      labels[i] += "\t(partial)";
+    }
+    if (opts.monitor)
+      opts.monitor->finishArgument(finished += sets[i].runningLength());
+  }
+  vector<const char*> files;
+  for (const string& label : labels)
+    files.push_back(label.c_str());
+  printSharedUsage(sharedUsage(sets), files, opts.humanReadable, nullptr, cout, partial);
+  printTopFiles(opts);
+  return partial ? 2 : 0;
+}
+
+/// Reports the arguments like run, with estimates from a sketch of the
+/// blocks of each argument (or read from the sketch files given as
+/// arguments with --from-sketches)
+static int runApprox(const Options& opts) {
+  vector<BlockSketch> sketches;
+  if (opts.fromSketches) {
+    try {
+      for (const char* file : opts.files)
+        sketches.push_back(BlockSketch::load(file));
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      return 1;
+    }
+  } else {
+    BlockSketch::configure(opts.approxSize);
+    sketches.resize(opts.files.size());
+    __u64 finished = 0;
+    for (size_t i = 0; i < sketches.size(); ++i) {
+      if (opts.monitor)
+        opts.monitor->startArgument(i);
+      scanArgument(opts.files[i], sketches[i], opts);
+      if (opts.monitor)
+        opts.monitor->finishArgument(finished += sketches[i].runningLength());
+    }
+  }
+  const SketchUsage usage = sketchUsage(sketches);
+  if (opts.shared) {
+    printSharedUsage(usage.value, opts.files, opts.humanReadable, &usage);
+    return 0;
+  }
+  for (size_t i = 0; i < sketches.size(); ++i) {
+    const BlockSketch::Estimate e = sketches[i].estimate();
+    printEstimate(e.bytes, e.error, opts.humanReadable);
+    cout << '\t' << opts.files[i] << '\n';
+  }
+  printEstimate(usage.value.unionTotal, usage.error.unionTotal, opts.humanReadable);
+  cout << "\ttotal\n";
+  return 0;
+}
+
+/// Reports the arguments, which are extent dumps, without materializing
+/// them: every result is computed by streaming merges of the mapped files
+static int runDumps(const Options& opts) {
+  vector<unique_ptr<MappedExtentDump>> dumps;
+  typedef pair<MappedExtentDump::iterator, MappedExtentDump::iterator> Range;
+  vector<Range> ranges, allRanges; // Arguments, arguments followed by kept dumps
+  vector<string> tmpPaths; // Of the dumps written
+  try {
+    for (const char* file : opts.files)
+      dumps.push_back(make_unique<MappedExtentDump>(file));
+    for (const char* file : opts.keepDumps)
+      dumps.push_back(make_unique<MappedExtentDump>(file));
+    for (const auto& d : dumps)
+      allRanges.emplace_back(d->begin(), d->end());
+    ranges.assign(allRanges.begin(), allRanges.begin() + opts.files.size());
+
+    if (opts.shared) {
+      printSharedUsage(sharedUsage(ranges), opts.files, opts.humanReadable);
+    } else {
+      for (size_t i = 0; i < opts.files.size(); ++i) {
+        printSize(dumps[i]->totalLength(), opts.humanReadable);
+        cout << '\t' << opts.files[i] << '\n';
+      }
+      __u64 total = 0;
+      sweepExtents(ranges, [&](__u64 start, __u64 end, const vector<size_t>&) { total += end - start; });
+      printSize(total, opts.humanReadable);
+      cout << "\ttotal\n";
+    }
+
+    if (!opts.keepDumps.empty()) {
+      // Bytes referenced by the arguments and not by the kept dumps
+      const size_t nArgs = opts.files.size();
+      __u64 freed = 0;
+      sweepExtents(allRanges, [&](__u64 start, __u64 end, const vector<size_t>& active) {
+        for (size_t i : active)
+          if (i >= nArgs)
+            return;
+        freed += end - start;
+      });
+      printSize(freed, opts.humanReadable);
+      cout << "\tfreed\n";
+    }
+
+    // The outputs may be among the inputs, which are mapped: they are
+    // written to temporary files, renamed over them once unmapped
+    if (opts.writeUnion) {
+      ExtentDumpWriter w(opts.writeUnion + ".tmp"s);
+      tmpPaths.push_back(opts.writeUnion + ".tmp"s);
+      sweepExtents(ranges, [&](__u64 start, __u64 end, const vector<size_t>&) { w.append(Extent::FromTo(start, end)); });
+      w.close();
+    }
+    if (opts.writeIntersection) {
+      ExtentDumpWriter w(opts.writeIntersection + ".tmp"s);
+      tmpPaths.push_back(opts.writeIntersection + ".tmp"s);
+      sweepExtents(ranges, [&](__u64 start, __u64 end, const vector<size_t>& active) {
+        if (active.size() == ranges.size())
+          w.append(Extent::FromTo(start, end));
+      });
+      w.close();
+    }
+    ranges.clear();
+    allRanges.clear();
+    dumps.clear();
+    if (opts.writeUnion && rename(tmpPaths.front().c_str(), opts.writeUnion))
+      throw system_error(errno, generic_category(), "Could not write dump file: "s + opts.writeUnion);
+    if (opts.writeIntersection && rename(tmpPaths.back().c_str(), opts.writeIntersection))
+      throw system_error(errno, generic_category(), "Could not write dump file: "s + opts.writeIntersection);
+  } catch (const exception& ex) {
+    cerr << ex.what() << endl;
+    for (const string& path : tmpPaths)
+      unlink(path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+/// Prints the bytes of es within each range of opts.regionSize physical
+/// addresses that it uses
+template <class Set>
+static void printRegions(const Set& es, const Options& opts) {
+  if (es.empty())
+    return;
+  const __u64 size = opts.regionSize, last = es.last().end();
+  for (__u64 start = es.first().start() / size * size; start < last;) {
+    const __u64 end = (start > ~__u64(0) - size) ? ~__u64(0) : start + size;
+    const __u64 used = es.lengthWithin(Extent::FromTo(start, end));
+    if (used) {
+      printSize(used, opts.humanReadable);
+      cout << "\tregion " << start << '-' << end << '\n';
+    }
+    start = end;
+  }
+}
+
+/// Set by SIGINT and SIGTERM to leave runWatch
+static volatile sig_atomic_t stopWatching = 0;
+
+static void onWatchSignal(int) { stopWatching = 1; }
+
+/// Prints the current report of runWatch: the size of each argument and
+/// the total, or the same as --shared
+static void printWatchReport(const WatchedUsage& watched, const Options& opts, ostream& out) {
+  const SharedUsage& usage = watched.usage();
+  if (opts.shared) {
+    printSharedUsage(usage, opts.files, opts.humanReadable, nullptr, out);
+    return;
+  }
+  for (size_t i = 0; i < usage.n; ++i) {
+    printSize(usage.total[i], opts.humanReadable, out);
+    out << '\t' << opts.files[i] << '\n';
+  }
+  printSize(usage.unionTotal, opts.humanReadable, out);
+  out << "\ttotal\n";
+}
+
+/// Opens a Unix socket listening at path, replacing a stale socket (but
+/// nothing else). Throws std::system_error on failure.
+static UniqueFileDescriptor listenAt(const char* path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    throw runtime_error("Socket path too long: "s + path);
+  strcpy(addr.sun_path, path);
+  UniqueFileDescriptor fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), "socket");
+  struct stat st;
+  if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+    ::unlink(path);
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) || listen(fd, 16))
+    throw system_error(errno, generic_category(), "Could not listen at "s + path);
+  return fd;
+}
+
+/// Scans the arguments (directories), then keeps their sizes up to date
+/// with the changes notified by inotify, printing a new report when they
+/// change (at most every opts.watchInterval seconds) and sending the
+/// current one to every client of opts.watchSocket, until interrupted
+static int runWatch(const Options& opts) {
+  for (const char* file : opts.files)
+    if (!is_directory(file)) {
+      cerr << "Not a directory (required by --watch): " << file << endl;
+      return 1;
+    }
+  struct sigaction sa = {};
+  sa.sa_handler = onWatchSignal; // Without SA_RESTART, so that poll is interrupted
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  unique_ptr<WatchedUsage> watched;
+  UniqueFileDescriptor server;
+  try {
+    watched = make_unique<WatchedUsage>(vector<string>(opts.files.begin(), opts.files.end()), opts.scan);
+    if (opts.watchSocket)
+      server = listenAt(opts.watchSocket);
+  } catch (const exception& ex) {
+    cerr << ex.what() << endl;
+    return 1;
+  }
+  vector<pollfd> fds;
+  for (int fd : watched->fds())
+    fds.push_back({fd, POLLIN, 0});
+  if (server)
+    fds.push_back({server, POLLIN, 0});
+
+  const __u64 interval = opts.watchInterval * 1000000000ULL;
+  printWatchReport(*watched, opts, cout);
+  cout << flush;
+  SharedUsage reported = watched->usage();
+  __u64 lastReport = ScanStats::now();
+  bool pending = false; // Files updated since the last report
+  int ret = 0;
+  while (!stopWatching) {
+    int timeout = -1;
+    if (pending) {
+      const __u64 now = ScanStats::now();
+      timeout = lastReport + interval > now ? (lastReport + interval - now + 999999) / 1000000 : 0;
+    }
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << system_error(errno, generic_category(), "poll").what() << endl;
+      ret = 1;
+      break;
+    }
+    try {
+      const __u64 start = ScanStats::now();
+      const size_t changed = watched->update();
+      if (changed) {
+        pending = true;
+        if (opts.verbose)
+          cerr << changed << " files updated in " << (ScanStats::now() - start) / 1000000 << " ms" << endl;
+      }
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      ret = 1;
+      break;
+    }
+    const int clientFd = server && (fds.back().revents & POLLIN) ? accept4(server, nullptr, nullptr, SOCK_CLOEXEC) : -1;
+    if (clientFd >= 0) {
+      UniqueFileDescriptor client(clientFd, "accept");
+      ostringstream report;
+      printWatchReport(*watched, opts, report);
+      const string text = report.str();
+      // A client that does not read is simply dropped
+      for (size_t sent = 0; sent < text.size();) {
+        const ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n <= 0)
+          break;
+        sent += n;
+      }
+    }
+    if (pending && ScanStats::now() >= lastReport + interval) {
+      // Files were rewritten, but the sizes may be the same
+      const SharedUsage& usage = watched->usage();
+      if (usage.unionTotal != reported.unionTotal || usage.pairwise != reported.pairwise ||
+          usage.exclusive != reported.exclusive) {
+        cout << '\n';
+        printWatchReport(*watched, opts, cout);
+        cout << flush;
+        reported = usage;
+        lastReport = ScanStats::now();
+      }
+      pending = false;
+    }
+  }
+  if (opts.watchSocket && server)
+    ::unlink(opts.watchSocket);
+  return ret;
+}
+
+/// Scans and reports all the arguments, using Set as extent container
+template <class Set>
+static int run(const Options& opts) {
+  if (opts.shared)
+    return runShared<Set>(opts);
+
+  // Find and list file sizes
+  Set es, total;
+  bool partial = false;
+  for (size_t i = 0; i < opts.files.size(); ++i) {
+    const char* file = opts.files[i];
+    if (partial) { // After the time budget ran out
+      printSize(0, opts.humanReadable);
+      cout << '\t' << file << "\t(not scanned)\n";
+      continue;
+    }
+    es.clear();
+    if (opts.monitor)
+      opts.monitor->startArgument(i);
+    if (opts.breakdown) {
+      scanBreakdown(file, es, opts);
+    } else {
+      partial = !scanArgument(file, es, opts);
+      printSize(es.parallelTotalLength(opts.scan.threads), opts.humanReadable);
+      cout << '\t' << file << (partial ? "\t(partial)\n" : "\n");
+    }
+    total.parallelUnion(es, opts.scan.threads);
+    if (opts.monitor) {
+      opts.monitor->finishArgument(total.runningLength());
+      cout << flush; // Keep the results so far if killed
+    }
+  }
+
+  printSize(total.parallelTotalLength(opts.scan.threads), opts.humanReadable);
+  cout << (partial ? "\ttotal\t(partial)\n" : "\ttotal\n");
+  if (opts.regionSize)
+    printRegions(total, opts);
+  printTopFiles(opts);
+
+  // TODO count also file metadata size, which is never shared
+
+  return partial ? 2 : 0;
+}
+
 int main(int argc, char** argv) {
   // Parse args
-  bool printHelp = false, humanReadable = false;
-  int nFiles = 0;
+  bool printHelp = false;
+  Options opts;
+#ifdef SNAPSIZE_FLAT_EXTENT_SET
+  string setType = "flat";
+#else
+  string setType = "tree";
+#endif
   for (int i = 1; i < argc; ++i) {
     if (argv[i][0] == '-') {
       if (argv[i] == "--help"s) {
         printHelp = true;
       } else if (argv[i] == "-h"s) {
-        humanReadable = true;
+        opts.humanReadable = true;
+      } else if (argv[i] == "--shared"s) {
+        opts.shared = true;
+      } else if (argv[i] == "--io-uring"s) {
+        opts.scan.ioUring = true;
+      } else if (argv[i] == "--inode-order"s) {
+        opts.scan.inodeOrder = true;
+      } else if (argv[i] == "-v"s || argv[i] == "--verbose"s) {
+        opts.verbose = true;
+      } else if (argv[i] == "--cache"s && i + 1 < argc) {
+        opts.cachePath = argv[++i];
+      } else if (argv[i] == "--cache-max-size"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.cacheMaxSize)) {
+          printHelp = true;
+          cerr << "Invalid cache size: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--cache-reset"s) {
+        opts.cacheReset = true;
+      } else if (argv[i] == "--memory-limit"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.memoryLimit) || !opts.memoryLimit) {
+          printHelp = true;
+          cerr << "Invalid memory limit: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--regions"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.regionSize) || !opts.regionSize) {
+          printHelp = true;
+          cerr << "Invalid region size: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--max-depth"s && i + 1 < argc) {
+        opts.breakdown = true;
+        if (!parseUnsigned(argv[++i], opts.maxDepth)) {
+          printHelp = true;
+          cerr << "Invalid depth: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--summarize"s) {
+        opts.breakdown = true;
+        opts.maxDepth = 0;
+      } else if (argv[i] == "-x"s || argv[i] == "--one-file-system"s) {
+        opts.scan.oneFileSystem = true;
+      } else if (argv[i] == "--exclude"s && i + 1 < argc) {
+        opts.scan.exclude.push_back(argv[++i]);
+      } else if (argv[i] == "--exclude-from"s && i + 1 < argc) {
+        ifstream in(argv[++i]);
+        if (!in) {
+          printHelp = true;
+          cerr << "Cannot read exclude file: " << argv[i] << endl;
+        }
+        for (string line; getline(in, line);)
+          if (!line.empty())
+            opts.scan.exclude.push_back(line);
+      } else if (argv[i] == "--approx"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.approxSize) || opts.approxSize < 3) {
+          printHelp = true;
+          cerr << "Invalid sketch size: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--sketch-dir"s && i + 1 < argc) {
+        opts.sketchDir = argv[++i];
+      } else if (argv[i] == "--from-sketches"s) {
+        opts.fromSketches = true;
+      } else if (argv[i] == "--watch"s && i + 1 < argc) {
+        opts.watch = true;
+        if (!parseUnsigned(argv[++i], opts.watchInterval)) {
+          printHelp = true;
+          cerr << "Invalid interval: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--watch-socket"s && i + 1 < argc) {
+        opts.watchSocket = argv[++i];
+      } else if (argv[i] == "--progress"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.progressInterval) || !opts.progressInterval) {
+          printHelp = true;
+          cerr << "Invalid interval: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--top"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.topFiles) || !opts.topFiles) {
+          printHelp = true;
+          cerr << "Invalid number of files: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--time-budget"s && i + 1 < argc) {
+        if (!parseUnsigned(argv[++i], opts.timeBudget) || !opts.timeBudget) {
+          printHelp = true;
+          cerr << "Invalid time budget: " << argv[i] << endl;
+        }
+      } else if (argv[i] == "--stats"s) {
+        opts.stats = true;
+      } else if (argv[i] == "--stats-json"s && i + 1 < argc) {
+        opts.statsJson = argv[++i];
+      } else if (argv[i] == "--source"s && i + 1 < argc) {
+        opts.sourceSpec = argv[++i];
+      } else if (argv[i] == "--record-trace"s && i + 1 < argc) {
+        opts.tracePath = argv[++i];
+      } else if (argv[i] == "--dump-dir"s && i + 1 < argc) {
+        opts.dumpDir = argv[++i];
+      } else if (argv[i] == "--from-dumps"s) {
+        opts.fromDumps = true;
+      } else if (argv[i] == "--keep"s && i + 1 < argc) {
+        opts.keepDumps.push_back(argv[++i]);
+      } else if (argv[i] == "--write-union"s && i + 1 < argc) {
+        opts.writeUnion = argv[++i];
+      } else if (argv[i] == "--write-intersection"s && i + 1 < argc) {
+        opts.writeIntersection = argv[++i];
+      } else if (argv[i] == "--set"s && i + 1 < argc) {
+        setType = argv[++i];
+        if (setType != "tree" && setType != "flat" && setType != "hybrid") {
+          printHelp = true;
+          cerr << "Unknown set type: " << setType << endl;
+        }
+      } else if (argv[i] == "-j"s || (argv[i][1] == 'j' && argv[i][2])) {
+        const char* value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc) ? argv[++i] : "";
+        unsigned long n;
+        if (parseUnsigned(value, n) && n <= MAX_THREADS) {
+          opts.scan.threads = n;
+        } else {
+          printHelp = true;
+          cerr << "Invalid number of threads: " << value << endl;
+        }
       } else {
         printHelp = true;
         cerr << "Unrecognized option: " << argv[i] << endl;
       }
     } else {
-      ++nFiles;
+      opts.files.push_back(argv[i]);
     }
   }
-  if (argc < 2 || nFiles == 0 || printHelp) {
+  if (!opts.fromDumps && (!opts.keepDumps.empty() || opts.writeUnion || opts.writeIntersection)) {
+    printHelp = true;
+    cerr << "--keep, --write-union and --write-intersection require --from-dumps" << endl;
+  }
+  if (opts.writeUnion && opts.writeIntersection && opts.writeUnion == string(opts.writeIntersection)) {
+    printHelp = true;
+    cerr << "--write-union and --write-intersection cannot write the same file" << endl;
+  }
+  if (opts.breakdown && (opts.shared || opts.fromDumps)) {
+    printHelp = true;
+    cerr << "--max-depth and --summarize cannot be combined with --shared or --from-dumps" << endl;
+  }
+  if (opts.regionSize && (opts.shared || opts.fromDumps)) {
+    printHelp = true;
+    cerr << "--regions cannot be combined with --shared or --from-dumps" << endl;
+  }
+  if ((opts.approxSize || opts.fromSketches) &&
+      (opts.breakdown || opts.regionSize || opts.memoryLimit || opts.dumpDir || opts.fromDumps)) {
+    printHelp = true;
+    cerr << "--approx and --from-sketches cannot be combined with --max-depth, --summarize, --regions,\n"
+            "--memory-limit, --dump-dir or --from-dumps" << endl;
+  }
+  if (opts.sketchDir && !opts.approxSize) {
+    printHelp = true;
+    cerr << "--sketch-dir requires --approx" << endl;
+  }
+  if (opts.watch && (opts.approxSize || opts.fromSketches || opts.fromDumps || opts.breakdown || opts.regionSize ||
+                     opts.memoryLimit || opts.dumpDir || opts.sourceSpec || opts.tracePath)) {
+    printHelp = true;
+    cerr << "--watch cannot be combined with --approx, --from-sketches, --from-dumps, --max-depth,\n"
+            "--summarize, --regions, --memory-limit, --dump-dir, --source or --record-trace" << endl;
+  }
+  if (opts.watchSocket && !opts.watch) {
+    printHelp = true;
+    cerr << "--watch-socket requires --watch" << endl;
+  }
+  if ((opts.progressInterval || opts.timeBudget) && (opts.watch || opts.fromDumps || opts.fromSketches)) {
+    printHelp = true;
+    cerr << "--progress and --time-budget cannot be combined with --watch, --from-dumps or --from-sketches" << endl;
+  }
+  if (opts.topFiles && (opts.watch || opts.approxSize || opts.fromDumps || opts.fromSketches || opts.tracePath)) {
+    printHelp = true;
+    cerr << "--top cannot be combined with --watch, --approx, --from-dumps, --from-sketches or --record-trace" << endl;
+  }
+  if (opts.timeBudget && (opts.breakdown || opts.approxSize)) {
+    printHelp = true;
+    cerr << "--time-budget cannot be combined with --max-depth, --summarize or --approx" << endl;
+  }
+  if (opts.files.empty() || printHelp) {
     cerr
       << "Reports the disk space used by each file given as argument, or by\n"
          "all files in the tree of directory arguments, taking into account \n"
          "overlapping extents. Multiple files may share the same physical\n"
          "extents on disk when hardlink or copy-on-write features are used\n"
          "(on filesystems that support them).\n\n"
-         "Usage: " << argv[0] << " [-h] FILE_OR_DIR [FILE_OR_DIR [...]]\n\n"
+         "Usage: " << argv[0] << " [-h] [-v] [-j N] [--io-uring] [--inode-order] [--set TYPE] [--shared]\n"
+         "          [--cache FILE [--cache-max-size BYTES] [--cache-reset]]\n"
+         "          [--memory-limit BYTES] [--regions BYTES] [--max-depth N | --summarize]\n"
+         "          [-x] [--exclude PATTERN] [--exclude-from FILE] [--approx K [--sketch-dir DIR]]\n"
+         "          [--source SPEC] [--record-trace FILE] [--watch SECONDS [--watch-socket PATH]]\n"
+         "          [--progress SECONDS] [--time-budget SECONDS] [--top K]\n"
+         "          [--stats] [--stats-json FILE] [--dump-dir DIR] FILE_OR_DIR [FILE_OR_DIR [...]]\n"
+         "       " << argv[0] << " --from-dumps [-h] [--shared] [--keep DUMP [...]]\n"
+         "          [--write-union DUMP] [--write-intersection DUMP] DUMP [DUMP [...]]\n"
+         "       " << argv[0] << " --from-sketches [-h] [--shared] SKETCH [SKETCH [...]]\n\n"
+         "Options\n"
+         " -h          Print sizes in human-readable format\n"
+         " -v          Report the number of files scanned, hardlinks skipped\n"
+         "             and errors for each directory argument on stderr\n"
+         " -j N        Scan directories and merge the results with N threads\n"
+         "             (0 = one per core, at most 1024)\n"
+         " --io-uring  Batch the open, stat and close calls of each directory\n"
+         "             with io_uring (if available)\n"
+         " --inode-order\n"
+         "             Read the files of each directory by inode number after\n"
+         "             listing it, which avoids random seeks through the inode\n"
+         "             tables on rotational disks with a cold cache\n"
+         " --set TYPE  Extent container: 'tree' (std::set, low peak memory\n"
+         "             for few extents), 'flat' (sorted vector, faster and\n"
+         "             much smaller for many extents) or 'hybrid' (runs and\n"
+         "             block bitmaps, smallest for very fragmented files)\n"
+         " --shared    For each argument, print its size, the bytes exclusive\n"
+         "             to it (freed if it is deleted) and the bytes it shares\n"
+         "             with the others; after the total, print the matrix of\n"
+         "             bytes shared by each pair of arguments, one row per\n"
+         "             argument\n"
+         " --cache FILE\n"
+         "             Read the extents of unchanged files (same device, inode\n"
+         "             and ctime) from FILE instead of the filesystem, and save\n"
+         "             the extents of the others to it; the entries of files\n"
+         "             not scanned in this run are dropped. FILE must be\n"
+         "             missing, empty or a cache. A btrfs balance moves\n"
+         "             extents without changing ctime: entries of read-only\n"
+         "             snapshots are invalidated by their generation, but after\n"
+         "             a balance the files of writable subvolumes need\n"
+         "             --cache-reset\n"
+         " --cache-max-size BYTES\n"
+         "             Limit the size of the cache file, keeping the entries\n"
+         "             added in this run first\n"
+         " --cache-reset\n"
+         "             Discard the current content of the cache file (also\n"
+         "             needed if it is corrupted)\n"
+         " --memory-limit BYTES\n"
+         "             Keep the extents in memory up to about BYTES in total,\n"
+         "             spilling sorted runs to temporary files ($TMPDIR or\n"
+         "             /tmp) beyond it; the results are the same\n"
+         " --regions BYTES\n"
+         "             After the total, print the bytes it uses in each range\n"
+         "             of BYTES physical addresses (e.g. 1073741824 for the\n"
+         "             1 GiB data block groups of BTRFS), skipping unused ones\n"
+         " --max-depth N\n"
+         "             For each directory argument, print the size and the\n"
+         "             exclusive bytes (not shared with the rest of the\n"
+         "             argument, i.e. freed if the directory is deleted) of\n"
+         "             each directory up to N levels below it, after its\n"
+         "             subdirectories, computed in a single walk; the files\n"
+         "             of each directory at level N are kept together\n"
+         " --summarize Same as --max-depth 0\n"
+         " -x, --one-file-system\n"
+         "             Skip directories (and files) on a different filesystem\n"
+         "             than the directory argument, without entering them\n"
+         " --exclude PATTERN\n"
+         "             Skip files and directories matching the shell PATTERN;\n"
+         "             excluded directories are not read at all. A PATTERN\n"
+         "             with a '/' is matched against the whole path (starting\n"
+         "             with the argument), otherwise against the name (may be\n"
+         "             repeated)\n"
+         " --exclude-from FILE\n"
+         "             Same as --exclude for each non-empty line of FILE\n"
+         " --source SPEC\n"
+         "             Scan a virtual tree instead of the filesystem, to\n"
+         "             measure the scan at scale; arguments are absolute paths\n"
+         "             in it. SPEC is 'replay:TRACE' for a trace written by\n"
+         "             --record-trace, or 'synthetic[:KEY=VALUE,...]' for a\n"
+         "             generated pool; keys (defaults) are files (1M),\n"
+         "             files-per-dir (100), subdirs (10), extents per file\n"
+         "             (4), shared (fraction of files sharing their content\n"
+         "             with another one, 0.5), hardlinks (0) and seed (1);\n"
+         "             the tree holds f0, f1... and d0, d1... in each directory\n"
+         " --record-trace FILE\n"
+         "             Write the path, inode and extents of every file scanned\n"
+         "             in directory arguments to FILE\n"
+         " --stats     Print counters (files, directories, FIEMAP calls, extents\n"
+         "             returned, inserted and left after coalescing...), the\n"
+         "             time spent reading directories, opening files, in the\n"
+         "             ioctl and inserting extents (summed over threads), and\n"
+         "             the peak memory on stderr\n"
+         " --stats-json FILE\n"
+         "             Write the same as a JSON object to FILE ('-' for stdout)\n"
+         " --dump-dir DIR\n"
+         "             Also save the extents of each argument to a compact\n"
+         "             binary dump, named after the argument, in DIR\n"
+         " --approx K  Estimate the sizes from a sketch of the K smallest\n"
+         "             hashes of the 4 KiB blocks of each argument (8*K bytes\n"
+         "             each); every value is followed by '+-' and the half-width\n"
+         "             of its ~95% confidence interval, about 2/sqrt(K) of the\n"
+         "             total (exact below K blocks)\n"
+         " --sketch-dir DIR\n"
+         "             Also save the sketch of each argument, named after the\n"
+         "             argument, in DIR\n"
+         " --watch SECONDS\n"
+         "             After scanning the arguments (directories), keep their\n"
+         "             extents in memory and watch them with inotify: only the\n"
+         "             files written, created, deleted or moved are read again.\n"
+         "             A new report (preceded by an empty line) is printed when\n"
+         "             the sizes change, at most every SECONDS, until SIGINT or\n"
+         "             SIGTERM. Changes not closing a file opened for writing\n"
+         "             (e.g. deduplication) are not seen; --set is ignored\n"
+         " --watch-socket PATH\n"
+         "             Also send the current report to every client connecting\n"
+         "             to the Unix socket PATH (e.g. with 'nc -U PATH')\n"
+         " --progress SECONDS\n"
+         "             Every SECONDS, print on stderr the files and bytes read\n"
+         "             so far in the argument being scanned and in all of\n"
+         "             them, and the files read per second; until an argument\n"
+         "             is finished, bytes shared within it may be counted more\n"
+         "             than once with several threads, and with --shared the\n"
+         "             bytes shared between arguments are counted in each\n"
+         " --time-budget SECONDS\n"
+         "             Stop scanning after SECONDS and report the partial\n"
+         "             results: the argument being scanned is marked\n"
+         "             '(partial)', the following ones '(not scanned)' with\n"
+         "             size 0 and the total '(partial)'; the exit status is 2\n"
+         " --top K     After the other results and an empty line, print the\n"
+         "             size, the exclusive bytes (not shared with any other\n"
+         "             file scanned) and the shared bytes of the K files with\n"
+         "             the most exclusive bytes, in decreasing order. Deleting\n"
+         "             a file frees its exclusive bytes only if it has no other\n"
+         "             hardlinks: the files with several are followed by\n"
+         "             '(N links)' and listed once per argument, at one of\n"
+         "             their paths. Keeps 24 bytes per extent and 20 per\n"
+         "             file, plus the paths, in memory\n\n"
+         "Offline mode (--from-sketches)\n"
+         "Arguments are sketches written by --sketch-dir, possibly on different\n"
+         "hosts; they are reported as with --approx.\n\n"
+         "Offline mode (--from-dumps)\n"
+         "Arguments are dumps written by --dump-dir. They are memory-mapped\n"
+         "and merged in a streaming fashion, without touching the filesystem.\n"
+         " --keep DUMP Also read DUMP and print the bytes that would be freed\n"
+         "             by deleting all the arguments but not the kept dumps\n"
+         "             (may be repeated)\n"
+         " --write-union DUMP, --write-intersection DUMP\n"
+         "             Write the union/intersection of the arguments to DUMP\n\n"
          "Limitations\n"
          " - All files within a directory argument are expected to be on the\n"
          "   same filesystem; inconsistent results will be returned if this\n"
-         "   is not true.\n"
+         "   is not true, unless -x is used to skip the other filesystems.\n"
          " - This program only reports the space occupied by file contents;\n"
          "   the space used by the metadata is not accounted for; this is\n"
          "   particularly relevant for very short files whose data is stored\n"
@@ -73,37 +1151,108 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  // Find and list file sizes
-  ExtentSet es, total;
-  for (int i = 1; i < argc; ++i) {
-    if (argv[i][0] != '-') {
-      es.clear();
-      try {
-        path p = resolve_path(argv[i]);
-        if (is_directory(p))
-          es.insertFromDir(p.c_str());
-        else if (is_regular_file(p))
-          es.insertFromFile(p.c_str());
-        else
-          throw runtime_error("Neither regular file nor directory");
-        } catch (const exception& ex) {
-          cerr << argv[i] << ": " << ex.what() << endl;
-        }
-        // Output
-        if (humanReadable)
-          cout << HumanSize(es.totalLength()) << '\t' << argv[i] << '\n';
-        else
-          cout << es.totalLength() << '\t' << argv[i] << '\n';
-        total |= es;
+  unique_ptr<ExtentCache> cache;
+  if (opts.cachePath) {
+    try {
+      cache = make_unique<ExtentCache>(opts.cachePath, !opts.cacheReset);
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      return 1;
     }
+    opts.scan.cache = cache.get();
   }
 
-  if (humanReadable)
-    cout << HumanSize(es.totalLength()) << "\ttotal\n";
-  else
-    cout << total.totalLength() << "\ttotal\n";
+  if (opts.fromDumps)
+    return runDumps(opts);
+  if (opts.fromSketches)
+    return runApprox(opts);
 
-  // TODO count also file metadata size, which is never shared
+  unique_ptr<ExtentSource> source;
+  unique_ptr<ExtentTraceWriter> trace;
+  try {
+    if (opts.sourceSpec)
+      source = makeExtentSource(opts.sourceSpec);
+    if (opts.tracePath)
+      trace = make_unique<ExtentTraceWriter>(opts.tracePath);
+  } catch (const exception& ex) {
+    cerr << ex.what() << endl;
+    return 1;
+  }
+  opts.scan.source = source.get();
+  opts.scan.trace = trace.get();
+  unique_ptr<FileUsage> fileUsage;
+  if (opts.topFiles) {
+    fileUsage = make_unique<FileUsage>();
+    opts.fileUsage = fileUsage.get();
+    opts.scan.trace = fileUsage.get();
+  }
+  ScanStats stats;
+  if (opts.stats || opts.statsJson)
+    opts.scan.stats = &stats;
+  const __u64 start = ScanStats::now();
+  unique_ptr<ScanMonitor> monitor;
+  if (opts.progressInterval || opts.timeBudget) {
+    monitor = make_unique<ScanMonitor>(opts.files, opts.humanReadable, opts.progressInterval, opts.timeBudget);
+    opts.monitor = monitor.get();
+    opts.scan.progress = monitor.get();
+    if (opts.timeBudget)
+      opts.scan.cancel = &monitor->expired();
+  }
 
-  return 0;
+  int ret;
+  if (opts.watch) {
+    ret = runWatch(opts);
+  } else if (opts.approxSize) {
+    ret = runApprox(opts);
+  } else if (opts.memoryLimit) {
+    // Split the budget among the sets alive at the same time: one per
+    // argument with --shared (two otherwise), plus one per extra thread
+    unsigned threads = opts.scan.threads ? opts.scan.threads : max(thread::hardware_concurrency(), 1U);
+    size_t sets = (opts.shared ? opts.files.size() : 2) + threads - 1;
+    SpillingExtentSet::configure(max<size_t>(opts.memoryLimit / sets, 1));
+    ret = run<SpillingExtentSet>(opts);
+  } else if (setType == "hybrid")
+    ret = run<HybridExtentSet>(opts);
+  else
+    ret = (setType == "tree") ? run<ExtentSet>(opts) : run<FlatExtentSet>(opts);
+  monitor.reset();
+
+  if (opts.scan.stats) {
+    stats.wallNs = ScanStats::now() - start;
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    stats.peakRssKiB = ru.ru_maxrss;
+    if (opts.stats)
+      stats.print(cerr);
+    if (opts.statsJson) {
+      if (opts.statsJson == "-"s) {
+        stats.writeJson(cout);
+      } else {
+        ofstream out(opts.statsJson);
+        if (out)
+          stats.writeJson(out);
+        if (!out) {
+          cerr << "Could not write " << opts.statsJson << endl;
+          ret = 1;
+        }
+      }
+    }
+  }
+  if (trace) {
+    try {
+      trace->close();
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      ret = 1;
+    }
+  }
+  if (cache) {
+    try {
+      cache->save(opts.cacheMaxSize);
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      ret = 1;
+    }
+  }
+  return ret;
 }
@@ -0,0 +1,129 @@
+/** C interface of libsnapsize (implementation).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "snapsize.h"
+#include "Scanner.hh"
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct snapsize_scanner {
+  explicit snapsize_scanner(unsigned threads) : scanner(makeOptions(threads)) {}
+
+  static ScanOptions makeOptions(unsigned threads) {
+    ScanOptions opts;
+    opts.threads = threads;
+    return opts;
+  }
+
+  Scanner scanner;
+  string error;
+};
+
+/// Runs f, storing the message of any exception in the scanner
+template <class F>
+static int guarded(snapsize_scanner* s, F f) {
+  s->error.clear();
+  try {
+    f();
+    return SNAPSIZE_OK;
+  } catch (const ScanCancelled& ex) {
+    s->error = ex.what();
+    return SNAPSIZE_CANCELLED;
+  } catch (const exception& ex) {
+    s->error = ex.what();
+  } catch (...) {
+    s->error = "Unknown error";
+  }
+  return SNAPSIZE_ERROR;
+}
+
+snapsize_scanner* snapsize_scanner_new(unsigned threads) {
+  try {
+    return new snapsize_scanner(threads);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void snapsize_scanner_free(snapsize_scanner* scanner) { delete scanner; }
+
+void snapsize_scanner_set_callbacks(snapsize_scanner* scanner, snapsize_file_callback on_file,
+                                    snapsize_directory_callback on_directory, void* user) {
+  Scanner& s = scanner->scanner;
+  if (on_file)
+    s.onFile([on_file, user](const string& path, __u64 ino, const vector<Extent>& extents) {
+      uint64_t bytes = 0;
+      for (const Extent& x : extents)
+        bytes += x.length();
+      on_file(user, path.c_str(), ino, bytes);
+    });
+  else
+    s.onFile(nullptr);
+  if (on_directory)
+    s.onDirectory([on_directory, user](const string& path, size_t files, __s64 bytes) {
+      on_directory(user, path.c_str(), files, bytes);
+    });
+  else
+    s.onDirectory(nullptr);
+}
+
+void snapsize_scanner_set_one_file_system(snapsize_scanner* scanner, int enable) {
+  scanner->scanner.options().oneFileSystem = enable;
+}
+
+void snapsize_scanner_set_inode_order(snapsize_scanner* scanner, int enable) {
+  scanner->scanner.options().inodeOrder = enable;
+}
+
+int snapsize_scanner_add_exclude(snapsize_scanner* scanner, const char* pattern) {
+  return guarded(scanner, [&] { scanner->scanner.options().exclude.push_back(pattern); });
+}
+
+int snapsize_scanner_use_cache(snapsize_scanner* scanner, const char* path) {
+  return guarded(scanner, [&] { scanner->scanner.useCache(path ? path : ""); });
+}
+
+int snapsize_scanner_save_cache(snapsize_scanner* scanner, size_t max_bytes) {
+  return guarded(scanner, [&] { scanner->scanner.saveCache(max_bytes); });
+}
+
+void snapsize_scanner_cancel(snapsize_scanner* scanner) { scanner->scanner.cancel(); }
+
+int snapsize_scan(snapsize_scanner* scanner, const char* const* paths, size_t n, uint64_t* total, uint64_t* exclusive,
+                  uint64_t* pairwise, uint64_t* union_total, snapsize_summary* summary) {
+  return guarded(scanner, [&] {
+    ScanSummary counters;
+    const SharedUsage usage = scanner->scanner.usage(vector<string>(paths, paths + n), &counters);
+    if (total)
+      copy(usage.total.begin(), usage.total.end(), total);
+    if (exclusive)
+      copy(usage.exclusive.begin(), usage.exclusive.end(), exclusive);
+    if (pairwise)
+      copy(usage.pairwise.begin(), usage.pairwise.end(), pairwise);
+    if (union_total)
+      *union_total = usage.unionTotal;
+    if (summary)
+      *summary = {counters.files, counters.hardlinksSkipped, counters.cacheHits, counters.errors};
+  });
+}
+
+const char* snapsize_last_error(const snapsize_scanner* scanner) { return scanner->error.c_str(); }
@@ -0,0 +1,422 @@
+/** Microbenchmarks of the extent set operations on synthetic workloads.
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Extents.hh"
+#include "FlatExtentSet.hh"
+#include "HybridExtentSet.hh"
+#include "ScanStats.hh"
+#include "SpillingExtentSet.hh"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+/// Size of the blocks of the synthetic extents
+static constexpr __u64 BLOCK = 4096;
+
+/// Results of the operations are stored here, so that they are not optimized out
+static volatile __u64 g_sink;
+
+/// Benchmark configuration
+struct Config {
+  vector<string> sets{"tree", "flat"};
+  vector<string> workloads{"sequential", "random", "fragmented", "overlapping", "snapshot", "unbalanced"};
+  vector<unsigned long> sizes{1000, 10000, 100000, 1000000};
+  vector<string> ops{"insert", "totalLength", "union", "intersection"};
+  double minTime = 0.2;
+  unsigned long seed = 1;
+  unsigned long memoryLimit = 64UL << 20;
+  // Directory scans (--scan)
+  vector<string> scanDirs;
+  vector<string> orders{"readdir", "inode"};
+  unsigned long repeat = 3;
+  unsigned long threads = 1;
+  bool ioUring = false;
+  bool dropCaches = false;
+};
+
+/// The two operands of the binary operations
+struct Workload {
+  vector<Extent> a, b;
+};
+
+/// Returns extents in increasing order, separated by gaps of 1 to maxGap
+/// blocks (0 to maxGap if adjacent is true), each 1 to maxLen blocks long
+static vector<Extent> ascending(size_t n, __u64 maxGap, __u64 maxLen, bool adjacent, mt19937_64& rng) {
+  uniform_int_distribution<__u64> gap(adjacent ? 0 : 1, maxGap), len(1, maxLen);
+  vector<Extent> v;
+  v.reserve(n);
+  __u64 pos = 0;
+  for (size_t i = 0; i < n; ++i) {
+    pos += gap(rng) * BLOCK;
+    __u64 l = len(rng) * BLOCK;
+    v.emplace_back(pos, l);
+    pos += l;
+  }
+  return v;
+}
+
+/// Generates n extents for each operand of the given workload:
+///  - sequential: sorted, disjoint extents, inserted in order
+///  - random: the same, inserted in random order
+///  - fragmented: single-block extents, half of them adjacent to the
+///    previous one, in random order (many merges)
+///  - overlapping: long extents at random positions in a narrow range
+///  - snapshot: b is a copy of a where 5% of the extents were rewritten
+///    elsewhere, as after a few changes to a copy-on-write snapshot
+///  - unbalanced: like random, but b has only one extent every 1024 of
+///    a, spread over the same range (as a small file against a large set)
+static Workload generate(const string& name, size_t n, unsigned long seed) {
+  mt19937_64 rng(seed);
+  Workload w;
+  if (name == "sequential" || name == "random") {
+    w.a = ascending(n, 8, 16, false, rng);
+    w.b = ascending(n, 8, 16, false, rng);
+  } else if (name == "fragmented") {
+    w.a = ascending(n, 1, 1, true, rng);
+    w.b = ascending(n, 1, 1, true, rng);
+  } else if (name == "overlapping") {
+    uniform_int_distribution<__u64> start(0, 4 * n), len(1, 64);
+    for (vector<Extent>* v : {&w.a, &w.b})
+      for (size_t i = 0; i < n; ++i)
+        v->emplace_back(start(rng) * BLOCK, len(rng) * BLOCK);
+  } else if (name == "snapshot") {
+    w.a = ascending(n, 8, 16, false, rng);
+    w.b = w.a;
+    __u64 pos = w.a.empty() ? 0 : w.a.back().end();
+    bernoulli_distribution rewritten(0.05);
+    for (Extent& x : w.b)
+      if (rewritten(rng)) {
+        pos += BLOCK;
+        x = Extent(pos, x.length());
+        pos += x.length();
+      }
+  } else if (name == "unbalanced") {
+    w.a = ascending(n, 8, 16, false, rng);
+    w.b = ascending(max<size_t>(n / 1024, 1), 26 * 1024, 16, false, rng);
+  } else
+    throw invalid_argument("Unknown workload: " + name);
+  if (name != "sequential" && name != "snapshot") {
+    shuffle(w.a.begin(), w.a.end(), rng);
+    shuffle(w.b.begin(), w.b.end(), rng);
+  }
+  return w;
+}
+
+/// Runs f until it has taken at least minTime seconds in total (or the
+/// wall time, which includes setup, exceeds ten times that), returning
+/// the number of iterations and the time spent in f. setup is called
+/// before each iteration and is not timed.
+static pair<size_t, double> measure(double minTime, const function<void()>& setup, const function<void()>& f) {
+  typedef chrono::steady_clock clock;
+  const clock::time_point wallStart = clock::now();
+  size_t iterations = 0;
+  double elapsed = 0;
+  do {
+    setup();
+    const clock::time_point start = clock::now();
+    f();
+    elapsed += chrono::duration<double>(clock::now() - start).count();
+    ++iterations;
+  } while (elapsed < minTime && chrono::duration<double>(clock::now() - wallStart).count() < 10 * minTime);
+  return {iterations, elapsed};
+}
+
+/// Prints one result as a line of JSON
+static void report(const string& set, const string& workload, size_t n, const string& op, size_t elements,
+                   pair<size_t, double> m) {
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  const double perIteration = m.second / m.first;
+  printf("{\"set\":\"%s\",\"workload\":\"%s\",\"extents\":%zu,\"op\":\"%s\",\"elements\":%zu,"
+         "\"iterations\":%zu,\"seconds\":%.9g,\"ns_per_op\":%.6g,\"ops_per_sec\":%.6g,\"peak_rss_kib\":%ld}\n",
+         set.c_str(), workload.c_str(), n, op.c_str(), elements, m.first, perIteration,
+         perIteration * 1e9 / max<size_t>(elements, 1), elements / perIteration, ru.ru_maxrss);
+  fflush(stdout);
+}
+
+/// Runs the selected operations with one container type and workload
+template <class Set>
+static void benchmark(const Config& cfg, const string& set, const string& name, size_t n) {
+  const Workload w = generate(name, n, cfg.seed);
+  Set a, b;
+  for (const Extent& x : w.a)
+    a.insert(x);
+  for (const Extent& x : w.b)
+    b.insert(x);
+  const size_t sizeA = a.size(), sizeB = b.size(); // Also flushes pending insertions
+  __u64 sink = 0;
+  for (const string& op : cfg.ops) {
+    if (op == "insert") {
+      Set s;
+      auto m = measure(cfg.minTime, [&]() { s.clear(); }, [&]() {
+        for (const Extent& x : w.a)
+          s.insert(x);
+        sink += s.size();
+      });
+      report(set, name, n, op, w.a.size(), m);
+    } else if (op == "totalLength") {
+      Set s;
+      auto m = measure(cfg.minTime, [&]() { s = a; }, [&]() { sink += s.totalLength(); });
+      report(set, name, n, op, sizeA, m);
+    } else if (op == "union") {
+      Set s;
+      auto m = measure(cfg.minTime, [&]() { s = a; }, [&]() {
+        s |= b;
+        sink += s.totalLength();
+      });
+      report(set, name, n, op, sizeA + sizeB, m);
+    } else if (op == "intersection") {
+      auto m = measure(cfg.minTime, []() {}, [&]() { sink += (a & b).totalLength(); });
+      report(set, name, n, op, sizeA + sizeB, m);
+    } else
+      throw invalid_argument("Unknown operation: " + op);
+  }
+  g_sink = sink;
+}
+
+/// Runs one benchmark case in a child process, so that its peak memory
+/// is measured separately. Returns false if the child failed.
+static bool runCase(const Config& cfg, const string& set, const string& workload, size_t n) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0) {
+    int ret = 0;
+    try {
+      if (set == "tree")
+        benchmark<ExtentSet>(cfg, set, workload, n);
+      else if (set == "flat")
+        benchmark<FlatExtentSet>(cfg, set, workload, n);
+      else if (set == "hybrid")
+        benchmark<HybridExtentSet>(cfg, set, workload, n);
+      else if (set == "spill") {
+        SpillingExtentSet::configure(cfg.memoryLimit);
+        benchmark<SpillingExtentSet>(cfg, set, workload, n);
+      } else
+        throw invalid_argument("Unknown set type: " + set);
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      ret = 1;
+    }
+    fflush(stdout);
+    _exit(ret);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR) {
+      perror("waitpid");
+      return false;
+    }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return true;
+  printf("{\"set\":\"%s\",\"workload\":\"%s\",\"extents\":%zu,\"error\":\"%s\"}\n", set.c_str(), workload.c_str(), n,
+         WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "failed");
+  return false;
+}
+
+/// Writes back dirty pages and drops the page, dentry and inode caches
+/// (requires root), so that the next scan reads all metadata from disk
+static void dropCaches() {
+  sync();
+  FILE* f = fopen("/proc/sys/vm/drop_caches", "w");
+  if (!f || fputs("3\n", f) < 0 || fclose(f))
+    throw runtime_error("Could not write /proc/sys/vm/drop_caches (root is required)");
+}
+
+/// Scans each directory with each file order, cfg.repeat times (the
+/// orders alternate, so that both see the same drift of the disk),
+/// printing one JSON object per scan
+static bool scanBenchmark(const Config& cfg) {
+  for (const string& dir : cfg.scanDirs)
+    for (unsigned long run = 0; run < cfg.repeat; ++run)
+      for (const string& order : cfg.orders) {
+        ScanOptions opts;
+        opts.threads = cfg.threads;
+        opts.ioUring = cfg.ioUring;
+        if (order == "inode")
+          opts.inodeOrder = true;
+        else if (order != "readdir")
+          throw invalid_argument("Unknown order: " + order);
+        ScanStats stats;
+        opts.stats = &stats;
+        if (cfg.dropCaches)
+          dropCaches();
+        FlatExtentSet es;
+        const __u64 start = ScanStats::now();
+        es.insertFromDir(dir.c_str(), opts);
+        const double seconds = (ScanStats::now() - start) * 1e-9;
+        printf("{\"scan\":\"%s\",\"order\":\"%s\",\"cold\":%s,\"threads\":%lu,\"io_uring\":%s,\"run\":%lu,"
+               "\"files\":%llu,\"directories\":%llu,\"bytes\":%llu,\"seconds\":%.6f,\"files_per_sec\":%.6g}\n",
+               dir.c_str(), order.c_str(), cfg.dropCaches ? "true" : "false", cfg.threads, cfg.ioUring ? "true" : "false",
+               run, (unsigned long long)stats.files, (unsigned long long)stats.directories,
+               (unsigned long long)es.totalLength(), seconds, stats.files / seconds);
+        fflush(stdout);
+      }
+  return true;
+}
+
+/// Splits a comma-separated list
+static vector<string> splitList(const string& s) {
+  vector<string> v;
+  size_t start = 0;
+  for (size_t comma; (comma = s.find(',', start)) != string::npos; start = comma + 1)
+    v.push_back(s.substr(start, comma - start));
+  v.push_back(s.substr(start));
+  return v;
+}
+
+/// Parses a positive count with an optional k, M or G (decimal) suffix
+static bool parseCount(const string& s, unsigned long& x) {
+  char* end;
+  errno = 0;
+  x = strtoul(s.c_str(), &end, 10);
+  if (end == s.c_str() || errno || !x)
+    return false;
+  switch (*end) {
+  case 'k': x *= 1000UL; ++end; break;
+  case 'M': x *= 1000000UL; ++end; break;
+  case 'G': x *= 1000000000UL; ++end; break;
+  }
+  return !*end;
+}
+
+int main(int argc, char** argv) {
+  Config cfg;
+  bool printHelp = false;
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--sets" && hasValue) {
+      cfg.sets = splitList(argv[++i]);
+    } else if (arg == "--workloads" && hasValue) {
+      cfg.workloads = splitList(argv[++i]);
+    } else if (arg == "--ops" && hasValue) {
+      cfg.ops = splitList(argv[++i]);
+    } else if (arg == "--sizes" && hasValue) {
+      cfg.sizes.clear();
+      for (const string& s : splitList(argv[++i])) {
+        unsigned long n;
+        if (!parseCount(s, n)) {
+          printHelp = true;
+          cerr << "Invalid size: " << s << endl;
+        }
+        cfg.sizes.push_back(n);
+      }
+    } else if (arg == "--min-time" && hasValue) {
+      cfg.minTime = atof(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      cfg.seed = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--memory-limit" && hasValue) {
+      if (!parseCount(argv[++i], cfg.memoryLimit)) {
+        printHelp = true;
+        cerr << "Invalid memory limit: " << argv[i] << endl;
+      }
+    } else if (arg == "--scan" && hasValue) {
+      cfg.scanDirs = splitList(argv[++i]);
+    } else if (arg == "--orders" && hasValue) {
+      cfg.orders = splitList(argv[++i]);
+    } else if (arg == "--repeat" && hasValue) {
+      if (!parseCount(argv[++i], cfg.repeat)) {
+        printHelp = true;
+        cerr << "Invalid repeat count: " << argv[i] << endl;
+      }
+    } else if (arg == "--threads" && hasValue) {
+      if (!parseCount(argv[++i], cfg.threads)) {
+        printHelp = true;
+        cerr << "Invalid number of threads: " << argv[i] << endl;
+      }
+    } else if (arg == "--io-uring") {
+      cfg.ioUring = true;
+    } else if (arg == "--drop-caches") {
+      cfg.dropCaches = true;
+    } else {
+      printHelp = true;
+      if (arg != "--help")
+        cerr << "Unrecognized option: " << arg << endl;
+    }
+  }
+  if (printHelp) {
+    cerr
+      << "Benchmarks the extent set operations on synthetic workloads,\n"
+         "printing one JSON object per line and operation on stdout, with\n"
+         "the time per element (ns_per_op), the throughput (ops_per_sec)\n"
+         "and the peak resident memory of the case (peak_rss_kib). Each\n"
+         "combination of set, workload and size runs in its own process.\n\n"
+         "Usage: " << argv[0] << " [--sets LIST] [--workloads LIST] [--sizes LIST]\n"
+         "          [--ops LIST] [--min-time SECONDS] [--seed N] [--memory-limit BYTES]\n"
+         "       " << argv[0] << " --scan DIRS [--orders LIST] [--repeat N] [--threads N]\n"
+         "          [--io-uring] [--drop-caches]\n\n"
+         "Options (lists are comma-separated)\n"
+         " --sets LIST       tree, flat, hybrid, spill (default: tree,flat)\n"
+         " --workloads LIST  sequential, random, fragmented, overlapping,\n"
+         "                   snapshot, unbalanced (default: all)\n"
+         " --sizes LIST      Extents per operand, with optional k, M, G\n"
+         "                   suffixes (default: 1k,10k,100k,1M)\n"
+         " --ops LIST        insert, totalLength, union, intersection\n"
+         "                   (default: all)\n"
+         " --min-time S      Minimum time measured per operation (default: 0.2)\n"
+         " --seed N          Seed of the workload generators (default: 1)\n"
+         " --memory-limit B  Memory budget of each spill set (default: 64M)\n\n"
+         "Scan benchmark (--scan)\n"
+         "Scans the given directories instead, printing the time and files per\n"
+         "second of each scan.\n"
+         " --orders LIST     Orders in which the files of each directory are\n"
+         "                   read: readdir, inode (default: both, alternated)\n"
+         " --repeat N        Scans per directory and order (default: 3)\n"
+         " --threads N       Threads of each scan (default: 1)\n"
+         " --io-uring        Batch the metadata calls with io_uring\n"
+         " --drop-caches     Drop the page, dentry and inode caches before each\n"
+         "                   scan, to measure cold-cache scans (requires root)"
+      << endl;
+    return 1;
+  }
+
+  if (!cfg.scanDirs.empty()) {
+    try {
+      return scanBenchmark(cfg) ? 0 : 1;
+    } catch (const exception& ex) {
+      cerr << ex.what() << endl;
+      return 1;
+    }
+  }
+
+  int ret = 0;
+  for (unsigned long n : cfg.sizes)
+    for (const string& workload : cfg.workloads)
+      for (const string& set : cfg.sets)
+        if (!runCase(cfg, set, workload, n))
+          ret = 1;
+  return ret;
+}
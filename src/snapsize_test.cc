@@ -0,0 +1,647 @@
+/** Randomized tests of the extent sets, kernels and usage computations,
+ *  each compared with a brute-force reference (run by ctest).
+ *
+ * Copyright 2024 Ludovico Massaccesi
+ *
+ * This file is part of snapsize.
+ *
+ * snapsize is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * snapsize is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with snapsize. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ExtentKernels.hh"
+#include "ExtentSource.hh"
+#include "Extents.hh"
+#include "FileUsage.hh"
+#include "FlatExtentSet.hh"
+#include "HybridExtentSet.hh"
+#include "IncrementalUsage.hh"
+#include "SharedUsage.hh"
+#include "SpillingExtentSet.hh"
+#include "ThreadPool.hh"
+#include "TreeUsage.hh"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+/// Reference model of a set of extents: the indices of the units (of a
+/// given number of bytes) that it covers
+typedef set<__u64> Units;
+
+/// Bytes of a chunk of HybridExtentSet, whose boundaries the extents are
+/// crowded around
+static constexpr __u64 CHUNK = __u64(1) << HybridExtentSet::CHUNK_SHIFT;
+
+/// Number of failed checks
+static size_t g_failures = 0;
+
+/// Reports a failed check (only the first ones are printed)
+static void check(bool ok, const string& what) {
+  if (!ok && ++g_failures <= 20)
+    cerr << "FAIL: " << what << endl;
+}
+
+/// Random inputs. Extents are made of units of `unit` bytes and start
+/// within `window` units of 0 or of a few chunk boundaries, so that they
+/// overlap, touch and cross the boundaries often.
+class Generator {
+public:
+  explicit Generator(unsigned long seed) : m_rng(seed) {}
+
+  /// Returns a uniform number in [0, n)
+  inline __u64 below(__u64 n) { return uniform_int_distribution<__u64>(0, n - 1)(m_rng); }
+
+  /// Returns n extents (in no particular order) of up to maxUnits units,
+  /// possibly empty, starting and ending at multiples of align units
+  vector<Extent> extents(size_t n, __u64 unit, __u64 window, __u64 maxUnits, __u64 align = 1) {
+    static const __u64 anchors[] = {0, 1, 2, 5};
+    vector<Extent> res;
+    res.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      const __u64 pos = anchors[below(4)] * (CHUNK / unit) + below(2 * window);
+      const __u64 start = pos < window ? 0 : (pos - window) / align * align;
+      res.emplace_back(start * unit, below(maxUnits + 1) * align * unit);
+    }
+    return res;
+  }
+
+private:
+  mt19937_64 m_rng;
+};
+
+/// Returns the units covered by the given extents
+static Units unitsOf(const vector<Extent>& extents, __u64 unit) {
+  Units res;
+  for (const Extent& x : extents)
+    for (__u64 u = x.start() / unit; u < x.end() / unit; ++u)
+      res.insert(u);
+  return res;
+}
+
+/// Returns the sorted, coalesced extents covering the given units
+static vector<Extent> extentsOf(const Units& units, __u64 unit) {
+  vector<Extent> res;
+  for (__u64 u : units) {
+    if (!res.empty() && res.back().end() == u * unit)
+      res.back() = Extent(res.back().start(), res.back().length() + unit);
+    else
+      res.emplace_back(u * unit, unit);
+  }
+  return res;
+}
+
+static Units unite(const Units& a, const Units& b) {
+  Units res;
+  set_union(a.begin(), a.end(), b.begin(), b.end(), inserter(res, res.end()));
+  return res;
+}
+
+static Units intersect(const Units& a, const Units& b) {
+  Units res;
+  set_intersection(a.begin(), a.end(), b.begin(), b.end(), inserter(res, res.end()));
+  return res;
+}
+
+/// Returns the number of units in [lo, hi)
+static __u64 unitsWithin(const Units& units, __u64 lo, __u64 hi) {
+  return lo < hi ? distance(units.lower_bound(lo), units.lower_bound(hi)) : 0;
+}
+
+/// Checks that the extents in [begin, end) are sorted, coalesced, not
+/// empty and cover exactly the reference units
+template <class Iter>
+static void checkExtents(Iter begin, Iter end, const Units& ref, __u64 unit, const string& what) {
+  Units got;
+  bool ok = true;
+  for (Iter it = begin; it != end; ++it) {
+    const Extent& x = *it;
+    if (!x.length() || x.start() % unit || x.length() % unit || (it != begin && x.start() <= prev(it)->end()))
+      ok = false;
+    for (__u64 u = x.start() / unit; u < x.end() / unit; ++u)
+      got.insert(got.end(), u);
+  }
+  check(ok, what + ": extents not sorted and coalesced");
+  check(got == ref, what + ": wrong extents");
+}
+
+/// Same as checkExtents for a whole set, also checking its total length
+template <class Set>
+static void checkSet(const Set& s, const Units& ref, __u64 unit, const string& what) {
+  vector<Extent> extents(s.begin(), s.end()); // The iterators of some sets are forward only
+  checkExtents(extents.begin(), extents.end(), ref, unit, what);
+  check(s.totalLength() == ref.size() * unit, what + ": wrong totalLength");
+  check(s.empty() == ref.empty(), what + ": wrong empty");
+}
+
+/// Checks lengthWithin on random ranges, and first and last
+template <class Set>
+static void checkQueries(Generator& gen, const Set& s, const Units& ref, __u64 unit, const string& what) {
+  for (int i = 0; i < 20; ++i) {
+    const vector<Extent> range = gen.extents(1, unit, 300, 400);
+    const __u64 lo = range[0].start() / unit, hi = range[0].end() / unit;
+    check(s.lengthWithin(range[0]) == unitsWithin(ref, lo, hi) * unit, what + ": wrong lengthWithin");
+  }
+  if (!ref.empty()) {
+    check(s.first().start() == *ref.begin() * unit, what + ": wrong first");
+    check(s.last().end() == (*ref.rbegin() + 1) * unit, what + ": wrong last");
+  }
+}
+
+/// Returns a set with the given extents, inserted in order
+template <class Set>
+static Set makeSet(const vector<Extent>& extents, Set s = Set()) {
+  for (const Extent& x : extents)
+    s.insert(x);
+  return s;
+}
+
+/// intersectExtents, unionExtents and firstEndingAfter of the kernel in
+/// use, on balanced and very unbalanced inputs (galloping)
+static void testKernels(Generator& gen) {
+  const __u64 unit = 4096;
+  const size_t sizes[][2] = {{0, 0}, {0, 50}, {1, 2}, {30, 40}, {300, 300}, {1, 5000}, {3, 8000}, {4000, 2}};
+  for (int round = 0; round < 40; ++round) {
+    const size_t* n = sizes[round % size(sizes)];
+    const __u64 window = 1 + gen.below(round % 2 ? 50 : 20000);
+    const Units ua = unitsOf(gen.extents(n[0], unit, window, 4), unit);
+    const Units ub = unitsOf(gen.extents(n[1], unit, window, 4), unit);
+    const vector<Extent> a = extentsOf(ua, unit), b = extentsOf(ub, unit);
+    const string what = string("kernel ") + extentKernelName() + " round " + to_string(round);
+
+    vector<Extent> out;
+    intersectExtents(a.data(), a.size(), b.data(), b.size(), out);
+    checkExtents(out.begin(), out.end(), intersect(ua, ub), unit, what + " intersection");
+    out.clear();
+    unionExtents(a.data(), a.size(), b.data(), b.size(), out);
+    checkExtents(out.begin(), out.end(), unite(ua, ub), unit, what + " union");
+
+    // The union is also coalesced with an extent already in out, adjacent or not
+    const Units all = unite(ua, ub);
+    if (!all.empty() && *all.begin() > 1) {
+      for (__u64 gap : {0, 1}) {
+        out.assign(1, Extent(0, (*all.begin() - gap) * unit));
+        unionExtents(a.data(), a.size(), b.data(), b.size(), out);
+        Units ref = all;
+        for (__u64 u = 0; u < *all.begin() - gap; ++u)
+          ref.insert(u);
+        checkExtents(out.begin(), out.end(), ref, unit, what + " union after an extent");
+      }
+    }
+
+    for (int i = 0; i < 50; ++i) {
+      // Keys at the ends of the extents too, to check the ties
+      __u64 key = gen.below(2 * (window + 10) * unit + 5 * CHUNK);
+      if (!a.empty() && i % 2)
+        key = a[gen.below(a.size())].end() - (i % 4 == 1);
+      size_t ref = 0;
+      while (ref < a.size() && a[ref].end() <= key)
+        ++ref;
+      check(firstEndingAfter(a.data(), a.size(), key) == ref, what + " firstEndingAfter");
+    }
+  }
+}
+
+/// parallelUnion and parallelIntersection of a set type, with new threads
+/// and with a pool, on inputs large enough to be split into ranges
+template <class Set>
+static void testParallelSet(Generator& gen, const string& name, ThreadPool& pool) {
+  for (__u64 unit : {__u64(4096), __u64(512)}) {
+    // Spread over 16 chunks, plus extents across their boundaries
+    const __u64 window = 16 * CHUNK / unit;
+    vector<Extent> ea = gen.extents(60000, unit, window, 3), eb;
+    for (__u64 c = 1; c < 16; ++c)
+      ea.emplace_back(c * CHUNK - unit, 2 * unit);
+    for (int variant = 0; variant < 3; ++variant) {
+      if (variant == 0) { // Independent
+        eb = gen.extents(60000, unit, window, 3);
+      } else { // The same extents, or shifted by one unit so that they overlap and touch
+        eb = ea;
+        for (Extent& x : eb)
+          if (variant == 2 && x.length())
+            x = Extent(x.start() + unit, x.length());
+      }
+      const Units ua = unitsOf(ea, unit), ub = unitsOf(eb, unit);
+      const Set a = makeSet<Set>(ea), b = makeSet<Set>(eb);
+      const Units both = intersect(ua, ub), all = unite(ua, ub);
+      for (unsigned threads : {2u, 3u}) {
+        const string what = name + " unit " + to_string(unit) + " variant " + to_string(variant) + " threads " +
+                            to_string(threads);
+        checkSet(parallelIntersection(a, b, threads), both, unit, what + " parallelIntersection");
+        for (ThreadPool* p : {(ThreadPool*)nullptr, &pool}) {
+          Set u = a;
+          u.parallelUnion(b, threads, p);
+          checkSet(u, all, unit, what + (p ? " parallelUnion on the pool" : " parallelUnion"));
+        }
+      }
+    }
+  }
+}
+
+static void testParallel(Generator& gen) {
+  ThreadPool pool(3);
+  testParallelSet<ExtentSet>(gen, "ExtentSet", pool);
+  testParallelSet<FlatExtentSet>(gen, "FlatExtentSet", pool);
+  testParallelSet<HybridExtentSet>(gen, "HybridExtentSet", pool);
+}
+
+/// Serial operators and queries of all the sets, on small random inputs
+template <class Set>
+static void testSetType(Generator& gen, const string& name, const function<Set()>& make) {
+  for (int round = 0; round < 60; ++round) {
+    const __u64 unit = round % 3 ? 4096 : 512;
+    const __u64 window = 1 + gen.below(round % 2 ? 30 : 3000);
+    const vector<Extent> ea = gen.extents(gen.below(400), unit, window, 6);
+    const vector<Extent> eb = gen.extents(gen.below(400), unit, window, 6);
+    const Units ua = unitsOf(ea, unit), ub = unitsOf(eb, unit);
+    const Set a = makeSet(ea, make()), b = makeSet(eb, make());
+    const string what = name + " round " + to_string(round);
+    checkSet(a, ua, unit, what + " insert");
+    checkQueries(gen, a, ua, unit, what);
+    checkSet(a & b, intersect(ua, ub), unit, what + " intersection");
+    checkSet(a | b, unite(ua, ub), unit, what + " union");
+    Set c = a;
+    c |= c;
+    checkSet(c, ua, unit, what + " union with itself");
+    // Empty extents are ignored, even away from 0
+    Set e = make();
+    e.insert(Extent(3 * unit, 0));
+    checkSet(e, Units(), unit, what + " empty extent");
+  }
+}
+
+/// Returns 1.5 to 2 times MAX_RUNS disjoint runs of one or two blocks on
+/// each side of the boundary of the given chunk, in units of unit bytes
+static vector<Extent> denseExtents(Generator& gen, __u64 chunk, __u64 unit) {
+  const __u64 block = HybridExtentSet::BLOCK_SIZE / unit, runs = 3 * HybridExtentSet::MAX_RUNS + gen.below(1024);
+  const __u64 base = (chunk * (CHUNK / HybridExtentSet::BLOCK_SIZE) - runs * 3 / 2) * block;
+  vector<Extent> res;
+  for (__u64 k = 0; k < runs; ++k)
+    res.emplace_back((base + 3 * k * block) * unit, (1 + gen.below(2)) * block * unit);
+  shuffle(res.begin(), res.end(), mt19937_64(gen.below(1000)));
+  return res;
+}
+
+/// HybridExtentSet conversions between runs and bitmaps: dense aligned
+/// chunks become bitmaps, unaligned extents turn them back into runs, and
+/// so does an intersection leaving few runs
+static void testHybrid(Generator& gen) {
+  const __u64 unit = 512, block = HybridExtentSet::BLOCK_SIZE / unit;
+  for (int round = 0; round < 20; ++round) {
+    const string what = "HybridExtentSet conversion round " + to_string(round);
+    const vector<Extent> dense = denseExtents(gen, 1 + round % 2, unit);
+    const Units ud = unitsOf(dense, unit);
+    HybridExtentSet h = makeSet<HybridExtentSet>(dense);
+    check(h.bitmapChunks() > 0, what + ": no bitmap chunk");
+    checkSet(h, ud, unit, what + " bitmap");
+    checkQueries(gen, h, ud, unit, what + " bitmap");
+
+    // Joining with aligned runs keeps the bitmaps
+    const vector<Extent> aligned = gen.extents(200, unit, 300 * block, 3 * block, block);
+    const Units ua = unitsOf(aligned, unit);
+    checkSet(h | makeSet<HybridExtentSet>(aligned), unite(ud, ua), unit, what + " bitmap | runs");
+    checkSet(h & makeSet<HybridExtentSet>(aligned), intersect(ud, ua), unit, what + " bitmap & runs");
+    const HybridExtentSet few = h & makeSet<HybridExtentSet>(aligned);
+    check(!few.bitmapChunks(), what + ": intersection with few runs kept a bitmap");
+
+    // Unaligned extents force the exact runs back
+    const vector<Extent> unaligned = gen.extents(1 + gen.below(50), unit, 300 * block, 5);
+    const Units uu = unitsOf(unaligned, unit);
+    HybridExtentSet mixed = h;
+    for (const Extent& x : unaligned)
+      mixed.insert(x);
+    checkSet(mixed, unite(ud, uu), unit, what + " bitmap + unaligned inserts");
+    checkSet(h | makeSet<HybridExtentSet>(unaligned), unite(ud, uu), unit, what + " bitmap | unaligned");
+    checkSet(h & makeSet<HybridExtentSet>(unaligned), intersect(ud, uu), unit, what + " bitmap & unaligned");
+
+    // Between two bitmaps, word by word
+    const vector<Extent> dense2 = denseExtents(gen, 1 + round % 2, unit);
+    const Units ud2 = unitsOf(dense2, unit);
+    const HybridExtentSet h2 = makeSet<HybridExtentSet>(dense2);
+    checkSet(h | h2, unite(ud, ud2), unit, what + " bitmap | bitmap");
+    checkSet(h & h2, intersect(ud, ud2), unit, what + " bitmap & bitmap");
+  }
+}
+
+/// SpillingExtentSet with a budget small enough to spill many runs
+static void testSpilling(Generator& gen) {
+  testSetType<SpillingExtentSet>(gen, "SpillingExtentSet", [] { return SpillingExtentSet(1024); });
+  SpillingExtentSet s(1024);
+  const vector<Extent> extents = gen.extents(5000, 4096, 3000, 4);
+  for (const Extent& x : extents)
+    s.insert(x);
+  check(s.runs() > 1, "SpillingExtentSet: nothing spilled");
+  checkSet(s, unitsOf(extents, 4096), 4096, "SpillingExtentSet spilled");
+}
+
+/// Returns the number of units covered by the sets in `in` but by none of
+/// those in `out`, as indices in the given reference sets
+static __u64 coveredOnlyBy(const vector<Units>& refs, const vector<char>& in) {
+  map<__u64, pair<bool, bool>> cover; // Covered by a set in, by a set out
+  for (size_t i = 0; i < refs.size(); ++i)
+    for (__u64 u : refs[i])
+      (in[i] ? cover[u].first : cover[u].second) = true;
+  __u64 res = 0;
+  for (const auto& c : cover)
+    res += c.second.first && !c.second.second;
+  return res;
+}
+
+/// sharedUsage (sweepExtents) and treeUsage of random sets and trees
+static void testSweep(Generator& gen) {
+  const __u64 unit = 4096;
+  for (int round = 0; round < 40; ++round) {
+    const size_t n = 1 + gen.below(12);
+    const __u64 window = 1 + gen.below(round % 2 ? 20 : 500);
+    vector<FlatExtentSet> sets(n);
+    vector<Units> refs(n);
+    for (size_t i = 0; i < n; ++i) {
+      const vector<Extent> extents = gen.extents(gen.below(60), unit, window, 5);
+      sets[i] = makeSet<FlatExtentSet>(extents);
+      refs[i] = unitsOf(extents, unit);
+    }
+    const string what = "sweep round " + to_string(round);
+
+    const SharedUsage usage = sharedUsage(sets);
+    Units all;
+    for (size_t i = 0; i < n; ++i) {
+      all = unite(all, refs[i]);
+      vector<char> in(n, 0);
+      in[i] = 1;
+      check(usage.total[i] == refs[i].size() * unit, what + ": wrong shared total");
+      check(usage.exclusive[i] == coveredOnlyBy(refs, in) * unit, what + ": wrong shared exclusive");
+      for (size_t j = 0; j < n; ++j)
+        check(usage.shared(i, j) == intersect(refs[i], refs[j]).size() * unit, what + ": wrong pairwise");
+    }
+    check(usage.unionTotal == all.size() * unit, what + ": wrong union total");
+
+    // A random tree over the same sets
+    vector<size_t> parent(n, 0);
+    for (size_t i = 1; i < n; ++i)
+      parent[i] = gen.below(i);
+    const TreeUsage tree = treeUsage(parent, extentRanges(sets));
+    for (size_t i = 0; i < n; ++i) {
+      vector<char> in(n, 0); // The subtree of i
+      for (size_t k = 0; k < n; ++k)
+        for (size_t d = k;; d = parent[d]) {
+          if (d == i)
+            in[k] = 1;
+          if (d == i || !d)
+            break;
+        }
+      Units subtree;
+      for (size_t k = 0; k < n; ++k)
+        if (in[k])
+          subtree = unite(subtree, refs[k]);
+      check(tree.total[i] == subtree.size() * unit, what + ": wrong tree total");
+      check(tree.exclusive[i] == coveredOnlyBy(refs, in) * unit, what + ": wrong tree exclusive");
+    }
+  }
+}
+
+/// Lists the files of the source below dir recursively, adding their
+/// extents to the reference of the directory maxDepth levels below the
+/// root at most (by path relative to the root)
+static void walkSource(const ExtentSource& source, const string& dir, const string& node, size_t depth,
+                       size_t maxDepth, __u64 unit, map<string, Units>& refs) {
+  vector<ExtentSource::Entry> entries;
+  source.list(dir, entries);
+  refs[node]; // Even if empty
+  for (const ExtentSource::Entry& e : entries) {
+    const string path = dir == "/" ? "/" + e.name : dir + "/" + e.name;
+    if (e.isDir) {
+      walkSource(source, path, depth < maxDepth ? node + "/" + e.name : node, depth + 1, maxDepth, unit, refs);
+    } else {
+      vector<Extent> extents;
+      source.extents(e, extents);
+      const Units u = unitsOf(extents, unit);
+      refs[node].insert(u.begin(), u.end());
+    }
+  }
+}
+
+/// insertFromDirTree on a synthetic tree, then treeUsage of its nodes
+static void testDirTree(Generator& gen) {
+  const __u64 unit = 4096; // The synthetic extents are multiples of 4 KiB
+  for (int round = 0; round < 6; ++round) {
+    SyntheticExtentSource::Params params;
+    params.files = 200 + gen.below(800);
+    params.filesPerDir = 5 + gen.below(20);
+    params.subdirs = 1 + gen.below(4);
+    params.extentsPerFile = 1 + gen.below(4);
+    params.hardlinks = round % 2 ? 0.3 : 0; // Links to files of other nodes too
+    params.seed = 1 + gen.below(1000);
+    const SyntheticExtentSource source(params);
+    const size_t maxDepth = round % 4;
+    const string what = "insertFromDirTree round " + to_string(round);
+
+    ScanOptions opts;
+    opts.source = &source;
+    opts.threads = 1 + round % 3;
+    DirTree tree;
+    deque<FlatExtentSet> sets;
+    insertFromDirTree("/", maxDepth, opts, tree, sets);
+    check(sets.size() == tree.parent.size(), what + ": one set per node");
+
+    map<string, Units> refs;
+    walkSource(source, "/", "", 0, maxDepth, unit, refs);
+    check(refs.size() == tree.parent.size(), what + ": wrong number of nodes");
+    vector<string> paths(tree.parent.size());
+    vector<Units> nodeRefs(tree.parent.size());
+    for (size_t k = 0; k < tree.parent.size() && k < sets.size(); ++k) {
+      if (k)
+        paths[k] = paths[tree.parent[k]] + "/" + tree.names[k];
+      nodeRefs[k] = refs[paths[k]];
+      checkSet(sets[k], nodeRefs[k], unit, what + " node " + paths[k]);
+    }
+
+    const TreeUsage usage = treeUsage(tree.parent, extentRanges(vector<FlatExtentSet>(sets.begin(), sets.end())));
+    Units all;
+    for (const Units& u : nodeRefs)
+      all = unite(all, u);
+    check(usage.total[0] == all.size() * unit, what + ": wrong total of the root");
+    check(usage.exclusive[0] == all.size() * unit, what + ": wrong exclusive of the root");
+  }
+}
+
+/// Brute-force usage of n multisets, given the number of groups of each
+/// set covering each unit
+static SharedUsage referenceUsage(size_t n, const map<__u64, vector<int>>& counts, __u64 unit) {
+  SharedUsage res(n);
+  for (const auto& c : counts) {
+    vector<size_t> active;
+    for (size_t i = 0; i < n; ++i)
+      if (c.second[i])
+        active.push_back(i);
+    if (active.empty())
+      continue;
+    res.unionTotal += unit;
+    if (active.size() == 1)
+      res.exclusive[active[0]] += unit;
+    for (size_t a : active)
+      for (size_t b : active)
+        res.pairwise[a * n + b] += unit;
+  }
+  for (size_t i = 0; i < n; ++i)
+    res.total[i] = res.pairwise[i * n + i];
+  return res;
+}
+
+/// IncrementalUsage under random additions and removals of groups
+static void testIncremental(Generator& gen) {
+  const __u64 unit = 4096;
+  for (int round = 0; round < 20; ++round) {
+    const size_t n = 1 + gen.below(4);
+    const __u64 window = 1 + gen.below(round % 2 ? 20 : 300);
+    IncrementalUsage usage(n);
+    vector<pair<size_t, vector<Extent>>> groups; // Added and not removed yet
+    map<__u64, vector<int>> counts;
+    const string what = "IncrementalUsage round " + to_string(round);
+    for (int op = 0; op < 200; ++op) {
+      const bool add = groups.empty() || gen.below(3);
+      size_t i;
+      vector<Extent> extents;
+      if (add) {
+        i = gen.below(n);
+        extents = extentsOf(unitsOf(gen.extents(gen.below(8), unit, window, 4), unit), unit);
+        usage.add(i, extents);
+        groups.emplace_back(i, extents);
+      } else {
+        const size_t g = gen.below(groups.size());
+        i = groups[g].first;
+        extents = move(groups[g].second);
+        groups.erase(groups.begin() + g);
+        usage.remove(i, extents);
+      }
+      for (const Extent& x : extents)
+        for (__u64 u = x.start() / unit; u < x.end() / unit; ++u) {
+          vector<int>& c = counts[u];
+          c.resize(n, 0);
+          c[i] += add ? 1 : -1;
+        }
+      const SharedUsage ref = referenceUsage(n, counts, unit);
+      const SharedUsage& got = usage.usage();
+      check(got.total == ref.total && got.exclusive == ref.exclusive && got.pairwise == ref.pairwise &&
+                got.unionTotal == ref.unionTotal,
+            what + " op " + to_string(op) + ": wrong usage");
+    }
+    bool threw = false;
+    try {
+      usage.remove(0, {Extent(100 * CHUNK, unit)});
+    } catch (const logic_error&) {
+      threw = true;
+    }
+    check(threw, what + ": removing extents never added did not throw");
+  }
+}
+
+/// FileUsage::top on files with unsorted, overlapping and empty extents,
+/// many of them tied
+static void testFileUsage(Generator& gen) {
+  const __u64 unit = 4096;
+  for (int round = 0; round < 40; ++round) {
+    const size_t n = gen.below(40);
+    const __u64 window = 1 + gen.below(round % 2 ? 10 : 200);
+    FileUsage fileUsage;
+    vector<Units> refs(n);
+    for (size_t f = 0; f < n; ++f) {
+      vector<Extent> extents = gen.extents(gen.below(6), unit, window, 4);
+      if (gen.below(4) == 0 && f) // Same extents as an earlier file: tied at 0
+        extents = extentsOf(refs[gen.below(f)], unit);
+      if (!extents.empty() && gen.below(2)) // Duplicated
+        extents.push_back(extents[0]);
+      refs[f] = unitsOf(extents, unit);
+      fileUsage.add("f" + to_string(f), 0, f + 1, 1 + f % 3, extents);
+    }
+    check(fileUsage.files() == n, "FileUsage: wrong number of files");
+
+    vector<__u64> exclusive(n);
+    vector<size_t> order(n);
+    for (size_t f = 0; f < n; ++f) {
+      vector<char> in(n, 0);
+      in[f] = 1;
+      exclusive[f] = coveredOnlyBy(refs, in) * unit;
+      order[f] = f;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return exclusive[a] > exclusive[b]; });
+    for (size_t k : {size_t(0), size_t(1), size_t(3), n, n + 5}) {
+      const vector<FileUsage::Entry> top = fileUsage.top(k);
+      const string what = "FileUsage round " + to_string(round) + " top " + to_string(k);
+      check(top.size() == min(k, n), what + ": wrong size");
+      for (size_t r = 0; r < top.size() && r < n; ++r) {
+        const size_t f = order[r];
+        check(top[r].path == "f" + to_string(f), what + ": wrong file at " + to_string(r));
+        check(top[r].total == refs[f].size() * unit, what + ": wrong total at " + to_string(r));
+        check(top[r].exclusive == exclusive[f], what + ": wrong exclusive at " + to_string(r));
+        check(top[r].links == 1 + f % 3, what + ": wrong links at " + to_string(r));
+      }
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const pair<const char*, void (*)(Generator&)> tests[] = {
+    {"kernels", testKernels},
+    {"parallel", testParallel},
+    {"sets", [](Generator& gen) {
+       testSetType<ExtentSet>(gen, "ExtentSet", [] { return ExtentSet(); });
+       testSetType<FlatExtentSet>(gen, "FlatExtentSet", [] { return FlatExtentSet(); });
+       testSetType<HybridExtentSet>(gen, "HybridExtentSet", [] { return HybridExtentSet(); });
+     }},
+    {"hybrid", testHybrid},
+    {"spilling", testSpilling},
+    {"sweep", testSweep},
+    {"dirtree", testDirTree},
+    {"incremental", testIncremental},
+    {"fileusage", testFileUsage},
+  };
+  unsigned long seed = 1;
+  vector<string> selected;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--seed") && i + 1 < argc) {
+      seed = strtoul(argv[++i], nullptr, 0);
+    } else if (argv[i][0] == '-') {
+      cerr << "Usage: " << argv[0] << " [--seed N] [TEST...]\nTests:";
+      for (const auto& t : tests)
+        cerr << ' ' << t.first;
+      cerr << endl;
+      return 2;
+    } else {
+      selected.push_back(argv[i]);
+    }
+  }
+  cout << "Kernel " << extentKernelName() << ", seed " << seed << endl;
+  for (const auto& t : tests) {
+    if (!selected.empty() && find(selected.begin(), selected.end(), t.first) == selected.end())
+      continue;
+    const size_t before = g_failures;
+    Generator gen(seed);
+    try {
+      t.second(gen);
+    } catch (const exception& ex) {
+      check(false, string(t.first) + ": " + ex.what());
+    }
+    cout << (g_failures == before ? "ok   " : "FAIL ") << t.first << endl;
+  }
+  return g_failures ? 1 : 0;
+}